@@ -0,0 +1,342 @@
+/**
+ *
+ * This module summarizes rows during ingest with a BIRCH clustering-feature tree (Zhang, Ramakrishnan & Livny).
+ *
+ * The nodes hold clustering features (weight, linear sum and squared sum), which add up,
+ * so the feature of an inner entry is simply the sum of the features below it.
+ * Rows descend to the entry with the closest centroid on every level, and nodes that overflow
+ * are split around their two most distant entries, growing the tree at the root like a B-tree.
+ *
+ */
+
+#include "birch.h"
+#include "reduce.h"
+#include "fail.h"
+#include <math.h>
+#include <float.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct {
+    double weight;
+    double* linear;  // The weighted sum of the rows, m values.
+    double squared;  // The weighted sum of the squared norms of the rows.
+} cf_entry;
+
+typedef struct cf_node {
+    bool leaf;
+    size_t count;
+    // One slot more than the branching factor, so a node can overflow before it is split.
+    cf_entry entries[BIRCH_BRANCHING + 1];
+    struct cf_node* children[BIRCH_BRANCHING + 1];
+} cf_node;
+
+struct cf_tree {
+    size_t m;
+    size_t max_entries;
+    size_t entries;    // The amount of leaf entries.
+    double threshold;  // The largest squared radius a leaf entry may grow to.
+    cf_node* root;
+};
+
+static cf_entry entry_create(size_t m) {
+    cf_entry entry;
+    entry.weight = 0.0;
+    entry.linear = calloc(m, sizeof(double));
+    entry.squared = 0.0;
+    if (entry.linear == NULL) {
+        failwith("Could not allocate a clustering feature!\n");
+    }
+    return entry;
+}
+
+static void entry_add(size_t m, cf_entry* a, const cf_entry* b) {
+    size_t vi;
+    a->weight += b->weight;
+    a->squared += b->squared;
+    for (vi = 0; vi < m; vi++) {
+        a->linear[vi] += b->linear[vi];
+    }
+}
+
+static double centroid_distance(size_t m, const cf_entry* a, const cf_entry* b) {
+    size_t vi;
+    double distance = 0.0;
+    for (vi = 0; vi < m; vi++) {
+        double d = a->linear[vi] / a->weight - b->linear[vi] / b->weight;
+        distance += d * d;
+    }
+    return distance;
+}
+
+/**
+ * @brief The squared radius (mean squared distance to the centroid) of two features merged into one.
+ */
+static double merged_radius(size_t m, const cf_entry* a, const cf_entry* b) {
+    size_t vi;
+    double weight = a->weight + b->weight;
+    double norm = 0.0;
+    for (vi = 0; vi < m; vi++) {
+        double sum = a->linear[vi] + b->linear[vi];
+        norm += sum * sum;
+    }
+    double radius = (a->squared + b->squared) / weight - norm / (weight * weight);
+    return (radius > 0.0) ? radius : 0.0;
+}
+
+static size_t closest_entry(size_t m, const cf_node* node, const cf_entry* entry) {
+    size_t i, closest = 0;
+    double closest_distance = INFINITY;
+    for (i = 0; i < node->count; i++) {
+        double distance = centroid_distance(m, &node->entries[i], entry);
+        if (distance < closest_distance) {
+            closest_distance = distance;
+            closest = i;
+        }
+    }
+    return closest;
+}
+
+static cf_node* node_create(bool leaf) {
+    cf_node* node = malloc(sizeof(cf_node));
+    if (node == NULL) {
+        failwith("Could not allocate a node of the clustering-feature tree!\n");
+    }
+    node->leaf = leaf;
+    node->count = 0;
+    return node;
+}
+
+/**
+ * @brief Sum the features of a node into a single (new) feature, used for the inner entry pointing at it.
+ */
+static cf_entry summarize(size_t m, const cf_node* node) {
+    cf_entry summary = entry_create(m);
+    size_t i;
+    for (i = 0; i < node->count; i++) {
+        entry_add(m, &summary, &node->entries[i]);
+    }
+    return summary;
+}
+
+/**
+ * @brief Split an overflowing node around its two most distant entries, returns the new sibling.
+ */
+static cf_node* split(size_t m, cf_node* node) {
+    size_t i, j, first = 0, second = 1;
+    double farthest = -1.0;
+    for (i = 0; i < node->count; i++) {
+        for (j = i + 1; j < node->count; j++) {
+            double distance = centroid_distance(m, &node->entries[i], &node->entries[j]);
+            if (distance > farthest) {
+                farthest = distance;
+                first = i;
+                second = j;
+            }
+        }
+    }
+    cf_entry entries[BIRCH_BRANCHING + 1];
+    cf_node* children[BIRCH_BRANCHING + 1];
+    size_t count = node->count;
+    memcpy(entries, node->entries, sizeof(cf_entry) * count);
+    memcpy(children, node->children, sizeof(cf_node*) * count);
+
+    cf_node* sibling = node_create(node->leaf);
+    node->count = 0;
+    for (i = 0; i < count; i++) {
+        bool to_sibling = (i == second) || (i != first
+                && centroid_distance(m, &entries[i], &entries[second]) < centroid_distance(m, &entries[i], &entries[first]));
+        cf_node* target = to_sibling ? sibling : node;
+        target->entries[target->count] = entries[i];
+        target->children[target->count] = children[i];
+        target->count += 1;
+    }
+    return sibling;
+}
+
+/**
+ * @brief Insert a feature below a node, the tree takes over the feature.
+ *
+ * @return The new sibling of the node when it had to be split, NULL otherwise.
+ */
+static cf_node* insert_entry(cf_tree* tree, cf_node* node, cf_entry* entry) {
+    size_t m = tree->m;
+    if (node->leaf) {
+        if (node->count > 0) {
+            size_t closest = closest_entry(m, node, entry);
+            if (merged_radius(m, &node->entries[closest], entry) <= tree->threshold) {
+                entry_add(m, &node->entries[closest], entry);
+                free(entry->linear);
+                return NULL;
+            }
+        }
+        node->entries[node->count] = *entry;
+        node->children[node->count] = NULL;
+        node->count += 1;
+        tree->entries += 1;
+        return (node->count > BIRCH_BRANCHING) ? split(m, node) : NULL;
+    }
+
+    size_t closest = closest_entry(m, node, entry);
+    entry_add(m, &node->entries[closest], entry);
+    cf_node* sibling = insert_entry(tree, node->children[closest], entry);
+    if (sibling == NULL) {
+        return NULL;
+    }
+    // The child lost part of its entries to the sibling, so both summaries are recomputed.
+    free(node->entries[closest].linear);
+    node->entries[closest] = summarize(m, node->children[closest]);
+    node->entries[node->count] = summarize(m, sibling);
+    node->children[node->count] = sibling;
+    node->count += 1;
+    return (node->count > BIRCH_BRANCHING) ? split(m, node) : NULL;
+}
+
+static void insert_root(cf_tree* tree, cf_entry* entry) {
+    cf_node* sibling = insert_entry(tree, tree->root, entry);
+    if (sibling != NULL) {
+        cf_node* root = node_create(false);
+        root->entries[0] = summarize(tree->m, tree->root);
+        root->children[0] = tree->root;
+        root->entries[1] = summarize(tree->m, sibling);
+        root->children[1] = sibling;
+        root->count = 2;
+        tree->root = root;
+    }
+}
+
+/**
+ * @brief Free the nodes below (and including) a node, the leaf features are only freed when asked to.
+ */
+static void free_nodes(cf_node* node, bool free_leaf_entries) {
+    size_t i;
+    for (i = 0; i < node->count; i++) {
+        if (!node->leaf) {
+            free_nodes(node->children[i], free_leaf_entries);
+        }
+        if (!node->leaf || free_leaf_entries) {
+            free(node->entries[i].linear);
+        }
+    }
+    free(node);
+}
+
+static void collect_leaf_entries(cf_node* node, cf_entry* out, size_t* count) {
+    size_t i;
+    for (i = 0; i < node->count; i++) {
+        if (node->leaf) {
+            out[*count] = node->entries[i];
+            *count += 1;
+        } else {
+            collect_leaf_entries(node->children[i], out, count);
+        }
+    }
+}
+
+/**
+ * @brief The average over the leaves of the smallest radius that two of their entries would merge into.
+ *
+ * Raising the threshold to this value lets roughly every leaf merge its closest pair.
+ */
+static double closest_pair_radius(size_t m, cf_node* node, double* sum, size_t* leaves) {
+    size_t i, j;
+    if (!node->leaf) {
+        for (i = 0; i < node->count; i++) {
+            closest_pair_radius(m, node->children[i], sum, leaves);
+        }
+        return (*leaves > 0) ? *sum / (double) *leaves : 0.0;
+    }
+    double closest = INFINITY;
+    for (i = 0; i < node->count; i++) {
+        for (j = i + 1; j < node->count; j++) {
+            double radius = merged_radius(m, &node->entries[i], &node->entries[j]);
+            closest = (radius < closest) ? radius : closest;
+        }
+    }
+    if (closest < INFINITY) {
+        *sum += closest;
+        *leaves += 1;
+    }
+    return (*leaves > 0) ? *sum / (double) *leaves : 0.0;
+}
+
+/**
+ * @brief Raise the threshold and reinsert the leaf entries into a fresh tree, which merges the closest of them.
+ */
+static void rebuild(cf_tree* tree) {
+    double sum = 0.0;
+    size_t leaves = 0;
+    double radius = closest_pair_radius(tree->m, tree->root, &sum, &leaves);
+    tree->threshold = (radius > 2.0 * tree->threshold) ? radius : 2.0 * tree->threshold;
+    if (tree->threshold < DBL_MIN) {
+        tree->threshold = DBL_MIN;
+    }
+
+    size_t count = 0, i;
+    cf_entry* entries = malloc(sizeof(cf_entry) * tree->entries);
+    collect_leaf_entries(tree->root, entries, &count);
+    free_nodes(tree->root, false);
+    tree->root = node_create(true);
+    tree->entries = 0;
+    for (i = 0; i < count; i++) {
+        insert_root(tree, &entries[i]);
+    }
+    free(entries);
+}
+
+cf_tree* cf_create(size_t m, size_t max_entries) {
+    if (max_entries < BIRCH_BRANCHING) {
+        failwithf("The clustering-feature tree needs room for at least %d leaf entries, got %zu!\n", BIRCH_BRANCHING, max_entries);
+    }
+    cf_tree* tree = malloc(sizeof(cf_tree));
+    tree->m = m;
+    tree->max_entries = max_entries;
+    tree->entries = 0;
+    tree->threshold = 0.0;
+    tree->root = node_create(true);
+    return tree;
+}
+
+void cf_insert(cf_tree* tree, const double* row, double weight) {
+    if (!(weight > 0.0)) {
+        // Rows without weight do not change any feature.
+        return;
+    }
+    size_t vi;
+    cf_entry entry = entry_create(tree->m);
+    entry.weight = weight;
+    for (vi = 0; vi < tree->m; vi++) {
+        entry.linear[vi] = weight * row[vi];
+        entry.squared += weight * row[vi] * row[vi];
+    }
+    insert_root(tree, &entry);
+    while (tree->entries > tree->max_entries) {
+        rebuild(tree);
+    }
+}
+
+size_t cf_entries(cf_tree* tree) {
+    return tree->entries;
+}
+
+double** cf_leaf_rows(cf_tree* tree, size_t* count, double** weights) {
+    size_t i, vi, collected = 0;
+    cf_entry* entries = malloc(sizeof(cf_entry) * (tree->entries + 1));
+    collect_leaf_entries(tree->root, entries, &collected);
+    double** rows = allocate_rows(collected, tree->m);
+    *weights = malloc(sizeof(double) * (collected + 1));
+    for (i = 0; i < collected; i++) {
+        (*weights)[i] = entries[i].weight;
+        for (vi = 0; vi < tree->m; vi++) {
+            rows[i][vi] = entries[i].linear[vi] / entries[i].weight;
+        }
+    }
+    free(entries);
+    *count = collected;
+    return rows;
+}
+
+void cf_free(cf_tree* tree) {
+    free_nodes(tree->root, true);
+    free(tree);
+}
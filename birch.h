@@ -0,0 +1,52 @@
+#ifndef BIRCH_H
+#define BIRCH_H
+
+#include <stdlib.h>
+
+// The most entries a node of the tree holds before it is split.
+#define BIRCH_BRANCHING 50
+
+/**
+ * @brief A BIRCH clustering-feature tree, which summarizes rows as they are read.
+ *
+ * Every leaf entry is a clustering feature: the weight, the linear sum and the squared sum of the rows it absorbed.
+ * A row is absorbed by the closest leaf entry when that keeps the radius of the entry within a threshold,
+ * otherwise it starts a new entry. When there are more leaf entries than allowed, the threshold is raised
+ * and the tree is rebuilt from its own leaf entries, so the memory use stays bounded whatever the amount of rows.
+ */
+typedef struct cf_tree cf_tree;
+
+/**
+ * @brief Create an empty tree for rows of m columns.
+ *
+ * @param m The amount of columns in each row.
+ * @param max_entries The most leaf entries the tree may hold, at least BIRCH_BRANCHING.
+ */
+cf_tree* cf_create(size_t m, size_t max_entries);
+
+/**
+ * @brief Absorb a row into the tree, the row itself is not kept.
+ */
+void cf_insert(cf_tree* tree, const double* row, double weight);
+
+/**
+ * @brief The amount of leaf entries in the tree.
+ */
+size_t cf_entries(cf_tree* tree);
+
+/**
+ * @brief The centroids and weights of the leaf entries, ready to be clustered as weighted rows.
+ *
+ * @param count Set to the amount of leaf entries.
+ * @param weights Set to a newly allocated array with the weight of each entry.
+ *
+ * @return The centroid of each entry, free it with free_rows.
+ */
+double** cf_leaf_rows(cf_tree* tree, size_t* count, double** weights);
+
+/**
+ * @brief Free the tree.
+ */
+void cf_free(cf_tree* tree);
+
+#endif
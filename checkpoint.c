@@ -0,0 +1,150 @@
+/**
+ *
+ * This module saves and restores the progress of long k-means runs, so that they survive being killed.
+ *
+ * A checkpoint file is laid out in native byte order as:
+ *   char magic[8], uint32 version, uint32 reserved, uint64 fingerprint, uint64 seed, uint64 iteration,
+ *   uint64 k, uint64 m, uint64 history_count, double history[history_count], double kernels[k][m]
+ *
+ */
+
+#include "checkpoint.h"
+#include "reduce.h"
+#include "fail.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t fingerprint;
+    uint64_t seed;
+    uint64_t iteration;
+    uint64_t k;
+    uint64_t m;
+    uint64_t history_count;
+} checkpoint_header;
+
+uint64_t checkpoint_fingerprint(double** data_rows, size_t n, size_t m, const double* row_weights) {
+    // FNV-1a over the bits of every value, 0.0 and -0.0 are folded together like the rest of the program does.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t shape[2] = { n, m };
+    size_t ri, vi, i;
+    for (i = 0; i < 2; i++) {
+        hash ^= shape[i];
+        hash *= 0x100000001b3ULL;
+    }
+    for (ri = 0; ri < n; ri++) {
+        for (vi = 0; vi <= m; vi++) {
+            double value = (vi < m) ? data_rows[ri][vi] : ((row_weights != NULL) ? row_weights[ri] : 1.0);
+            uint64_t bits;
+            value = (value == 0.0) ? 0.0 : value;
+            memcpy(&bits, &value, sizeof(bits));
+            hash ^= bits;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+static void write_or_fail(const void* data, size_t size, FILE* file, const char* path) {
+    if (size > 0 && fwrite(data, size, 1, file) != 1) {
+        failwithf("Could not write the checkpoint to '%s'!\n", path);
+    }
+}
+
+void checkpoint_write(const char* path, const checkpoint* progress) {
+    size_t ki;
+    size_t temporary_length = strlen(path) + 5;
+    char* temporary = malloc(temporary_length);
+    snprintf(temporary, temporary_length, "%s.tmp", path);
+    FILE* file = fopen(temporary, "wb");
+    if (file == NULL) {
+        failwithf("Could not open '%s' to write the checkpoint!\n", temporary);
+    }
+
+    checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.fingerprint = progress->fingerprint;
+    header.seed = progress->seed;
+    header.iteration = progress->iteration;
+    header.k = progress->k;
+    header.m = progress->m;
+    header.history_count = progress->history_count;
+    write_or_fail(&header, sizeof(header), file, temporary);
+    write_or_fail(progress->history, sizeof(double) * progress->history_count, file, temporary);
+    for (ki = 0; ki < progress->k; ki++) {
+        write_or_fail(progress->kernels[ki], sizeof(double) * progress->m, file, temporary);
+    }
+    // The data must be on disk before the rename makes it the checkpoint.
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0 || fclose(file) != 0) {
+        failwithf("Could not sync the checkpoint '%s' to disk!\n", temporary);
+    }
+    if (rename(temporary, path) != 0) {
+        failwithf("Could not move the checkpoint '%s' to '%s'!\n", temporary, path);
+    }
+    free(temporary);
+}
+
+static void read_or_fail(void* data, size_t size, FILE* file, const char* path) {
+    if (size > 0 && fread(data, size, 1, file) != 1) {
+        failwithf("The checkpoint '%s' is truncated!\n", path);
+    }
+}
+
+checkpoint* checkpoint_read(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return NULL;
+        }
+        failwithf("Could not open the checkpoint '%s'!\n", path);
+    }
+    checkpoint_header header;
+    read_or_fail(&header, sizeof(header), file, path);
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) {
+        failwithf("'%s' is not a checkpoint file!\n", path);
+    }
+    if (header.version != CHECKPOINT_VERSION) {
+        failwithf("The checkpoint '%s' has version %u, but only version %d can be read!\n", path, header.version, CHECKPOINT_VERSION);
+    }
+    // The counts are checked against the size of the file before anything is allocated for them.
+    if (fseek(file, 0, SEEK_END) != 0) {
+        failwithf("Could not find the size of the checkpoint '%s'!\n", path);
+    }
+    uint64_t values = (uint64_t) (ftell(file) - (long) sizeof(header)) / sizeof(double);
+    if (header.k == 0 || header.m == 0 || header.m > values || header.k > values / header.m
+            || header.history_count != values - header.k * header.m
+            || (uint64_t) ftell(file) != sizeof(header) + sizeof(double) * values) {
+        failwithf("The checkpoint '%s' is corrupt or truncated!\n", path);
+    }
+    fseek(file, sizeof(header), SEEK_SET);
+
+    size_t ki;
+    checkpoint* progress = malloc(sizeof(checkpoint));
+    progress->fingerprint = header.fingerprint;
+    progress->seed = header.seed;
+    progress->iteration = header.iteration;
+    progress->k = header.k;
+    progress->m = header.m;
+    progress->history_count = header.history_count;
+    progress->history = malloc(sizeof(double) * (header.history_count + 1));
+    read_or_fail(progress->history, sizeof(double) * header.history_count, file, path);
+    progress->kernels = allocate_rows(header.k, header.m);
+    for (ki = 0; ki < header.k; ki++) {
+        read_or_fail(progress->kernels[ki], sizeof(double) * header.m, file, path);
+    }
+    fclose(file);
+    return progress;
+}
+
+void checkpoint_free(checkpoint* progress) {
+    free_rows(progress->kernels, progress->k);
+    free(progress->history);
+    free(progress);
+}
@@ -0,0 +1,51 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// The first 8 bytes of every checkpoint file.
+#define CHECKPOINT_MAGIC "CMEANSC"
+#define CHECKPOINT_VERSION 1
+
+/**
+ * @brief The progress of a k-means run, enough to continue it where it was stopped.
+ */
+typedef struct {
+    uint64_t fingerprint;  // Identifies the data the run was on, see checkpoint_fingerprint.
+    uint64_t seed;         // The seed of the random seeding.
+    size_t iteration;      // The amount of iterations done.
+    size_t k;
+    size_t m;
+    size_t history_count;
+    double* history;       // The movement of the kernels in every iteration done, oldest first.
+    double** kernels;      // k kernels of m values.
+} checkpoint;
+
+/**
+ * @brief A 64-bit hash of the shape, values and weights of the data, a resumed run must be on the same data.
+ *
+ * @param row_weights The weight of each row, or NULL when all rows weigh 1.
+ */
+uint64_t checkpoint_fingerprint(double** data_rows, size_t n, size_t m, const double* row_weights);
+
+/**
+ * @brief Write a checkpoint atomically: to a temporary file that is synced to disk and then renamed over path.
+ *
+ * A run killed while writing leaves the previous checkpoint as it was.
+ */
+void checkpoint_write(const char* path, const checkpoint* progress);
+
+/**
+ * @brief Read a checkpoint, failing when it is not a valid one.
+ *
+ * @return The checkpoint, or NULL when there is no file at path.
+ */
+checkpoint* checkpoint_read(const char* path);
+
+/**
+ * @brief Free a checkpoint returned by checkpoint_read.
+ */
+void checkpoint_free(checkpoint* progress);
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ *
+ * c_means_client, a small client of the resident mode (c_means --serve <socket>), for testing it.
+ *
+ * It reads rows of numbers from stdin, sends them as a job (or many copies of it, to load the daemon),
+ * and prints the labels of the first answer, one per line, and its kernels to stderr.
+ *
+ */
+
+#include "serve.h"
+#include "cmeans.h"
+#include "fail.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/**
+ * @brief Read rows of separated numbers, every row must have as many numbers as the first one.
+ */
+static double* read_rows(char separator, size_t* n, size_t* m) {
+    size_t cap = 1024, count = 0, columns = 0;
+    double* values = malloc(sizeof(double) * cap);
+    char* line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, stdin) > 0) {
+        size_t found = 0;
+        char* at = line;
+        char* end;
+        while (true) {
+            double value = strtod(at, &end);
+            if (end == at) {
+                break;
+            }
+            if (count == cap) {
+                cap *= 2;
+                values = realloc(values, sizeof(double) * cap);
+            }
+            values[count++] = value;
+            found += 1;
+            at = (*end == separator) ? end + 1 : end;
+        }
+        if (found == 0) {
+            continue;
+        }
+        if (columns == 0) {
+            columns = found;
+        } else if (found != columns) {
+            failwithf("Row %zu has %zu columns, but the first row has %zu!\n", count / columns + 1, found, columns);
+        }
+    }
+    free(line);
+    if (columns == 0) {
+        failwith("There were no rows on stdin!\n");
+    }
+    *n = count / columns;
+    *m = columns;
+    return values;
+}
+
+int main(int argc, char** argv) {
+    const char* path = NULL;
+    serve_request request;
+    memset(&request, 0, sizeof(request));
+    request.magic = SERVE_REQUEST_MAGIC;
+    request.version = SERVE_VERSION;
+    request.metric = CMEANS_METRIC_EUCLIDEAN;
+    size_t repeat = 1;
+    char separator = ',';
+    int option;
+    while ((option = getopt(argc, argv, "s:k:gr:f:x:h")) != -1) {
+        switch (option) {
+            case 's': path = optarg; break;
+            case 'k': request.k = strtoull(optarg, NULL, 10); break;
+            case 'g': request.flags |= SERVE_GENERATE_KERNELS; break;
+            case 'r': repeat = strtoull(optarg, NULL, 10); break;
+            case 'f': separator = optarg[0]; break;
+            case 'x': request.seed = (uint32_t) strtoul(optarg, NULL, 10); break;
+            default:
+                printf("Usage: %s -s <socket> -k <integer> [-g] [-r <repeats>] [-f <char>] [-x <seed>] < rows.csv\n"
+                       "  -s  the socket of 'c_means --serve'\n"
+                       "  -k  the amount of kernels\n"
+                       "  -g  generate kernels instead of picking random rows\n"
+                       "  -r  send the job this many times at once, and print the throughput to stderr\n"
+                       "  -f  the column separator, default ','\n"
+                       "  -x  the seed of the random seeding\n", argv[0]);
+                return (option == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (path == NULL || request.k == 0 || repeat == 0) {
+        failwith("A socket (-s), a kernel amount (-k) and a positive amount of repeats (-r) are needed!\n");
+    }
+    size_t n, m, r, ri, ki, vi;
+    double* values = read_rows(separator, &n, &m);
+    request.n = n;
+    request.m = m;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        failwithf("Could not connect to '%s'!\n", path);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Jobs are written from a child process, so answers are read while jobs are still being sent.
+    pid_t writer = fork();
+    if (writer == 0) {
+        for (r = 0; r < repeat; r++) {
+            request.id = r;
+            if (!write_exactly(fd, &request, sizeof(request)) || !write_exactly(fd, values, sizeof(double) * n * m)) {
+                _exit(EXIT_FAILURE);
+            }
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    uint64_t* labels = malloc(sizeof(uint64_t) * n);
+    double* kernels = malloc(sizeof(double) * request.k * m);
+    for (r = 0; r < repeat; r++) {
+        serve_response response;
+        if (!read_exactly(fd, &response, sizeof(response)) || response.magic != SERVE_RESPONSE_MAGIC) {
+            failwith("The daemon hung up!\n");
+        }
+        if (response.status != CMEANS_OK) {
+            failwithf("Job %llu failed: %s!\n", (unsigned long long) response.id, cmeans_status_message(response.status));
+        }
+        if (!read_exactly(fd, labels, sizeof(uint64_t) * n) || !read_exactly(fd, kernels, sizeof(double) * request.k * m)) {
+            failwith("The daemon hung up!\n");
+        }
+        if (r == 0) {
+            for (ri = 0; ri < n; ri++) {
+                printf("%llu\n", (unsigned long long) labels[ri]);
+            }
+            for (ki = 0; ki < request.k; ki++) {
+                for (vi = 0; vi < m; vi++) {
+                    fprintf(stderr, "%s%lf", (vi == 0) ? "" : ",", kernels[ki * m + vi]);
+                }
+                fprintf(stderr, "\n");
+            }
+        }
+    }
+    waitpid(writer, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (repeat > 1) {
+        fprintf(stderr, "%zu jobs of %zu rows in %.3lf s, %.1lf jobs per second.\n", repeat, n, seconds, (double) repeat / seconds);
+    }
+    close(fd);
+    free(labels);
+    free(kernels);
+    free(values);
+    return EXIT_SUCCESS;
+}
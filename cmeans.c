@@ -0,0 +1,190 @@
+/**
+ *
+ * This module is the public face of libcmeans, it translates the flat, strided matrices of cmeans.h
+ * to the row pointers that the k_means-module works on, without copying any values.
+ *
+ */
+
+#include "cmeans.h"
+#include "k_means.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+// cmeans_assign labels rows in blocks of this many rows, so their row pointers fit on the stack.
+#define CMEANS_ASSIGN_BLOCK 256
+
+// With at most this many kernels, cmeans_assign keeps the kernel pointers on the stack as well.
+#define CMEANS_STACK_KERNELS 1024
+
+// The oldest options a caller can pass, those of version 1.0.
+#define CMEANS_OPTIONS_V1_SIZE (offsetof(cmeans_options, initial_kernels) + sizeof(const double*))
+
+/**
+ * @brief Reserve an aligned piece of the workspace, see carve in k_means.c.
+ */
+static void* carve(char* base, size_t* used, size_t bytes) {
+    size_t start = (*used + KMEANS_WORKSPACE_ALIGNMENT - 1) & ~((size_t) KMEANS_WORKSPACE_ALIGNMENT - 1);
+    *used = start + bytes;
+    return (base != NULL) ? base + start : NULL;
+}
+
+static bool valid_options(const cmeans_options* options) {
+    return options != NULL && options->size >= CMEANS_OPTIONS_V1_SIZE && options->metric <= CMEANS_METRIC_WEIGHTED;
+}
+
+static k_means_options engine_options(const cmeans_options* options) {
+    k_means_options engine = k_means_default_options((size_t) options->k, options->generate_kernels != 0);
+    engine.metric = (metric_t) options->metric;
+    engine.column_weights = options->column_weights;
+    engine.row_weights = options->row_weights;
+    engine.seed = options->seed;
+    // Only whether there are initial kernels matters for the size of the workspace, they are pointed to later.
+    engine.initial_kernels = (options->initial_kernels != NULL) ? (double**) &options->initial_kernels : NULL;
+    return engine;
+}
+
+/**
+ * @brief Lay out the row pointers, the kernel pointers and the workspace of the k_means-module.
+ *
+ * @return The size of the whole workspace.
+ */
+static size_t lay_out(const k_means_options* engine, size_t n, size_t m, char* base,
+        double*** rows, double*** kernels, double*** initial, void** rest) {
+    size_t used = 0;
+    *rows = carve(base, &used, sizeof(double*) * n);
+    *kernels = carve(base, &used, sizeof(double*) * engine->k);
+    *initial = carve(base, &used, sizeof(double*) * engine->k);
+    *rest = carve(base, &used, kmeans_workspace_size(engine, n, m));
+    return used;
+}
+
+static cmeans_status to_status(kmeans_status status) {
+    switch (status) {
+        case KMEANS_OK:              return CMEANS_OK;
+        case KMEANS_ERROR_ROWS:      return CMEANS_ERROR_ROWS;
+        case KMEANS_ERROR_WORKSPACE: return CMEANS_ERROR_WORKSPACE;
+        case KMEANS_ERROR_MEMORY:    return CMEANS_ERROR_MEMORY;
+        case KMEANS_ERROR_NAN:       return CMEANS_ERROR_NAN;
+        default:                     return CMEANS_ERROR_ARGUMENT;
+    }
+}
+
+uint32_t cmeans_version(void) {
+    return CMEANS_VERSION;
+}
+
+void cmeans_default_options(cmeans_options* options, uint64_t k) {
+    memset(options, 0, sizeof(cmeans_options));
+    options->size = sizeof(cmeans_options);
+    options->metric = CMEANS_METRIC_EUCLIDEAN;
+    options->k = k;
+}
+
+size_t cmeans_workspace_size(const cmeans_options* options, size_t n, size_t m) {
+    if (!valid_options(options)) {
+        return 0;
+    }
+    k_means_options engine = engine_options(options);
+    double** rows;
+    double** kernels;
+    double** initial;
+    void* rest;
+    return lay_out(&engine, n, m, NULL, &rows, &kernels, &initial, &rest);
+}
+
+cmeans_status cmeans_cluster(const cmeans_options* options, const double* data, size_t n, size_t m, size_t stride,
+        size_t* labels, double* kernels_out, void* workspace, size_t workspace_size) {
+    if (!valid_options(options) || data == NULL || labels == NULL || options->k == 0 || n == 0 || m == 0 || stride < m) {
+        return CMEANS_ERROR_ARGUMENT;
+    }
+    k_means_options engine = engine_options(options);
+    double** rows;
+    double** kernels;
+    double** initial;
+    void* rest;
+    size_t needed = lay_out(&engine, n, m, NULL, &rows, &kernels, &initial, &rest);
+    void* owned = NULL;
+    if (workspace == NULL) {
+        owned = malloc(needed);
+        if (owned == NULL) {
+            return CMEANS_ERROR_MEMORY;
+        }
+        workspace = owned;
+    } else if (workspace_size < needed) {
+        return CMEANS_ERROR_WORKSPACE;
+    }
+    lay_out(&engine, n, m, workspace, &rows, &kernels, &initial, &rest);
+
+    size_t ri, ki;
+    // The engine only reads the rows, the casts drop the const of the caller's matrix and kernels.
+    for (ri = 0; ri < n; ri++) {
+        rows[ri] = (double*) (data + ri * stride);
+    }
+    if (options->initial_kernels != NULL) {
+        for (ki = 0; ki < engine.k; ki++) {
+            initial[ki] = (double*) (options->initial_kernels + ki * m);
+        }
+        engine.initial_kernels = initial;
+    }
+    if (kernels_out != NULL) {
+        for (ki = 0; ki < engine.k; ki++) {
+            kernels[ki] = kernels_out + ki * m;
+        }
+        engine.kernels_out = kernels;
+    }
+
+    kmeans_ctx ctx;
+    size_t rest_size = ((owned != NULL) ? needed : workspace_size) - (size_t) ((char*) rest - (char*) workspace);
+    kmeans_status status = kmeans_ctx_init(&ctx, &engine, rows, n, m, labels, rest, rest_size);
+    if (status == KMEANS_OK) {
+        status = kmeans_run(&ctx);
+    }
+    kmeans_free(&ctx);
+    free(owned);
+    return to_status(status);
+}
+
+cmeans_status cmeans_assign(const cmeans_options* options, const double* data, size_t n, size_t m, size_t stride,
+        const double* kernels, size_t k, size_t* labels) {
+    if (!valid_options(options) || data == NULL || kernels == NULL || labels == NULL || k == 0 || m == 0 || stride < m
+            || (options->metric == CMEANS_METRIC_WEIGHTED && options->column_weights == NULL)) {
+        return CMEANS_ERROR_ARGUMENT;
+    }
+    double* stack_kernels[CMEANS_STACK_KERNELS];
+    double** kernel_rows = (k <= CMEANS_STACK_KERNELS) ? stack_kernels : malloc(sizeof(double*) * k);
+    if (kernel_rows == NULL) {
+        return CMEANS_ERROR_MEMORY;
+    }
+    size_t ri, ki;
+    for (ki = 0; ki < k; ki++) {
+        kernel_rows[ki] = (double*) (kernels + ki * m);
+    }
+    k_means_options engine = engine_options(options);
+    engine.k = k;
+    double* rows[CMEANS_ASSIGN_BLOCK];
+    size_t block;
+    for (block = 0; block < n; block += CMEANS_ASSIGN_BLOCK) {
+        size_t count = (n - block < CMEANS_ASSIGN_BLOCK) ? n - block : CMEANS_ASSIGN_BLOCK;
+        for (ri = 0; ri < count; ri++) {
+            rows[ri] = (double*) (data + (block + ri) * stride);
+        }
+        k_means_assign(&engine, rows, count, m, kernel_rows, labels + block);
+    }
+    if (kernel_rows != stack_kernels) {
+        free(kernel_rows);
+    }
+    return CMEANS_OK;
+}
+
+const char* cmeans_status_message(cmeans_status status) {
+    switch (status) {
+        case CMEANS_OK:              return "No error";
+        case CMEANS_ERROR_ARGUMENT:  return "Invalid arguments, sizes must be positive, the stride at least m and the weighted metric needs column weights";
+        case CMEANS_ERROR_ROWS:      return "Fewer rows (with a weight above 0) than kernels to pick from them";
+        case CMEANS_ERROR_WORKSPACE: return "The workspace is smaller than cmeans_workspace_size";
+        case CMEANS_ERROR_MEMORY:    return "Could not allocate the workspace";
+        case CMEANS_ERROR_NAN:       return "The kernels moved by nan, the rows probably hold nan or infinite values";
+        default:                     return "Unknown status";
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef CMEANS_H
+#define CMEANS_H
+
+/**
+ * @brief The public interface of libcmeans, the clustering engine of c_means as a library.
+ *
+ * This is the only header a program linking libcmeans.a or libcmeans.so needs. It only uses fixed types,
+ * so its ABI stays the same within a major version: structs only grow at their end, guarded by their size field.
+ * The data is passed as a flat row-major matrix with a stride, so callers can cluster their own memory without copying it.
+ * Nothing here exits the process or keeps global state, problems are returned as a cmeans_status.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMEANS_VERSION_MAJOR 1
+#define CMEANS_VERSION_MINOR 0
+#define CMEANS_VERSION_PATCH 0
+#define CMEANS_VERSION ((CMEANS_VERSION_MAJOR * 10000) + (CMEANS_VERSION_MINOR * 100) + CMEANS_VERSION_PATCH)
+
+// The library is built with hidden symbols, only the functions marked with CMEANS_API are exported.
+#if defined(CMEANS_BUILD) && defined(__GNUC__)
+#define CMEANS_API __attribute__((visibility("default")))
+#else
+#define CMEANS_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    CMEANS_METRIC_EUCLIDEAN = 0,
+    CMEANS_METRIC_MANHATTAN = 1, // Kernels are the per-column medians of their rows (k-medians).
+    CMEANS_METRIC_COSINE = 2,    // Rows and kernels are compared at unit length (spherical k-means).
+    CMEANS_METRIC_WEIGHTED = 3   // Euclidean distance with a weight per column.
+} cmeans_metric;
+
+typedef enum {
+    CMEANS_OK = 0,
+    CMEANS_ERROR_ARGUMENT = 1,  // A size is 0, a pointer is missing, the stride is below m or the options are unknown.
+    CMEANS_ERROR_ROWS = 2,      // Fewer rows (with a weight above 0) than kernels to pick from them.
+    CMEANS_ERROR_WORKSPACE = 3, // The workspace is smaller than cmeans_workspace_size.
+    CMEANS_ERROR_MEMORY = 4,    // No workspace was given, and allocating one failed.
+    CMEANS_ERROR_NAN = 5        // The kernels moved by nan, the rows hold nan or infinite values.
+} cmeans_status;
+
+/**
+ * @brief The settings of a clustering, fill them in with cmeans_default_options and change what you need.
+ */
+typedef struct {
+    uint32_t size;                // sizeof(cmeans_options) of the caller, set by cmeans_default_options.
+    uint32_t metric;              // A cmeans_metric.
+    uint64_t k;                   // The amount of clusters.
+    uint32_t generate_kernels;    // Non-zero seeds at quantiles of the columns, zero picks random rows.
+    uint32_t seed;                // The seed of the random seeding, 0 picks one from the clock.
+    const double* column_weights; // m weights, required by CMEANS_METRIC_WEIGHTED.
+    const double* row_weights;    // n weights, or NULL to weigh all rows equally.
+    const double* initial_kernels; // k by m kernels (row-major, no stride) to start from, or NULL to seed.
+} cmeans_options;
+
+/**
+ * @brief The version the library was built as, compare it to CMEANS_VERSION.
+ */
+CMEANS_API uint32_t cmeans_version(void);
+
+/**
+ * @brief Fill in the options of a plain euclidean clustering into k clusters.
+ */
+CMEANS_API void cmeans_default_options(cmeans_options* options, uint64_t k);
+
+/**
+ * @brief The bytes of workspace cmeans_cluster needs for these options and an n by m matrix.
+ */
+CMEANS_API size_t cmeans_workspace_size(const cmeans_options* options, size_t n, size_t m);
+
+/**
+ * @brief Cluster the rows of a matrix with k-means (Lloyd's algorithm).
+ *
+ * @param options The settings, see cmeans_options.
+ * @param data The first value of the first row, row i starts at data + i * stride. It is only read.
+ * @param n The amount of rows.
+ * @param m The amount of values in each row.
+ * @param stride The distance between the starts of two rows, in doubles, at least m.
+ * @param labels Room for n labels, filled with the cluster (0 .. k - 1) of each row.
+ * @param kernels_out Room for k by m values (row-major, no stride) that receive the kernels, or NULL.
+ * @param workspace At least cmeans_workspace_size bytes, aligned to 64 bytes, or NULL to allocate it during the call.
+ *        With a workspace, the call allocates nothing, so any amount of calls can run concurrently with their own workspaces.
+ * @param workspace_size The size of the workspace.
+ */
+CMEANS_API cmeans_status cmeans_cluster(const cmeans_options* options, const double* data, size_t n, size_t m, size_t stride,
+        size_t* labels, double* kernels_out, void* workspace, size_t workspace_size);
+
+/**
+ * @brief Label the rows of a matrix with their closest kernel, e.g. new rows with the kernels_out of cmeans_cluster.
+ *
+ * @param options The metric and column weights to compare by, the other settings are ignored.
+ * @param kernels k by m kernels (row-major, no stride), cosine kernels must be unit length like those of cmeans_cluster.
+ * @param k The amount of kernels.
+ */
+CMEANS_API cmeans_status cmeans_assign(const cmeans_options* options, const double* data, size_t n, size_t m, size_t stride,
+        const double* kernels, size_t k, size_t* labels);
+
+/**
+ * @brief A human readable description of a status.
+ */
+CMEANS_API const char* cmeans_status_message(cmeans_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
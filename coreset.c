@@ -0,0 +1,174 @@
+/**
+ *
+ * This module builds coresets: small weighted samples of the rows that k-means can be run on instead of all rows.
+ *
+ * The sampling follows the sensitivity framework (Bachem, Lucic & Krause, "Practical Coreset Constructions").
+ * With a rough clustering B of mean cost c (its total cost over the total weight W),
+ * a row x in cluster b is sampled with a probability proportional to
+ *
+ *     a d(x, B)^2 / c  +  2 a c_b / (W_b c)  +  4 W / W_b
+ *
+ * where c_b and W_b are the cost and weight of its cluster and a = 16 (log k + 2).
+ * Rows far away from the rough kernels, or in small clusters, are the ones that can change the cost the most.
+ *
+ */
+
+#include "coreset.h"
+#include "reduce.h"
+#include "parallel.h"
+#include "rng.h"
+#include "fail.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    double** data_rows;
+    size_t m;
+    double* seed;
+    size_t seed_index;
+    double* distances; // The squared distance of each row to its closest seed.
+    size_t* closest;
+} seed_context;
+
+// Fold a new seed into the squared distances, this is the part of k-means++ that touches every row.
+static void seed_chunk(size_t from, size_t to, size_t worker, void* context) {
+    seed_context* seeding = context;
+    size_t ri, vi;
+    for (ri = from; ri < to; ri++) {
+        double distance = 0.0;
+        for (vi = 0; vi < seeding->m; vi++) {
+            double d = seeding->data_rows[ri][vi] - seeding->seed[vi];
+            distance += d * d;
+        }
+        if (distance < seeding->distances[ri]) {
+            seeding->distances[ri] = distance;
+            seeding->closest[ri] = seeding->seed_index;
+        }
+    }
+}
+
+/**
+ * @brief Draw an index with a probability proportional to its share of a cumulative sum.
+ */
+static size_t draw(const double* cumulative, size_t n, uint64_t* rng) {
+    double target = rng_uniform(rng) * cumulative[n - 1];
+    size_t low = 0, high = n - 1;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (cumulative[middle] > target) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+static int cmp_index(const void* p, const void* q) {
+    size_t a = *(const size_t*) p;
+    size_t b = *(const size_t*) q;
+    return (a > b) - (a < b);
+}
+
+double** coreset_rows(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights,
+        size_t samples, size_t* size, double** coreset_weights) {
+    if (n < k || samples < k) {
+        failwithf("Cannot build a coreset of %zu samples for %zu clusters out of %zu rows!\n", samples, k, n);
+    }
+    uint64_t rng = rng_seed((uint64_t) time(NULL));
+    size_t ri, ki, si;
+    double* cumulative = malloc(sizeof(double) * n);
+
+    // Rough clustering, k-means++ seeding with the row weights.
+    seed_context seeding;
+    seeding.data_rows = data_rows;
+    seeding.m = m;
+    seeding.distances = malloc(sizeof(double) * n);
+    seeding.closest = malloc(sizeof(size_t) * n);
+    for (ri = 0; ri < n; ri++) {
+        seeding.distances[ri] = INFINITY;
+        cumulative[ri] = ((ri > 0) ? cumulative[ri - 1] : 0.0) + ((row_weights != NULL) ? row_weights[ri] : 1.0);
+    }
+    if (!(cumulative[n - 1] > 0.0)) {
+        failwith("Cannot build a coreset when no row has a positive weight!\n");
+    }
+    for (ki = 0; ki < k; ki++) {
+        seeding.seed = data_rows[draw(cumulative, n, &rng)];
+        seeding.seed_index = ki;
+        parallel_for(n, seed_chunk, &seeding);
+        for (ri = 0; ri < n; ri++) {
+            double weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+            cumulative[ri] = ((ri > 0) ? cumulative[ri - 1] : 0.0) + weight * seeding.distances[ri];
+        }
+        if (!(cumulative[n - 1] > 0.0)) {
+            // Every row sits on a seed, the remaining seeds could not lower the cost anyway.
+            break;
+        }
+    }
+
+    // The cost and weight of every rough cluster.
+    double* cluster_cost = calloc(k, sizeof(double));
+    double* cluster_weight = calloc(k, sizeof(double));
+    double total_cost = 0.0, total_weight = 0.0;
+    for (ri = 0; ri < n; ri++) {
+        double weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+        cluster_cost[seeding.closest[ri]] += weight * seeding.distances[ri];
+        cluster_weight[seeding.closest[ri]] += weight;
+        total_cost += weight * seeding.distances[ri];
+        total_weight += weight;
+    }
+
+    // The sensitivity bound of every row, weighted by the row itself.
+    double alpha = 16.0 * (log((double) k) + 2.0);
+    double mean_cost = (total_weight > 0.0) ? total_cost / total_weight : 0.0;
+    for (ri = 0; ri < n; ri++) {
+        double weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+        size_t b = seeding.closest[ri];
+        double sensitivity = 0.0;
+        if (weight > 0.0) {
+            sensitivity = 4.0 * total_weight / cluster_weight[b];
+            if (mean_cost > 0.0) {
+                sensitivity += alpha * seeding.distances[ri] / mean_cost
+                    + 2.0 * alpha * cluster_cost[b] / (cluster_weight[b] * mean_cost);
+            }
+        }
+        cumulative[ri] = ((ri > 0) ? cumulative[ri - 1] : 0.0) + weight * sensitivity;
+    }
+
+    // Sample with replacement, sorting the picks lets repeated rows be merged into one heavier row.
+    size_t* picks = malloc(sizeof(size_t) * samples);
+    for (si = 0; si < samples; si++) {
+        picks[si] = draw(cumulative, n, &rng);
+    }
+    qsort(picks, samples, sizeof(size_t), cmp_index);
+    size_t distinct = 0;
+    for (si = 0; si < samples; si++) {
+        if (si == 0 || picks[si] != picks[si - 1]) {
+            distinct += 1;
+        }
+    }
+    double** rows = allocate_rows(distinct, m);
+    double* weights = calloc(distinct, sizeof(double));
+    size_t out = 0;
+    for (si = 0; si < samples; si++) {
+        ri = picks[si];
+        if (si > 0 && ri != picks[si - 1]) {
+            out += 1;
+        }
+        double weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+        double probability = (cumulative[ri] - ((ri > 0) ? cumulative[ri - 1] : 0.0)) / cumulative[n - 1];
+        memcpy(rows[out], data_rows[ri], sizeof(double) * m);
+        weights[out] += weight / ((double) samples * probability);
+    }
+
+    free(cumulative);
+    free(seeding.distances);
+    free(seeding.closest);
+    free(cluster_cost);
+    free(cluster_weight);
+    free(picks);
+    *size = distinct;
+    *coreset_weights = weights;
+    return rows;
+}
@@ -0,0 +1,27 @@
+#ifndef CORESET_H
+#define CORESET_H
+
+#include <stdlib.h>
+
+/**
+ * @brief Build a weighted coreset of the rows by sensitivity (importance) sampling.
+ *
+ * A rough clustering is found by k-means++ seeding alone. Every row is then sampled with a probability
+ * that bounds its share of the clustering cost, and weighted by the inverse of that probability,
+ * so that the weighted k-means cost of the coreset approximates the cost of all rows for any set of kernels.
+ *
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param k The amount of clusters the coreset is built for.
+ * @param row_weights The weight of each row, or NULL when all rows weigh 1.
+ * @param samples The amount of rows to sample, rows sampled more than once are merged.
+ * @param size Set to the amount of distinct rows in the coreset.
+ * @param coreset_weights Set to a newly allocated array with the weight of each coreset row.
+ *
+ * @return Copies of the coreset rows, free them with free_rows.
+ */
+double** coreset_rows(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights,
+        size_t samples, size_t* size, double** coreset_weights);
+
+#endif
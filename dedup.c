@@ -0,0 +1,118 @@
+/**
+ *
+ * This module collapses identical rows, using an open-addressing hash table with linear probing.
+ *
+ */
+
+#include "dedup.h"
+#include "fail.h"
+#include <stdint.h>
+#include <string.h>
+
+// The table is doubled when it is half full, which keeps the probe sequences short.
+#define DEDUP_INITIAL_CAPACITY 1024
+
+typedef struct {
+    double* row;     // NULL marks an empty slot.
+    uint64_t hash;
+    size_t index;
+} dedup_slot;
+
+struct dedup_table {
+    size_t m;
+    size_t count;
+    size_t capacity;  // Always a power of two, so the slot of a hash is a mask away.
+    dedup_slot* slots;
+};
+
+static uint64_t hash_row(const double* row, size_t m) {
+    // FNV-1a over the bits of each value, one 64-bit word at a time, followed by a final mix.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < m; i++) {
+        // 0.0 and -0.0 compare equal, so they must hash equally as well.
+        double value = (row[i] == 0.0) ? 0.0 : row[i];
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        hash ^= bits;
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static bool rows_equal(const double* p, const double* q, size_t m) {
+    size_t i;
+    for (i = 0; i < m; i++) {
+        if (p[i] != q[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+dedup_table* dedup_create(size_t m) {
+    dedup_table* table = malloc(sizeof(dedup_table));
+    table->m = m;
+    table->count = 0;
+    table->capacity = DEDUP_INITIAL_CAPACITY;
+    table->slots = calloc(table->capacity, sizeof(dedup_slot));
+    if (table->slots == NULL) {
+        failwith("Could not allocate the deduplication table!\n");
+    }
+    return table;
+}
+
+static void grow(dedup_table* table) {
+    size_t old_capacity = table->capacity;
+    dedup_slot* old_slots = table->slots;
+    size_t i;
+    table->capacity *= 2;
+    table->slots = calloc(table->capacity, sizeof(dedup_slot));
+    if (table->slots == NULL) {
+        failwith("Could not grow the deduplication table!\n");
+    }
+    for (i = 0; i < old_capacity; i++) {
+        if (old_slots[i].row == NULL) {
+            continue;
+        }
+        size_t slot = old_slots[i].hash & (table->capacity - 1);
+        while (table->slots[slot].row != NULL) {
+            slot = (slot + 1) & (table->capacity - 1);
+        }
+        table->slots[slot] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+size_t dedup_insert(dedup_table* table, double* row, size_t index, bool* inserted) {
+    if (2 * (table->count + 1) > table->capacity) {
+        grow(table);
+    }
+    uint64_t hash = hash_row(row, table->m);
+    size_t slot = hash & (table->capacity - 1);
+    while (table->slots[slot].row != NULL) {
+        if (table->slots[slot].hash == hash && rows_equal(table->slots[slot].row, row, table->m)) {
+            *inserted = false;
+            return table->slots[slot].index;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    table->slots[slot].row = row;
+    table->slots[slot].hash = hash;
+    table->slots[slot].index = index;
+    table->count += 1;
+    *inserted = true;
+    return index;
+}
+
+size_t dedup_count(dedup_table* table) {
+    return table->count;
+}
+
+void dedup_free(dedup_table* table) {
+    free(table->slots);
+    free(table);
+}
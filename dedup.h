@@ -0,0 +1,43 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * @brief A hash table of rows, used to collapse identical rows into a single weighted row while parsing.
+ *
+ * The table only keeps pointers to the rows, so the rows must stay where they are while the table is in use.
+ */
+typedef struct dedup_table dedup_table;
+
+/**
+ * @brief Create an empty table for rows of m columns.
+ */
+dedup_table* dedup_create(size_t m);
+
+/**
+ * @brief Look up a row, and add it when it has not been seen before.
+ *
+ * Rows are identical when all of their values are, 0.0 and -0.0 are treated as the same value.
+ *
+ * @param table The table.
+ * @param row The row to look up.
+ * @param index The index the row gets when it is new.
+ * @param inserted Set to whether the row was new.
+ *
+ * @return The index of the first identical row, or index when the row is new.
+ */
+size_t dedup_insert(dedup_table* table, double* row, size_t index, bool* inserted);
+
+/**
+ * @brief The amount of distinct rows in the table.
+ */
+size_t dedup_count(dedup_table* table);
+
+/**
+ * @brief Free the table, but not the rows.
+ */
+void dedup_free(dedup_table* table);
+
+#endif
@@ -0,0 +1,336 @@
+/**
+ *
+ * This module spreads Lloyd's algorithm over machines, see distributed.h for the shape of a run.
+ *
+ * A run goes through these messages, each a distributed_header followed by its payload:
+ *   JOIN       worker to coordinator: the port the worker listens on for its children, m and n.
+ *   ASSIGN     coordinator to worker: the rank, the amount of workers, k, the seeding, and where the parent listens.
+ *   HELLO      child to parent, once connected: the rank of the child.
+ *   SEED       worker 0 to coordinator: the k * m seeded kernels.
+ *   KERNELS    down the tree: whether to stop, and the k * m kernels to label the rows with.
+ *   PARTIALS   up the tree: k counts and k * m sums, of the shards in the subtree.
+ *
+ */
+
+#include "distributed.h"
+#include "fail.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+enum {
+    MESSAGE_JOIN = 1,
+    MESSAGE_ASSIGN,
+    MESSAGE_HELLO,
+    MESSAGE_SEED,
+    MESSAGE_KERNELS,
+    MESSAGE_PARTIALS
+};
+
+typedef struct {
+    uint32_t magic;   // DISTRIBUTED_MAGIC.
+    uint32_t type;    // One of the messages above.
+    uint32_t version; // DISTRIBUTED_VERSION.
+    uint32_t flag;    // ASSIGN: generate kernels, KERNELS: stop after labeling.
+    uint64_t a;       // JOIN: the port, ASSIGN: the rank, HELLO: the rank, KERNELS: the iteration.
+    uint64_t b;       // JOIN: m, ASSIGN: the amount of workers.
+    uint64_t c;       // JOIN: n, ASSIGN: k.
+    uint64_t d;       // ASSIGN: the seed, then the port of the parent.
+    uint64_t e;       // ASSIGN: the IPv4 address of the parent (network order), 0 for the coordinator.
+} distributed_header;
+
+static void send_message(int fd, uint32_t type, uint32_t flag, uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e,
+        const double* payload, size_t count) {
+    distributed_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DISTRIBUTED_MAGIC;
+    header.type = type;
+    header.version = DISTRIBUTED_VERSION;
+    header.flag = flag;
+    header.a = a;
+    header.b = b;
+    header.c = c;
+    header.d = d;
+    header.e = e;
+    if (!write_exactly(fd, &header, sizeof(header)) || (count > 0 && !write_exactly(fd, payload, sizeof(double) * count))) {
+        failwith("Lost the connection to another node of the distributed run!\n");
+    }
+}
+
+static distributed_header receive_message(int fd, uint32_t type, double* payload, size_t count) {
+    distributed_header header;
+    if (!read_exactly(fd, &header, sizeof(header))) {
+        failwith("Lost the connection to another node of the distributed run!\n");
+    }
+    if (header.magic != DISTRIBUTED_MAGIC || header.version != DISTRIBUTED_VERSION || header.type != type) {
+        failwithf("Expected message %u from another node, but got something else (version %u, type %u)!\n",
+                type, header.version, header.type);
+    }
+    if (count > 0 && !read_exactly(fd, payload, sizeof(double) * count)) {
+        failwith("Lost the connection to another node of the distributed run!\n");
+    }
+    return header;
+}
+
+/**
+ * @brief Listen for TCP connections on every interface, port 0 picks a free port.
+ */
+static int listen_on(unsigned int port, unsigned int* actual) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t) port);
+    socklen_t length = sizeof(address);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0
+            || getsockname(fd, (struct sockaddr*) &address, &length) != 0) {
+        failwithf("Could not listen on port %u!\n", port);
+    }
+    *actual = ntohs(address.sin_port);
+    return fd;
+}
+
+/**
+ * @brief Messages are small and answered at once, so they are sent without waiting to fill a packet.
+ */
+static void no_delay(int fd) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+static int accept_from(int listener, struct sockaddr_in* peer) {
+    socklen_t length = sizeof(*peer);
+    int fd = accept(listener, (struct sockaddr*) peer, &length);
+    if (fd < 0) {
+        failwith("Could not accept a connection of the distributed run!\n");
+    }
+    no_delay(fd);
+    return fd;
+}
+
+static int connect_to(const struct sockaddr_in* address) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (const struct sockaddr*) address, sizeof(*address)) != 0) {
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &address->sin_addr, host, sizeof(host));
+        failwithf("Could not connect to %s:%u!\n", host, ntohs(address->sin_port));
+    }
+    no_delay(fd);
+    return fd;
+}
+
+void distributed_coordinate(unsigned int port, size_t workers, const k_means_options* options, const char* separator) {
+    const size_t k = options->k;
+    unsigned int actual;
+    int listener = listen_on(port, &actual);
+    fprintf(stderr, "Coordinating on port %u, waiting for %zu workers.\n", actual, workers);
+    int* fds = malloc(sizeof(int) * workers);
+    struct sockaddr_in* peers = malloc(sizeof(struct sockaddr_in) * workers);
+    uint64_t* ports = malloc(sizeof(uint64_t) * workers);
+    size_t m = 0, n = 0, w, ki, vi;
+    for (w = 0; w < workers; w++) {
+        fds[w] = accept_from(listener, &peers[w]);
+        distributed_header join = receive_message(fds[w], MESSAGE_JOIN, NULL, 0);
+        if (w > 0 && join.b != m) {
+            failwithf("Worker %zu has %llu columns, but the first worker has %zu!\n", w, (unsigned long long) join.b, m);
+        }
+        ports[w] = join.a;
+        m = join.b;
+        n += join.c;
+    }
+    close(listener);
+    for (w = 0; w < workers; w++) {
+        // Worker 0 reports to the coordinator, the others to their parent in the tree.
+        uint64_t parent_port = (w == 0) ? 0 : ports[(w - 1) / 2];
+        uint64_t parent_address = (w == 0) ? 0 : peers[(w - 1) / 2].sin_addr.s_addr;
+        send_message(fds[w], MESSAGE_ASSIGN, options->generate_kernels, w, workers, k,
+                ((uint64_t) options->seed << 32) | parent_port, parent_address, NULL, 0);
+        if (w > 0) {
+            close(fds[w]);
+        }
+    }
+
+    double* kernels = malloc(sizeof(double) * k * m);
+    double* partials = malloc(sizeof(double) * k * (m + 1));
+    double** kernel_rows = malloc(sizeof(double*) * k);
+    for (ki = 0; ki < k; ki++) {
+        kernel_rows[ki] = kernels + ki * m;
+    }
+    receive_message(fds[0], MESSAGE_SEED, kernels, k * m);
+    size_t iterations = options->first_iteration;
+    bool stop = false;
+    while (true) {
+        send_message(fds[0], MESSAGE_KERNELS, stop, iterations, 0, 0, 0, 0, kernels, k * m);
+        if (stop) {
+            break;
+        }
+        receive_message(fds[0], MESSAGE_PARTIALS, partials, k * (m + 1));
+        iterations += 1;
+        double movement = 0.0;
+        for (ki = 0; ki < k; ki++) {
+            if (partials[ki] <= 0.0) {
+                // An empty cluster keeps its kernel.
+                continue;
+            }
+            double distance = 0.0;
+            for (vi = 0; vi < m; vi++) {
+                double mean = partials[k + ki * m + vi] / partials[ki];
+                distance += (mean - kernels[ki * m + vi]) * (mean - kernels[ki * m + vi]);
+                kernels[ki * m + vi] = mean;
+            }
+            movement += sqrt(distance);
+        }
+        if (movement != movement) {
+            failwithf("Movement was nan after %zu iterations!\n", iterations);
+        }
+        stop = movement < DBL_EPSILON || iterations >= K_MEANS_MAX_ITERATIONS
+                || (options->on_iteration != NULL
+                    && !options->on_iteration(iterations, movement, kernel_rows, k, m, options->iteration_context));
+    }
+    close(fds[0]);
+    fprintf(stderr, "Clustered %zu rows on %zu workers in %zu iterations.\n", n, workers, iterations);
+    for (ki = 0; ki < k; ki++) {
+        for (vi = 0; vi < m; vi++) {
+            printf("%s%lf", (vi == 0) ? "" : separator, kernels[ki * m + vi]);
+        }
+        printf("\n");
+    }
+    free(kernel_rows);
+    free(kernels);
+    free(partials);
+    free(fds);
+    free(peers);
+    free(ports);
+}
+
+/**
+ * @brief Resolve host:port to an IPv4 address.
+ */
+static struct sockaddr_in resolve(const char* address) {
+    char* host = strdup(address);
+    char* colon = strrchr(host, ':');
+    if (colon == NULL) {
+        failwithf("Expected host:port, but got '%s'!\n", address);
+    }
+    *colon = '\0';
+    struct addrinfo hints;
+    struct addrinfo* found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &found) != 0) {
+        failwithf("Could not resolve '%s'!\n", address);
+    }
+    struct sockaddr_in resolved = *(struct sockaddr_in*) found->ai_addr;
+    freeaddrinfo(found);
+    free(host);
+    return resolved;
+}
+
+size_t* distributed_work(const char* address, double** data_rows, size_t n, size_t m, const double* row_weights) {
+    struct sockaddr_in coordinator_address = resolve(address);
+    unsigned int port;
+    int listener = listen_on(0, &port);
+    int coordinator = connect_to(&coordinator_address);
+    send_message(coordinator, MESSAGE_JOIN, 0, port, m, n, 0, 0, NULL, 0);
+    distributed_header assignment = receive_message(coordinator, MESSAGE_ASSIGN, NULL, 0);
+    size_t rank = assignment.a;
+    size_t workers = assignment.b;
+    size_t k = assignment.c;
+    size_t ri, ki, vi, c;
+
+    // Connect to the parent first, it accepts its children once it connected to its own parent.
+    int up = coordinator;
+    if (rank > 0) {
+        close(coordinator);
+        struct sockaddr_in parent;
+        memset(&parent, 0, sizeof(parent));
+        parent.sin_family = AF_INET;
+        parent.sin_addr.s_addr = (uint32_t) assignment.e;
+        parent.sin_port = htons((uint16_t) (assignment.d & 0xFFFF));
+        up = connect_to(&parent);
+        send_message(up, MESSAGE_HELLO, 0, rank, 0, 0, 0, 0, NULL, 0);
+    }
+    size_t children = 0;
+    int child_fds[2];
+    for (c = 2 * rank + 1; c <= 2 * rank + 2 && c < workers; c++) {
+        struct sockaddr_in peer;
+        child_fds[children] = accept_from(listener, &peer);
+        receive_message(child_fds[children], MESSAGE_HELLO, NULL, 0);
+        children += 1;
+    }
+    close(listener);
+
+    double* kernels = malloc(sizeof(double) * k * m);
+    double* partials = malloc(sizeof(double) * k * (m + 1));
+    double* child_partials = malloc(sizeof(double) * k * (m + 1));
+    double** kernel_rows = malloc(sizeof(double*) * k);
+    for (ki = 0; ki < k; ki++) {
+        kernel_rows[ki] = kernels + ki * m;
+    }
+    size_t* labels = malloc(sizeof(size_t) * (n + 1));
+    k_means_options options = k_means_default_options(k, assignment.flag != 0);
+    options.seed = (unsigned int) (assignment.d >> 32);
+    options.row_weights = row_weights;
+    if (rank == 0) {
+        // The seeding of a run in a single process, on the first shard.
+        kmeans_ctx ctx;
+        kmeans_status status = kmeans_ctx_init(&ctx, &options, data_rows, n, m, labels, NULL, 0);
+        if (status != KMEANS_OK) {
+            failwithf("Could not seed %zu kernels from the %zu rows of the first worker: %s!\n", k, n, kmeans_status_message(status));
+        }
+        for (ki = 0; ki < k; ki++) {
+            memcpy(kernels + ki * m, ctx.kernels[ki], sizeof(double) * m);
+        }
+        kmeans_free(&ctx);
+        send_message(up, MESSAGE_SEED, 0, 0, 0, 0, 0, 0, kernels, k * m);
+    }
+
+    while (true) {
+        distributed_header message = receive_message(up, MESSAGE_KERNELS, kernels, k * m);
+        for (c = 0; c < children; c++) {
+            send_message(child_fds[c], MESSAGE_KERNELS, message.flag, message.a, 0, 0, 0, 0, kernels, k * m);
+        }
+        k_means_assign(&options, data_rows, n, m, kernel_rows, labels);
+        if (message.flag) {
+            break;
+        }
+        memset(partials, 0, sizeof(double) * k * (m + 1));
+        for (ri = 0; ri < n; ri++) {
+            double weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+            partials[labels[ri]] += weight;
+            for (vi = 0; vi < m; vi++) {
+                partials[k + labels[ri] * m + vi] += weight * data_rows[ri][vi];
+            }
+        }
+        for (c = 0; c < children; c++) {
+            receive_message(child_fds[c], MESSAGE_PARTIALS, child_partials, k * (m + 1));
+            for (vi = 0; vi < k * (m + 1); vi++) {
+                partials[vi] += child_partials[vi];
+            }
+        }
+        send_message(up, MESSAGE_PARTIALS, 0, 0, 0, 0, 0, 0, partials, k * (m + 1));
+    }
+    for (c = 0; c < children; c++) {
+        close(child_fds[c]);
+    }
+    close(up);
+    free(kernel_rows);
+    free(kernels);
+    free(partials);
+    free(child_partials);
+    return labels;
+}
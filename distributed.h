@@ -0,0 +1,43 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <stdlib.h>
+#include "k_means.h"
+
+/**
+ * @brief Euclidean k-means over TCP, between a coordinator (--coordinate) and workers that each hold a shard (--join).
+ *
+ * The workers connect to the coordinator, which ranks them in the order they joined and arranges them in a binary tree:
+ * worker r reports to worker (r - 1) / 2, and worker 0 to the coordinator. Worker 0 seeds the kernels from its shard.
+ * Every iteration, the kernels are broadcast down the tree, every worker labels its own rows, and the counts and sums
+ * of the shards are added up the tree, so each link carries k * (m + 1) doubles per iteration, however many workers there are.
+ * All messages are raw binary in the byte order of the hosts, which must therefore agree.
+ */
+
+#define DISTRIBUTED_MAGIC 0x44534D43u // "CMSD" in memory.
+#define DISTRIBUTED_VERSION 1
+
+/**
+ * @brief Coordinate a distributed run and print the final kernels, one per line, to stdout.
+ *
+ * @param port The TCP port to listen on, on every interface.
+ * @param workers The amount of workers to wait for before starting.
+ * @param options The amount of kernels, the seeding (generate_kernels and seed) and on_iteration are used.
+ * @param separator Printed between the values of a kernel.
+ */
+void distributed_coordinate(unsigned int port, size_t workers, const k_means_options* options, const char* separator);
+
+/**
+ * @brief Join a distributed run as a worker, and label the rows of the shard once it is done.
+ *
+ * @param address Where the coordinator listens, as host:port.
+ * @param data_rows The shard, an n by m matrix, every worker must have the same m.
+ * @param n The amount of rows in the shard.
+ * @param m The amount of columns in each row.
+ * @param row_weights The weight of each row, or NULL when all rows weigh 1.
+ *
+ * @return The kernel (0 .. k - 1) of each row of the shard.
+ */
+size_t* distributed_work(const char* address, double** data_rows, size_t n, size_t m, const double* row_weights);
+
+#endif
@@ -0,0 +1,294 @@
+/**
+ *
+ * This module fits Gaussian mixture models with diagonal covariances using expectation-maximization.
+ *
+ * The E-step computes how probable each component is for each row, in log-space to avoid underflow.
+ * The M-step re-estimates the components from the sufficient statistics of the E-step:
+ * the summed probabilities, the probability-weighted sums and the probability-weighted squares of the rows.
+ * Both are done in a single pass over the rows per iteration, split over the threads of the parallel-module.
+ *
+ */
+
+#include "gmm.h"
+#include "k_means.h"
+#include "parallel.h"
+#include "fail.h"
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <time.h>
+
+// Rows are processed in blocks, so the log-probabilities of a block stay in cache for the log-sum-exp.
+#define GMM_BLOCK 256
+
+#define GMM_MAX_ITERATIONS 500
+
+// EM stops when the average log-likelihood per row improves less than this.
+#define GMM_TOLERANCE 1e-6
+
+// Variances are floored at this fraction of the overall variance of a column, so components cannot collapse onto a point.
+#define GMM_VARIANCE_FLOOR 1e-6
+
+typedef struct {
+    double** data_rows;
+    size_t k;
+    size_t m;
+    double* means;            // k by m.
+    double* inverse_variance; // k by m.
+    double* log_constant;     // k, log(weight) - 0.5 * log(det(2 pi covariance)).
+    size_t* labels;
+    double* probabilities;    // n by k or NULL.
+    // Sufficient statistics, one set per thread.
+    double** counts;
+    double** sums;
+    double** squares;
+    double* log_likelihood;
+} gmm_context;
+
+static void gmm_chunk(size_t from, size_t to, size_t worker, void* context) {
+    gmm_context* g = context;
+    size_t k = g->k;
+    size_t m = g->m;
+    double* log_p = malloc(sizeof(double) * GMM_BLOCK * k);
+    double* counts = g->counts[worker];
+    double* sums = g->sums[worker];
+    double* squares = g->squares[worker];
+    double log_likelihood = 0.0;
+    size_t block, ri, j, vi;
+
+    for (block = from; block < to; block += GMM_BLOCK) {
+        size_t end = (block + GMM_BLOCK < to) ? block + GMM_BLOCK : to;
+        // E-step, the log-probability of every component for every row of the block.
+        for (ri = block; ri < end; ri++) {
+            double* row = g->data_rows[ri];
+            double* out = log_p + (ri - block) * k;
+            for (j = 0; j < k; j++) {
+                const double* mean = g->means + j * m;
+                const double* inverse = g->inverse_variance + j * m;
+                double mahalanobis = 0.0;
+                for (vi = 0; vi < m; vi++) {
+                    double d = row[vi] - mean[vi];
+                    mahalanobis += d * d * inverse[vi];
+                }
+                out[j] = g->log_constant[j] - 0.5 * mahalanobis;
+            }
+        }
+        // Normalize with log-sum-exp and accumulate the statistics for the M-step.
+        for (ri = block; ri < end; ri++) {
+            double* row = g->data_rows[ri];
+            double* out = log_p + (ri - block) * k;
+            double largest = -INFINITY;
+            size_t likeliest = 0;
+            for (j = 0; j < k; j++) {
+                if (out[j] > largest) {
+                    largest = out[j];
+                    likeliest = j;
+                }
+            }
+            double total = 0.0;
+            for (j = 0; j < k; j++) {
+                out[j] = exp(out[j] - largest);
+                total += out[j];
+            }
+            log_likelihood += largest + log(total);
+            g->labels[ri] = likeliest;
+            for (j = 0; j < k; j++) {
+                double responsibility = out[j] / total;
+                if (g->probabilities != NULL) {
+                    g->probabilities[ri * k + j] = responsibility;
+                }
+                if (responsibility < DBL_MIN) {
+                    continue;
+                }
+                counts[j] += responsibility;
+                for (vi = 0; vi < m; vi++) {
+                    sums[j * m + vi] += responsibility * row[vi];
+                    squares[j * m + vi] += responsibility * row[vi] * row[vi];
+                }
+            }
+        }
+    }
+    g->log_likelihood[worker] = log_likelihood;
+    free(log_p);
+}
+
+/**
+ * @brief Recompute the log-normalization of every component from its weight and variances.
+ */
+static void update_constants(gmm_context* g, double* weights, double* variances) {
+    size_t j, vi;
+    for (j = 0; j < g->k; j++) {
+        double log_det = 0.0;
+        for (vi = 0; vi < g->m; vi++) {
+            g->inverse_variance[j * g->m + vi] = 1.0 / variances[j * g->m + vi];
+            log_det += log(2.0 * M_PI * variances[j * g->m + vi]);
+        }
+        g->log_constant[j] = log(weights[j]) - 0.5 * log_det;
+    }
+}
+
+size_t* gmm(const size_t k, double** data_rows, size_t n, size_t m, bool generate_kernels, bool kmeans_init, double* probabilities) {
+    if (n < k) {
+        failwithf("Cannot fit %zu components to %zu rows!\n", k, n);
+    }
+    size_t threads = parallel_threads();
+    size_t ri, j, vi, t, iteration;
+
+    // The overall mean and variance of each column, used to initialize and floor the variances.
+    double* column_mean = calloc(m, sizeof(double));
+    double* column_variance = calloc(m, sizeof(double));
+    for (ri = 0; ri < n; ri++) {
+        for (vi = 0; vi < m; vi++) {
+            column_mean[vi] += data_rows[ri][vi];
+        }
+    }
+    for (vi = 0; vi < m; vi++) {
+        column_mean[vi] /= (double) n;
+    }
+    for (ri = 0; ri < n; ri++) {
+        for (vi = 0; vi < m; vi++) {
+            double d = data_rows[ri][vi] - column_mean[vi];
+            column_variance[vi] += d * d;
+        }
+    }
+    double* floor_variance = malloc(sizeof(double) * m);
+    for (vi = 0; vi < m; vi++) {
+        column_variance[vi] /= (double) n;
+        floor_variance[vi] = GMM_VARIANCE_FLOOR * ((column_variance[vi] > 0.0) ? column_variance[vi] : 1.0);
+    }
+
+    gmm_context g;
+    g.data_rows = data_rows;
+    g.k = k;
+    g.m = m;
+    g.means = malloc(sizeof(double) * k * m);
+    g.inverse_variance = malloc(sizeof(double) * k * m);
+    g.log_constant = malloc(sizeof(double) * k);
+    g.labels = malloc(sizeof(size_t) * n);
+    g.probabilities = probabilities;
+    g.counts = malloc(sizeof(double*) * threads);
+    g.sums = malloc(sizeof(double*) * threads);
+    g.squares = malloc(sizeof(double*) * threads);
+    g.log_likelihood = malloc(sizeof(double) * threads);
+    for (t = 0; t < threads; t++) {
+        g.counts[t] = malloc(sizeof(double) * k);
+        g.sums[t] = malloc(sizeof(double) * k * m);
+        g.squares[t] = malloc(sizeof(double) * k * m);
+    }
+    double* weights = malloc(sizeof(double) * k);
+    double* variances = malloc(sizeof(double) * k * m);
+    double* counts = malloc(sizeof(double) * k);
+    double* sums = malloc(sizeof(double) * k * m);
+    double* squares = malloc(sizeof(double) * k * m);
+
+    if (kmeans_init) {
+        // Hard k-means memberships give the first estimate of every component.
+        size_t* labels = k_means(k, data_rows, n, m, generate_kernels);
+        memset(counts, 0, sizeof(double) * k);
+        memset(sums, 0, sizeof(double) * k * m);
+        memset(squares, 0, sizeof(double) * k * m);
+        for (ri = 0; ri < n; ri++) {
+            j = labels[ri];
+            counts[j] += 1.0;
+            for (vi = 0; vi < m; vi++) {
+                sums[j * m + vi] += data_rows[ri][vi];
+                squares[j * m + vi] += data_rows[ri][vi] * data_rows[ri][vi];
+            }
+        }
+        free(labels);
+        for (j = 0; j < k; j++) {
+            weights[j] = (counts[j] > 0.0) ? counts[j] / (double) n : 1.0 / (double) n;
+            for (vi = 0; vi < m; vi++) {
+                double mean = (counts[j] > 0.0) ? sums[j * m + vi] / counts[j] : column_mean[vi];
+                double variance = (counts[j] > 0.0) ? squares[j * m + vi] / counts[j] - mean * mean : column_variance[vi];
+                g.means[j * m + vi] = mean;
+                variances[j * m + vi] = (variance > floor_variance[vi]) ? variance : floor_variance[vi];
+            }
+        }
+    } else {
+        srand(time(NULL));
+        double** kernels = (generate_kernels) ? generate_mean_kernels(data_rows, n, m, k, NULL) : pick_random_kernels(data_rows, n, m, k, NULL);
+        for (j = 0; j < k; j++) {
+            weights[j] = 1.0 / (double) k;
+            for (vi = 0; vi < m; vi++) {
+                g.means[j * m + vi] = kernels[j][vi];
+                variances[j * m + vi] = (column_variance[vi] > floor_variance[vi]) ? column_variance[vi] : floor_variance[vi];
+            }
+            free(kernels[j]);
+        }
+        free(kernels);
+    }
+    update_constants(&g, weights, variances);
+
+    double previous_log_likelihood = -INFINITY;
+    for (iteration = 0; iteration < GMM_MAX_ITERATIONS; iteration++) {
+        for (t = 0; t < threads; t++) {
+            memset(g.counts[t], 0, sizeof(double) * k);
+            memset(g.sums[t], 0, sizeof(double) * k * m);
+            memset(g.squares[t], 0, sizeof(double) * k * m);
+            g.log_likelihood[t] = 0.0;
+        }
+        parallel_for(n, gmm_chunk, &g);
+
+        double log_likelihood = 0.0;
+        memset(counts, 0, sizeof(double) * k);
+        memset(sums, 0, sizeof(double) * k * m);
+        memset(squares, 0, sizeof(double) * k * m);
+        for (t = 0; t < threads; t++) {
+            log_likelihood += g.log_likelihood[t];
+            for (j = 0; j < k; j++) {
+                counts[j] += g.counts[t][j];
+            }
+            for (vi = 0; vi < k * m; vi++) {
+                sums[vi] += g.sums[t][vi];
+                squares[vi] += g.squares[t][vi];
+            }
+        }
+        if (log_likelihood != log_likelihood) {
+            failwithf("The log-likelihood was nan after %zu iterations\n", iteration);
+        }
+        // The labels (and probabilities) of this E-step match the current components, so we can stop right here.
+        if ((log_likelihood - previous_log_likelihood) / (double) n < GMM_TOLERANCE) {
+            break;
+        }
+        previous_log_likelihood = log_likelihood;
+
+        // M-step.
+        for (j = 0; j < k; j++) {
+            if (counts[j] < DBL_EPSILON) {
+                // An empty component keeps its previous estimate.
+                continue;
+            }
+            weights[j] = counts[j] / (double) n;
+            for (vi = 0; vi < m; vi++) {
+                double mean = sums[j * m + vi] / counts[j];
+                double variance = squares[j * m + vi] / counts[j] - mean * mean;
+                g.means[j * m + vi] = mean;
+                variances[j * m + vi] = (variance > floor_variance[vi]) ? variance : floor_variance[vi];
+            }
+        }
+        update_constants(&g, weights, variances);
+    }
+
+    for (t = 0; t < threads; t++) {
+        free(g.counts[t]);
+        free(g.sums[t]);
+        free(g.squares[t]);
+    }
+    free(g.counts);
+    free(g.sums);
+    free(g.squares);
+    free(g.log_likelihood);
+    free(g.means);
+    free(g.inverse_variance);
+    free(g.log_constant);
+    free(weights);
+    free(variances);
+    free(counts);
+    free(sums);
+    free(squares);
+    free(column_mean);
+    free(column_variance);
+    free(floor_variance);
+    return g.labels;
+}
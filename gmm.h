@@ -0,0 +1,25 @@
+#ifndef GMM_H
+#define GMM_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * @brief Fit a Gaussian mixture with diagonal covariances using expectation-maximization (EM).
+ *
+ * Every cluster gets its own weight, mean and per-column variance, and every row gets a probability
+ * of belonging to each cluster (soft clustering) instead of a single kernel.
+ *
+ * @param k The amount of mixture components (clusters).
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param generate_kernels Whether the initial means should be generated or selected randomly from the data.
+ * @param kmeans_init Whether to start from a k-means clustering instead of the initial means alone.
+ * @param probabilities Receives the n by k membership probabilities (row-major) when not NULL.
+ *
+ * @return The most probable component of each row.
+ */
+size_t* gmm(size_t k, double** data_rows, size_t n, size_t m, bool generate_kernels, bool kmeans_init, double* probabilities);
+
+#endif
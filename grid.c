@@ -0,0 +1,152 @@
+/**
+ *
+ * This module quantizes low-dimensional rows to a grid, so that massive inputs can be clustered as a few weighted cells.
+ *
+ * The coordinates of a cell are packed into a single 64-bit key, and keys are numbered in order of appearance
+ * with an open-addressing hash table. The keys are computed in parallel, the numbering is a single serial pass.
+ *
+ */
+
+#include "grid.h"
+#include "reduce.h"
+#include "parallel.h"
+#include "fail.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct {
+    double** data_rows;
+    size_t m;
+    size_t bins;
+    const double* minimum;
+    double scale[GRID_MAX_COLUMNS];
+    uint64_t* keys;
+} grid_context;
+
+static void key_chunk(size_t from, size_t to, size_t worker, void* context) {
+    grid_context* g = context;
+    size_t ri, vi;
+    for (ri = from; ri < to; ri++) {
+        uint64_t key = 0;
+        for (vi = 0; vi < g->m; vi++) {
+            double position = (g->data_rows[ri][vi] - g->minimum[vi]) * g->scale[vi];
+            size_t bin = (position > 0.0) ? (size_t) position : 0;
+            // The maximum itself lands just past the last bin.
+            if (bin >= g->bins) {
+                bin = g->bins - 1;
+            }
+            key = (key << 16) | (uint64_t) bin;
+        }
+        g->keys[ri] = key;
+    }
+}
+
+static uint64_t mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+double** grid_cells(double** data_rows, size_t n, size_t m, const double* row_weights,
+        const double* minimum, const double* maximum, size_t bins,
+        size_t* cell_of, size_t* cells, double** cell_weights) {
+    if (m > GRID_MAX_COLUMNS) {
+        failwithf("The grid supports at most %d columns, got %zu!\n", GRID_MAX_COLUMNS, m);
+    }
+    if (bins == 0 || bins > GRID_MAX_BINS) {
+        failwithf("The grid needs between 1 and %d bins per column, got %zu!\n", GRID_MAX_BINS, bins);
+    }
+    size_t ri, vi, slot;
+
+    grid_context g;
+    g.data_rows = data_rows;
+    g.m = m;
+    g.bins = bins;
+    g.minimum = minimum;
+    for (vi = 0; vi < m; vi++) {
+        double range = maximum[vi] - minimum[vi];
+        g.scale[vi] = (range > 0.0) ? (double) bins / range : 0.0;
+    }
+    g.keys = malloc(sizeof(uint64_t) * n);
+    if (g.keys == NULL) {
+        failwith("Could not allocate the grid keys!\n");
+    }
+    parallel_for(n, key_chunk, &g);
+
+    // Number the occupied cells, the table is kept at most half full.
+    size_t capacity = 1024;
+    size_t count = 0;
+    uint64_t* table_keys = malloc(sizeof(uint64_t) * capacity);
+    size_t* table_cells = malloc(sizeof(size_t) * capacity);
+    bool* used = calloc(capacity, sizeof(bool));
+    for (ri = 0; ri < n; ri++) {
+        if (2 * (count + 1) > capacity) {
+            size_t old_capacity = capacity;
+            uint64_t* old_keys = table_keys;
+            size_t* old_cells = table_cells;
+            bool* old_used = used;
+            capacity *= 2;
+            table_keys = malloc(sizeof(uint64_t) * capacity);
+            table_cells = malloc(sizeof(size_t) * capacity);
+            used = calloc(capacity, sizeof(bool));
+            if (table_keys == NULL || table_cells == NULL || used == NULL) {
+                failwith("Could not grow the grid table!\n");
+            }
+            for (slot = 0; slot < old_capacity; slot++) {
+                if (!old_used[slot]) {
+                    continue;
+                }
+                size_t target = mix(old_keys[slot]) & (capacity - 1);
+                while (used[target]) {
+                    target = (target + 1) & (capacity - 1);
+                }
+                used[target] = true;
+                table_keys[target] = old_keys[slot];
+                table_cells[target] = old_cells[slot];
+            }
+            free(old_keys);
+            free(old_cells);
+            free(old_used);
+        }
+        slot = mix(g.keys[ri]) & (capacity - 1);
+        while (used[slot] && table_keys[slot] != g.keys[ri]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (!used[slot]) {
+            used[slot] = true;
+            table_keys[slot] = g.keys[ri];
+            table_cells[slot] = count;
+            count += 1;
+        }
+        cell_of[ri] = table_cells[slot];
+    }
+    free(table_keys);
+    free(table_cells);
+    free(used);
+    free(g.keys);
+
+    // The centroid of a cell is the weighted mean of its rows, which is what k-means would see of them.
+    double** centroids = allocate_rows(count, m);
+    double* weights = calloc(count, sizeof(double));
+    for (ri = 0; ri < count; ri++) {
+        memset(centroids[ri], 0, sizeof(double) * m);
+    }
+    for (ri = 0; ri < n; ri++) {
+        double weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+        size_t cell = cell_of[ri];
+        weights[cell] += weight;
+        for (vi = 0; vi < m; vi++) {
+            centroids[cell][vi] += weight * data_rows[ri][vi];
+        }
+    }
+    for (ri = 0; ri < count; ri++) {
+        for (vi = 0; vi < m && weights[ri] > 0.0; vi++) {
+            centroids[ri][vi] /= weights[ri];
+        }
+    }
+    *cells = count;
+    *cell_weights = weights;
+    return centroids;
+}
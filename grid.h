@@ -0,0 +1,33 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <stdlib.h>
+
+// Cell coordinates are packed into 64 bits, 16 bits per column.
+#define GRID_MAX_COLUMNS 4
+#define GRID_MAX_BINS 65536
+
+/**
+ * @brief Bin rows into a grid and collapse every occupied cell into the weighted centroid of its rows.
+ *
+ * Each column is split into equally wide bins between its minimum and maximum,
+ * so the cells adapt to the range of every column. Only occupied cells are kept.
+ *
+ * @param data_rows The data in an n by m matrix, m must be at most GRID_MAX_COLUMNS.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param row_weights The weight of each row, or NULL when all rows weigh 1.
+ * @param minimum The smallest value of each column.
+ * @param maximum The largest value of each column.
+ * @param bins The amount of bins per column, at most GRID_MAX_BINS.
+ * @param cell_of Filled with the cell (0 .. cells - 1) of each row.
+ * @param cells Set to the amount of occupied cells.
+ * @param cell_weights Set to a newly allocated array with the summed weight of each cell.
+ *
+ * @return The centroid of each cell, free it with free_rows.
+ */
+double** grid_cells(double** data_rows, size_t n, size_t m, const double* row_weights,
+        const double* minimum, const double* maximum, size_t bins,
+        size_t* cell_of, size_t* cells, double** cell_weights);
+
+#endif
@@ -0,0 +1,315 @@
+/**
+ *
+ * This module keeps a euclidean clustering up to date as rows are appended to the data.
+ *
+ * The state file is mapped into memory and updated in place, laid out in native byte order as:
+ *   char magic[8], uint32 version, uint32 reserved, uint64 k, uint64 m, uint64 n, double max_drift,
+ *   uint64 columns[m], double kernels[k][m], double sums[k][m], double counts[k], double drift[k],
+ *   and a record per row: uint64 label, double upper, double lower, double weight, double values[m].
+ *
+ * The bounds are stored relative to how far the kernels have drifted since the state was created,
+ * so moving the kernels does not touch the rows at all: the upper bound of a row is its stored upper bound
+ * plus the drift of its kernel, and its lower bound is its stored lower bound minus the largest drift.
+ * Appending rows only writes the new records and the records of the rows that were compared again.
+ *
+ */
+
+#include "incremental.h"
+#include "fail.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// An update stops when this many rounds did not settle every row, like the iteration limit of k_means.
+#define INCREMENTAL_MAX_ROUNDS 2500
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t k;
+    uint64_t m;
+    uint64_t n;
+    double max_drift;  // The summed largest movement of any kernel, per update of the kernels.
+} state_header;
+
+typedef struct {
+    uint64_t label;
+    double upper;   // Relative to the drift of the kernel, see above.
+    double lower;   // Relative to the summed largest drift.
+    double weight;
+    double values[];
+} state_record;
+
+// The state as mapped into memory.
+typedef struct {
+    void* mapping;
+    size_t size;
+    state_header* header;
+    uint64_t* columns;
+    double* kernels;
+    double* sums;
+    double* counts;
+    double* drift;
+    char* records;
+    size_t record_size;
+} state;
+
+static size_t fixed_size(size_t k, size_t m) {
+    return sizeof(state_header) + sizeof(uint64_t) * m + sizeof(double) * (2 * k * m + 2 * k);
+}
+
+static size_t record_size(size_t m) {
+    return sizeof(state_record) + sizeof(double) * m;
+}
+
+static state_record* record(state* s, size_t i) {
+    return (state_record*) (s->records + i * s->record_size);
+}
+
+/**
+ * @brief Resize the state file to hold n rows and map all of it.
+ */
+static state map_state(int fd, size_t k, size_t m, size_t n, const char* path) {
+    state s;
+    s.size = fixed_size(k, m) + n * record_size(m);
+    if (ftruncate(fd, (off_t) s.size) != 0) {
+        failwithf("Could not resize the state '%s'!\n", path);
+    }
+    s.mapping = mmap(NULL, s.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s.mapping == MAP_FAILED) {
+        failwithf("Could not map the state '%s' into memory!\n", path);
+    }
+    s.header = s.mapping;
+    s.columns = (uint64_t*) (s.header + 1);
+    s.kernels = (double*) (s.columns + m);
+    s.sums = s.kernels + k * m;
+    s.counts = s.sums + k * m;
+    s.drift = s.counts + k;
+    s.records = (char*) (s.drift + k);
+    s.record_size = record_size(m);
+    return s;
+}
+
+static void unmap_state(state* s, const char* path) {
+    if (msync(s->mapping, s->size, MS_SYNC) != 0) {
+        failwithf("Could not write the state '%s' back to disk!\n", path);
+    }
+    munmap(s->mapping, s->size);
+}
+
+/**
+ * @brief Find the closest kernel of a row, and the distances to it and to the second closest kernel.
+ */
+static size_t closest_two(const double* kernels, size_t k, size_t m, const double* row, double* closest, double* second) {
+    size_t ki, vi, best = 0;
+    double best_distance = INFINITY, second_distance = INFINITY;
+    for (ki = 0; ki < k; ki++) {
+        double distance = 0.0;
+        for (vi = 0; vi < m; vi++) {
+            double d = row[vi] - kernels[ki * m + vi];
+            distance += d * d;
+        }
+        if (distance < best_distance) {
+            second_distance = best_distance;
+            best_distance = distance;
+            best = ki;
+        } else if (distance < second_distance) {
+            second_distance = distance;
+        }
+    }
+    *closest = sqrt(best_distance);
+    *second = sqrt(second_distance);
+    return best;
+}
+
+static double distance_to(const double* kernel, size_t m, const double* row) {
+    size_t vi;
+    double distance = 0.0;
+    for (vi = 0; vi < m; vi++) {
+        distance += (row[vi] - kernel[vi]) * (row[vi] - kernel[vi]);
+    }
+    return sqrt(distance);
+}
+
+/**
+ * @brief Label a row with its closest kernel, store its bounds and add it to the sums of its cluster.
+ */
+static void label_record(state* s, state_record* r) {
+    size_t k = s->header->k, m = s->header->m, vi;
+    double closest, second;
+    size_t label = closest_two(s->kernels, k, m, r->values, &closest, &second);
+    r->label = label;
+    r->upper = closest - s->drift[label];
+    r->lower = second + s->header->max_drift;
+    s->counts[label] += r->weight;
+    for (vi = 0; vi < m; vi++) {
+        s->sums[label * m + vi] += r->weight * r->values[vi];
+    }
+}
+
+static void write_record(state* s, size_t i, const double* row, double weight) {
+    state_record* r = record(s, i);
+    r->weight = weight;
+    memcpy(r->values, row, sizeof(double) * s->header->m);
+    label_record(s, r);
+}
+
+void incremental_create(const char* path, double** data_rows, size_t n, size_t m, const double* row_weights,
+        const size_t* columns, double** kernels, size_t k) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        failwithf("Could not open '%s' to write the state!\n", path);
+    }
+    state s = map_state(fd, k, m, n, path);
+    close(fd);
+    size_t ki, vi, ri;
+    memset(s.mapping, 0, fixed_size(k, m));
+    memcpy(s.header->magic, INCREMENTAL_MAGIC, sizeof(INCREMENTAL_MAGIC));
+    s.header->version = INCREMENTAL_VERSION;
+    s.header->k = k;
+    s.header->m = m;
+    s.header->n = n;
+    s.header->max_drift = 0.0;
+    for (vi = 0; vi < m; vi++) {
+        s.columns[vi] = columns[vi];
+    }
+    for (ki = 0; ki < k; ki++) {
+        memcpy(s.kernels + ki * m, kernels[ki], sizeof(double) * m);
+    }
+    for (ri = 0; ri < n; ri++) {
+        write_record(&s, ri, data_rows[ri], (row_weights != NULL) ? row_weights[ri] : 1.0);
+    }
+    unmap_state(&s, path);
+}
+
+/**
+ * @brief Move the kernels to the means of their rows and add their movement to the drift.
+ *
+ * @return The largest movement of any kernel.
+ */
+static double move_kernels(state* s) {
+    size_t k = s->header->k, m = s->header->m, ki, vi;
+    double largest = 0.0;
+    for (ki = 0; ki < k; ki++) {
+        if (s->counts[ki] <= 0.0) {
+            // An empty cluster keeps its kernel where it is.
+            continue;
+        }
+        double movement = 0.0;
+        for (vi = 0; vi < m; vi++) {
+            double mean = s->sums[ki * m + vi] / s->counts[ki];
+            double d = mean - s->kernels[ki * m + vi];
+            movement += d * d;
+            s->kernels[ki * m + vi] = mean;
+        }
+        movement = sqrt(movement);
+        s->drift[ki] += movement;
+        largest = (movement > largest) ? movement : largest;
+    }
+    s->header->max_drift += largest;
+    return largest;
+}
+
+size_t* incremental_append(const char* path, double** data_rows, size_t n, size_t m, const double* row_weights,
+        const size_t* columns, size_t* total) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        failwithf("Could not open the state '%s', create it with a full run first!\n", path);
+    }
+    state_header header;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(header) || read(fd, &header, sizeof(header)) != sizeof(header)) {
+        failwithf("'%s' is too small to be a state!\n", path);
+    }
+    if (memcmp(header.magic, INCREMENTAL_MAGIC, sizeof(INCREMENTAL_MAGIC)) != 0) {
+        failwithf("'%s' is not a state file!\n", path);
+    }
+    if (header.version != INCREMENTAL_VERSION) {
+        failwithf("The state '%s' has version %u, but only version %d can be read!\n", path, header.version, INCREMENTAL_VERSION);
+    }
+    if (header.m != m) {
+        failwithf("The state '%s' has %zu columns, but %zu columns are selected!\n", path, (size_t) header.m, m);
+    }
+    size_t k = header.k;
+    size_t old_n = header.n;
+    if (k == 0 || k > (size_t) info.st_size / sizeof(double) / (2 * m + 2) || (size_t) info.st_size != fixed_size(k, m) + old_n * record_size(m)) {
+        failwithf("The state '%s' is corrupt or truncated!\n", path);
+    }
+    // Every check happens before the file grows, a rejected append leaves the state as it was.
+    uint64_t* state_columns = malloc(sizeof(uint64_t) * m);
+    size_t ri, vi;
+    if (pread(fd, state_columns, sizeof(uint64_t) * m, sizeof(state_header)) != (ssize_t) (sizeof(uint64_t) * m)) {
+        failwithf("The state '%s' is corrupt or truncated!\n", path);
+    }
+    for (vi = 0; vi < m; vi++) {
+        if (state_columns[vi] != columns[vi]) {
+            failwithf("The state '%s' was made from other columns than the selected ones!\n", path);
+        }
+    }
+    free(state_columns);
+    state s = map_state(fd, k, m, old_n + n, path);
+    close(fd);
+
+    // Only the new rows are compared to every kernel.
+    for (ri = 0; ri < n; ri++) {
+        write_record(&s, old_n + ri, data_rows[ri], (row_weights != NULL) ? row_weights[ri] : 1.0);
+    }
+    s.header->n = old_n + n;
+    *total = old_n + n;
+
+    size_t round, rechecked = 0, moved = 0;
+    for (round = 0; round < INCREMENTAL_MAX_ROUNDS; round++) {
+        double largest = move_kernels(&s);
+        if (largest < DBL_EPSILON && round > 0) {
+            break;
+        }
+        size_t changes = 0;
+        double max_drift = s.header->max_drift;
+        for (ri = 0; ri < *total; ri++) {
+            state_record* r = record(&s, ri);
+            size_t label = r->label;
+            double upper = r->upper + s.drift[label];
+            double lower = r->lower - max_drift;
+            if (upper <= lower) {
+                continue;
+            }
+            // The bounds overlap, first tighten the upper bound, which is a single distance.
+            upper = distance_to(s.kernels + label * m, m, r->values);
+            r->upper = upper - s.drift[label];
+            if (upper <= lower) {
+                continue;
+            }
+            rechecked += 1;
+            s.counts[label] -= r->weight;
+            for (vi = 0; vi < m; vi++) {
+                s.sums[label * m + vi] -= r->weight * r->values[vi];
+            }
+            label_record(&s, r);
+            if (r->label != label) {
+                changes += 1;
+            }
+        }
+        moved += changes;
+        if (changes == 0) {
+            break;
+        }
+    }
+    fprintf(stderr, "Appended %zu rows to %zu rows in %zu rounds, %zu rows were compared to every kernel again and %zu moved.\n",
+            n, old_n, round + 1, rechecked, moved);
+
+    size_t* labels = malloc(sizeof(size_t) * (*total + 1));
+    for (ri = 0; ri < *total; ri++) {
+        labels[ri] = record(&s, ri)->label;
+    }
+    unmap_state(&s, path);
+    return labels;
+}
@@ -0,0 +1,49 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <stdlib.h>
+
+// The first 8 bytes of every state file.
+#define INCREMENTAL_MAGIC "CMEANSS"
+#define INCREMENTAL_VERSION 1
+
+/**
+ * @brief Save the state of a euclidean clustering, so that rows appended later can be clustered incrementally.
+ *
+ * The state holds the rows themselves, the kernels, the weighted sums and counts of every cluster,
+ * and per row its label with an upper bound on the distance to its kernel and a lower bound on the distance
+ * to any other kernel (as in Hamerly's algorithm). The rows are labeled with the closest of the given kernels.
+ *
+ * @param path Where to write the state.
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param row_weights The weight of each row, or NULL when all rows weigh 1.
+ * @param columns The input column of each of the m values.
+ * @param kernels The k kernels of the clustering.
+ * @param k The amount of kernels.
+ */
+void incremental_create(const char* path, double** data_rows, size_t n, size_t m, const double* row_weights,
+        const size_t* columns, double** kernels, size_t k);
+
+/**
+ * @brief Append rows to a saved state, and update the clustering in place until it is a Lloyd fixed point again.
+ *
+ * Only the new rows are compared to every kernel. After that, the kernels are moved to the means of their rows,
+ * and the bounds of every row are loosened by how far the kernels moved. Only rows whose bounds no longer prove
+ * that their kernel is the closest one are compared again, so the work mostly depends on the amount of new rows.
+ *
+ * @param path The state, written by incremental_create, which is updated in place.
+ * @param data_rows The new rows, an n by m matrix.
+ * @param n The amount of new rows.
+ * @param m The amount of columns in each row, must match the state.
+ * @param row_weights The weight of each new row, or NULL when all rows weigh 1.
+ * @param columns The input column of each of the m values, must match the state.
+ * @param total Set to the amount of rows in the state, including the new ones.
+ *
+ * @return The labels of all rows in the state, the new rows last.
+ */
+size_t* incremental_append(const char* path, double** data_rows, size_t n, size_t m, const double* row_weights,
+        const size_t* columns, size_t* total);
+
+#endif
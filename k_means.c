@@ -7,32 +7,17 @@
 #define _GNU_SOURCE
 #include "k_means.h"
 #include "fail.h"
+#include "rng.h"
 #include <math.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 #include <float.h>
+#include <stddef.h>
+#include <string.h>
 
 
-/**
- * @brief Compare two 64-bit float vectors, but treat them as (void*)'s so that they can be used with q_sort.
- *
- * @param p The first 64-bit float vector (double*).
- * @param q The second 64-bit float vector (double*).
- * @param d The dimension to compare the vectors in (size_t).
- *
- * @return The ordering of the first number in relation to the second.
- */
-int cmpf64v(const void* p, const void* q, void* d) {
-    double* a = *(double**)p;
-    double* b = *(double**)q;
-    size_t dim = *(size_t*)d;
-    if (a[dim] > b[dim]) return 1;
-    else if (a[dim] < b[dim]) return -1;
-    else return 0;
-}
-
 char* reprf64v(double* v, size_t n) {
     size_t i;
     size_t pos = 0;
@@ -67,34 +52,65 @@ double distf64v(double* p, double* q, size_t m) {
     return out;
 }
 
+// A value and the weight of its row, used to find weighted medians and weighted quantiles.
+typedef struct {
+    double value;
+    double weight;
+} weighted_value;
+
+static int cmp_weighted_value(const void* p, const void* q) {
+    double a = ((const weighted_value*)p)->value;
+    double b = ((const weighted_value*)q)->value;
+    return (a > b) - (a < b);
+}
+
 /**
- * @brief Pick random kernels from the data_rows and assign them to the kernels parameter.
+ * @brief Copy k distinct random rows into the kernels, without allocating.
  *
- * @param data_rows The data rows.
- * @param n The number of rows available in the data_rows pointer.
- * @param m The number of columns available in each row of the data_rows pointer.
- * @param k The amount of kernels to pick out.
+ * @param rng The random state to draw from.
+ * @param cumulative Scratch space for n running weights, only used with row weights.
+ * @param previous Scratch space for the k rows picked.
  *
- * @return A set of k kernel (vectors of length m), selected from the data_rows set.
+ * @return KMEANS_ERROR_ROWS when fewer than k rows have a weight above 0.
  */
-double** pick_random_kernels(double** data_rows, size_t n, size_t m, size_t k) {
-    //We have to both allocate an copy the values manually.
-    //We *could* let our kernels point to locations in the data_rows array,
-    // but we're going to sort them later, meaning that the content at those locations might change.
-    
-
-    double** kernels = malloc(sizeof(double*) * k);
+static kmeans_status pick_rows(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights,
+        uint64_t* rng, double* cumulative, size_t* previous, double** kernels) {
     size_t i, j, ri;
-    for (i = 0; i < k; i++) {
-        kernels[i] = malloc(sizeof(double) * m);
+    // With weights, a row is found by searching the running total of the weights for a random fraction of the total.
+    size_t available = n;
+    if (row_weights != NULL) {
+        double total = 0.0;
+        available = 0;
+        for (ri = 0; ri < n; ri++) {
+            total += row_weights[ri];
+            cumulative[ri] = total;
+            available += (row_weights[ri] > 0.0) ? 1 : 0;
+        }
+    }
+    if (available < k) {
+        return KMEANS_ERROR_ROWS;
     }
 
-    size_t* previous = malloc(sizeof(size_t) * k);
     for (i = 0; i < k; i++) {
         size_t row;
         while (true) {
-            double r = (double)(rand()) / (double)(RAND_MAX);
-            row = r * n;
+            double r = rng_uniform(rng);
+            if (row_weights != NULL) {
+                double target = r * cumulative[n - 1];
+                size_t low = 0;
+                size_t high = n - 1;
+                while (low < high) {
+                    size_t middle = low + (high - low) / 2;
+                    if (cumulative[middle] > target) {
+                        high = middle;
+                    } else {
+                        low = middle + 1;
+                    }
+                }
+                row = low;
+            } else {
+                row = r * n;
+            }
             
             bool already_seen = false;
             for (ri = 0; ri < i; ri++) {
@@ -115,7 +131,74 @@ double** pick_random_kernels(double** data_rows, size_t n, size_t m, size_t k) {
             kernels[i][j] = data_rows[row][j];
         }
     }
+    return KMEANS_OK;
+}
+
+/**
+ * @brief Set every column of the kernels to evenly spaced (weighted) quantiles of that column, without allocating.
+ *
+ * @param pairs Scratch space for n weighted values, a column is sorted in there together with the row weights.
+ */
+static void quantile_kernels(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights,
+        weighted_value* pairs, double** kernels) {
+    size_t i, j, ri;
+    for (i = 0; i < m; i++) {
+        //Sort all values along dimension i, the weight of each row follows its value around.
+        double total = 0.0;
+        for (ri = 0; ri < n; ri++) {
+            pairs[ri].value = data_rows[ri][i];
+            pairs[ri].weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+            total += pairs[ri].weight;
+        }
+        qsort(pairs, n, sizeof(weighted_value), cmp_weighted_value);
+        // We need a set of evenly distributed pivots, the rows where the running weight passes j / k of the total.
+        size_t pivot = 0;
+        double running = pairs[0].weight;
+        for (j = 0; j < k; j++) {
+            double target = ((double)(j)) / ((double)(k)) * total;
+            while (running <= target && pivot + 1 < n) {
+                pivot += 1;
+                running += pairs[pivot].weight;
+            }
+            kernels[j][i] = pairs[pivot].value;
+        }
+    }
+}
+
+static double** allocate_kernels(size_t k, size_t m) {
+    size_t i;
+    double** kernels = malloc(sizeof(double*) * k);
+    for (i = 0; i < k; i++) {
+        kernels[i] = malloc(sizeof(double) * m);
+    }
+    return kernels;
+}
+
+/**
+ * @brief Pick random kernels from the data_rows and assign them to the kernels parameter.
+ *
+ * @param data_rows The data rows.
+ * @param n The number of rows available in the data_rows pointer.
+ * @param m The number of columns available in each row of the data_rows pointer.
+ * @param k The amount of kernels to pick out.
+ * @param row_weights The weight of each row, rows are picked with a probability proportional to their weight. NULL weighs all rows equally.
+ *
+ * @return A set of k kernel (vectors of length m), selected from the data_rows set.
+ */
+double** pick_random_kernels(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights) {
+    //We have to both allocate an copy the values manually.
+    //We *could* let our kernels point to locations in the data_rows array,
+    // but we're going to sort them later, meaning that the content at those locations might change.
+    double** kernels = allocate_kernels(k, m);
+    double* cumulative = (row_weights != NULL) ? malloc(sizeof(double) * n) : NULL;
+    size_t* previous = malloc(sizeof(size_t) * k);
+    // Callers seed rand() (srand), which in turn seeds the generator.
+    uint64_t rng = rng_seed((uint64_t) rand());
+    if (pick_rows(data_rows, n, m, k, row_weights, &rng, cumulative, previous, kernels) != KMEANS_OK) {
+        failwithf("Cannot pick %zu kernels from fewer rows (with a weight above 0)!\n", k);
+    }
     free(previous);
+    free(cumulative);
     return kernels;
 }
 
@@ -126,150 +209,473 @@ double** pick_random_kernels(double** data_rows, size_t n, size_t m, size_t k) {
  * @param n The number of rows available in the data_rows pointer.
  * @param m The number of columns in each row of the data_rows pointer.
  * @param k The amount of kernels to generate.
+ * @param row_weights The weight of each row, the kernels are picked at evenly spaced weighted quantiles. NULL weighs all rows equally.
  *
  * @return A set k kernel.
  */
-double** generate_mean_kernels(double** data_rows, size_t n, size_t m, size_t k) {
+double** generate_mean_kernels(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights) {
     // Since we need to sort, we need to copy the data to preserve order.
-    size_t i, j;
-    double** data_rows_copy = malloc(sizeof(double*) * n);
-    for (i = 0; i < n; i++) {
-        data_rows_copy[i] = malloc(sizeof(double) * m);
-        for (j = 0; j < m; j++) {
-            data_rows_copy[i][j] = data_rows[i][j];
-        }
-    }   
+    double** kernels = allocate_kernels(k, m);
+    weighted_value* pairs = malloc(sizeof(weighted_value) * n);
+    quantile_kernels(data_rows, n, m, k, row_weights, pairs, kernels);
+    free(pairs);
+    return kernels;
+}
 
-    double** kernels = malloc(sizeof(double*) * k);
-    
-    for (i = 0; i < k; i++) {
-        kernels[i] = malloc(sizeof(double) * m);
+/*
+ * The assignment step is generated once per metric from a single template, so that the metric is
+ * resolved before the hot loop instead of inside it.
+ * TERM(x, c, w) is the contribution of a single column (x of the row, c of the kernel and w its column weight),
+ * and BETTER is the comparison that decides whether a score beats the best one so far.
+ * The columns are summed into four independent accumulators, which lets the compiler vectorize the sum
+ * without reordering floating point additions on its own, and the best kernel is picked without branches.
+ */
+#define DEFINE_ASSIGN(NAME, TERM, BETTER, WORST)                                                   \
+static void assign_##NAME(double** data_rows, size_t n, size_t m, double** kernels, size_t k,      \
+        const double* column_weights, size_t* followers) {                                         \
+    size_t ri, ki, vi;                                                                             \
+    for (ri = 0; ri < n; ri++) {                                                                   \
+        const double* row = data_rows[ri];                                                         \
+        double best_score = WORST;                                                                 \
+        size_t best_kernel = 0;                                                                    \
+        for (ki = 0; ki < k; ki++) {                                                               \
+            const double* kernel = kernels[ki];                                                    \
+            double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;                                         \
+            for (vi = 0; vi + 4 <= m; vi += 4) {                                                   \
+                s0 += TERM(row[vi], kernel[vi], column_weights[vi]);                               \
+                s1 += TERM(row[vi + 1], kernel[vi + 1], column_weights[vi + 1]);                   \
+                s2 += TERM(row[vi + 2], kernel[vi + 2], column_weights[vi + 2]);                   \
+                s3 += TERM(row[vi + 3], kernel[vi + 3], column_weights[vi + 3]);                   \
+            }                                                                                      \
+            for (; vi < m; vi++) {                                                                 \
+                s0 += TERM(row[vi], kernel[vi], column_weights[vi]);                               \
+            }                                                                                      \
+            double score = (s0 + s1) + (s2 + s3);                                                  \
+            bool better = score BETTER best_score;                                                 \
+            best_score = better ? score : best_score;                                              \
+            best_kernel = better ? ki : best_kernel;                                               \
+        }                                                                                          \
+        followers[ri] = best_kernel;                                                               \
+    }                                                                                              \
+}
+
+// Squared distances pick the same kernel as distances, without a square root per pair.
+#define EUCLIDEAN_TERM(x, c, w) (((x) - (c)) * ((x) - (c)))
+#define MANHATTAN_TERM(x, c, w) fabs((x) - (c))
+// The kernels are kept at unit length, so the largest dot product is the smallest angle.
+#define COSINE_TERM(x, c, w) ((x) * (c))
+#define WEIGHTED_TERM(x, c, w) ((w) * ((x) - (c)) * ((x) - (c)))
+
+DEFINE_ASSIGN(euclidean, EUCLIDEAN_TERM, <, INFINITY)
+DEFINE_ASSIGN(manhattan, MANHATTAN_TERM, <, INFINITY)
+DEFINE_ASSIGN(cosine, COSINE_TERM, >, -INFINITY)
+DEFINE_ASSIGN(weighted, WEIGHTED_TERM, <, INFINITY)
+
+static k_means_assign_fn pick_assign(metric_t metric) {
+    switch (metric) {
+        case METRIC_MANHATTAN: return assign_manhattan;
+        case METRIC_COSINE:    return assign_cosine;
+        case METRIC_WEIGHTED:  return assign_weighted;
+        default:               return assign_euclidean;
     }
-    
-    // We need a set of evenly distributed pivot numbers.
-    size_t* pivots = malloc(sizeof(size_t) * (k));
-    size_t pivot;
-    for (i = 0; i < k; i++) {
-        double t = (2.0 * ((double)(i)));
-        double b = ((double)(k)) * 2.0;
-        size_t p = (size_t)((t / b * ((double)(n))));
-        pivots[i] = p;
+}
+
+static void normalize_kernel(double* kernel, size_t m) {
+    size_t vi;
+    double norm = 0.0;
+    for (vi = 0; vi < m; vi++) {
+        norm += kernel[vi] * kernel[vi];
     }
-    
-    pivot = 0;
-    for (i = 0; i < m; i++) {
-        //Sort all values along dimension i.
-        qsort_r(data_rows_copy, n, sizeof(double**), cmpf64v, &i);
-        for (j = 0; j < k; j++) {
-            pivot = pivots[j];
-            kernels[j][i] = data_rows_copy[pivot][i];
+    if (norm <= 0.0) {
+        return;
+    }
+    norm = sqrt(norm);
+    for (vi = 0; vi < m; vi++) {
+        kernel[vi] /= norm;
+    }
+}
+
+/**
+ * @brief Find the k-th smallest of n values (Wirth's selection algorithm), the values are reordered.
+ */
+static double select_f64(double* values, size_t n, size_t k) {
+    ptrdiff_t target = (ptrdiff_t) k;
+    ptrdiff_t low = 0;
+    ptrdiff_t high = (ptrdiff_t) n - 1;
+    while (low < high) {
+        double pivot = values[target];
+        ptrdiff_t i = low;
+        ptrdiff_t j = high;
+        do {
+            while (values[i] < pivot) i++;
+            while (pivot < values[j]) j--;
+            if (i <= j) {
+                double swap = values[i];
+                values[i] = values[j];
+                values[j] = swap;
+                i++;
+                j--;
+            }
+        } while (i <= j);
+        if (j < target) low = i;
+        if (target < i) high = j;
+    }
+    return values[target];
+}
+
+/**
+ * @brief Move every kernel to the (weighted) mean of its followers.
+ *
+ * @param inverse_norms When not NULL, each row is scaled by its inverse norm first (spherical k-means).
+ */
+static void update_means(kmeans_ctx* ctx, const double* inverse_norms) {
+    const size_t k = ctx->k, m = ctx->m;
+    const double* row_weights = ctx->options.row_weights;
+    double* counts = ctx->counts;
+    double* sums = ctx->sums;
+    size_t ri, ki, vi;
+    // Reset kernel follower counts & sums.
+    memset(counts, 0, sizeof(double) * k);
+    memset(sums, 0, sizeof(double) * k * m);
+    for (ri = 0; ri < ctx->n; ri++) {
+        size_t closest_kernel = ctx->labels[ri];
+        double weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+        double scale = (inverse_norms != NULL) ? weight * inverse_norms[ri] : weight;
+        counts[closest_kernel] += weight;
+        for (vi = 0; vi < m; vi++) {
+            sums[closest_kernel * m + vi] += scale * ctx->data_rows[ri][vi];
         }
     }
-    free(pivots);
-    for (i = 0; i < n; i++) {
-        free(data_rows_copy[i]);
+    for (ki = 0; ki < k; ki++) {
+        if (counts[ki] <= 0) {
+            continue;
+        }
+        for (vi = 0; vi < m; vi++) {
+            ctx->kernels[ki][vi] = sums[ki * m + vi] / counts[ki];
+        }
     }
-    free(data_rows_copy);
-    return kernels;
 }
 
-// We use this to keep track of which kernel each data row is closest to,
-// meaning that kernel_followers[i] should be in the range 0 .. k - 1, depending on which kernel is closest.
-size_t* kernel_followers;
+/**
+ * @brief Move every kernel to the per-column (weighted) median of its followers, which minimizes the manhattan distance.
+ */
+static void update_medians(kmeans_ctx* ctx) {
+    const size_t k = ctx->k, m = ctx->m;
+    const double* row_weights = ctx->options.row_weights;
+    size_t* order = ctx->order;
+    size_t* starts = ctx->starts;
+    size_t* next = ctx->previous;
+    double* values = (double*) ctx->scratch;
+    weighted_value* pairs = ctx->scratch;
+    size_t ri, ki, vi, i;
+    memset(starts, 0, sizeof(size_t) * (k + 1));
+    for (ri = 0; ri < ctx->n; ri++) {
+        starts[ctx->labels[ri] + 1] += 1;
+    }
+    // Sort the row indices by kernel (counting sort), so the followers of each kernel are contiguous.
+    for (ki = 0; ki < k; ki++) {
+        starts[ki + 1] += starts[ki];
+    }
+    memcpy(next, starts, sizeof(size_t) * k);
+    for (ri = 0; ri < ctx->n; ri++) {
+        order[next[ctx->labels[ri]]++] = ri;
+    }
+    for (ki = 0; ki < k; ki++) {
+        size_t start = starts[ki];
+        size_t count = starts[ki + 1] - start;
+        if (count == 0) {
+            continue;
+        }
+        for (vi = 0; vi < m; vi++) {
+            if (row_weights == NULL) {
+                for (i = 0; i < count; i++) {
+                    values[i] = ctx->data_rows[order[start + i]][vi];
+                }
+                ctx->kernels[ki][vi] = select_f64(values, count, (count - 1) / 2);
+                continue;
+            }
+            double total = 0.0;
+            for (i = 0; i < count; i++) {
+                pairs[i].value = ctx->data_rows[order[start + i]][vi];
+                pairs[i].weight = row_weights[order[start + i]];
+                total += pairs[i].weight;
+            }
+            qsort(pairs, count, sizeof(weighted_value), cmp_weighted_value);
+            double running = 0.0;
+            for (i = 0; i + 1 < count; i++) {
+                running += pairs[i].weight;
+                if (running >= total / 2.0) {
+                    break;
+                }
+            }
+            ctx->kernels[ki][vi] = pairs[i].value;
+        }
+    }
+}
 
-// We simply keep track of how many rows each kernel has been assigned.
-size_t* kernel_follower_count; 
+k_means_options k_means_default_options(size_t k, bool generate_kernels) {
+    k_means_options options;
+    options.k = k;
+    options.generate_kernels = generate_kernels;
+    options.metric = METRIC_EUCLIDEAN;
+    options.column_weights = NULL;
+    options.row_weights = NULL;
+    options.kernels_out = NULL;
+    options.initial_kernels = NULL;
+    options.seed = 0;
+    options.first_iteration = 0;
+    options.on_iteration = NULL;
+    options.iteration_context = NULL;
+    return options;
+}
 
-// And the total sum of the assigned rows
-double** kernel_follower_sum;
+/**
+ * @brief Reserve an aligned piece of the workspace.
+ *
+ * @param base The start of the workspace, or NULL to only measure it.
+ * @param used The bytes reserved so far, advanced past the new piece.
+ *
+ * @return The piece, or NULL when only measuring or when nothing was asked for.
+ */
+static void* carve(char* base, size_t* used, size_t bytes) {
+    size_t start = (*used + KMEANS_WORKSPACE_ALIGNMENT - 1) & ~((size_t) KMEANS_WORKSPACE_ALIGNMENT - 1);
+    *used = start + bytes;
+    return (base != NULL && bytes > 0) ? base + start : NULL;
+}
+
+/**
+ * @brief Point the buffers of a context into the workspace, only those its options need are reserved.
+ *
+ * @return The size of the workspace.
+ */
+static size_t lay_out(kmeans_ctx* ctx, char* base) {
+    const size_t k = ctx->k, m = ctx->m, n = ctx->n;
+    const metric_t metric = ctx->options.metric;
+    bool seeding = ctx->options.initial_kernels == NULL;
+    // Seeding from quantiles and k-medians sort weighted values, k-medians and weighted random seeding need n values.
+    bool scratch = metric == METRIC_MANHATTAN
+            || (seeding && (ctx->options.generate_kernels || ctx->options.row_weights != NULL));
+    size_t used = 0;
+    ctx->kernels = carve(base, &used, sizeof(double*) * k);
+    ctx->kernel_values = carve(base, &used, sizeof(double) * k * m);
+    ctx->previous_kernels = carve(base, &used, sizeof(double) * k * m);
+    ctx->counts = carve(base, &used, sizeof(double) * k);
+    ctx->sums = carve(base, &used, sizeof(double) * k * m);
+    ctx->previous = carve(base, &used, sizeof(size_t) * k);
+    ctx->inverse_norms = carve(base, &used, (metric == METRIC_COSINE) ? sizeof(double) * n : 0);
+    ctx->order = carve(base, &used, (metric == METRIC_MANHATTAN) ? sizeof(size_t) * n : 0);
+    ctx->starts = carve(base, &used, (metric == METRIC_MANHATTAN) ? sizeof(size_t) * (k + 1) : 0);
+    ctx->scratch = carve(base, &used, (scratch) ? sizeof(weighted_value) * n : 0);
+    return used;
+}
 
-// We also keep track of where the kernels used to be.
-double** prev_means;
+size_t kmeans_workspace_size(const k_means_options* options, size_t n, size_t m) {
+    kmeans_ctx ctx;
+    ctx.options = *options;
+    ctx.k = options->k;
+    ctx.n = n;
+    ctx.m = m;
+    return lay_out(&ctx, NULL);
+}
 
-size_t* k_means(const size_t k, double** data_rows, size_t n, size_t m, bool generate_kernels) {
-    srand(time(NULL));
-    double** kernels = (generate_kernels) ? generate_mean_kernels(data_rows, n, m, k) : pick_random_kernels(data_rows, n, m, k);
-    double movement = INFINITY;
-    kernel_followers = malloc(sizeof(size_t) * n);
-    kernel_follower_count = malloc(sizeof(size_t) * k);
-    kernel_follower_sum = malloc(sizeof(double*) * k);
-    prev_means = malloc(sizeof(double*) * k);
-
-    size_t ri; // row-index, used to index to rows in the data_rows pointer.
-    size_t ki; // kernel-index, used to index to single kernels.
-    size_t vi; // value-index, used to index to individual float values.
-    for (ki = 0; ki < k; ki++) {
-        prev_means[ki] = malloc(sizeof(double) * m);
-        kernel_follower_sum[ki] = malloc(sizeof(double) * m);
+const char* kmeans_status_message(kmeans_status status) {
+    switch (status) {
+        case KMEANS_OK:              return "No error";
+        case KMEANS_ERROR_ARGUMENT:  return "Invalid arguments, k, n and m must be positive and the weighted metric needs column weights";
+        case KMEANS_ERROR_ROWS:      return "Fewer rows (with a weight above 0) than kernels to pick from them";
+        case KMEANS_ERROR_WORKSPACE: return "The workspace is smaller than kmeans_workspace_size";
+        case KMEANS_ERROR_MEMORY:    return "Could not allocate the workspace";
+        case KMEANS_ERROR_NAN:       return "The kernels moved by nan, the input probably holds nan or infinite values";
+        default:                     return "Unknown status";
     }
-    size_t iterations = 0;
-    while (movement >= DBL_EPSILON && iterations < 2500) { //Until the kernels stop moving:
-        for (ki = 0; ki < k; ki++) {
-            for (vi = 0; vi < m; vi++) {
-                prev_means[ki][vi] = kernels[ki][vi];
-            }
+}
+
+kmeans_status kmeans_ctx_init(kmeans_ctx* ctx, const k_means_options* options, double** data_rows, size_t n, size_t m,
+        size_t* labels, void* workspace, size_t workspace_size) {
+    size_t ri, ki, vi;
+    ctx->owned_workspace = NULL;
+    if (options == NULL || data_rows == NULL || labels == NULL || options->k == 0 || n == 0 || m == 0
+            || (options->metric == METRIC_WEIGHTED && options->column_weights == NULL)) {
+        return KMEANS_ERROR_ARGUMENT;
+    }
+    ctx->options = *options;
+    ctx->data_rows = data_rows;
+    ctx->k = options->k;
+    ctx->n = n;
+    ctx->m = m;
+    ctx->labels = labels;
+    ctx->assign = pick_assign(options->metric);
+    size_t needed = lay_out(ctx, NULL);
+    if (workspace == NULL) {
+        // The single allocation of a run, when the caller does not bring a workspace.
+        ctx->owned_workspace = malloc(needed);
+        if (ctx->owned_workspace == NULL) {
+            return KMEANS_ERROR_MEMORY;
         }
-        for (ki = 0; ki < k; ki++) { // Reset kernel follower counts & sums.
-            kernel_follower_count[ki] = 0;
-            for (vi = 0; vi < m; vi++) {
-                kernel_follower_sum[ki][vi] = 0.0;
-            }
+        workspace = ctx->owned_workspace;
+    } else if (workspace_size < needed) {
+        return KMEANS_ERROR_WORKSPACE;
+    }
+    lay_out(ctx, workspace);
+    for (ki = 0; ki < ctx->k; ki++) {
+        ctx->kernels[ki] = ctx->kernel_values + ki * m;
+    }
+
+    // Every context draws from its own generator, so concurrent runs started in the same second still differ.
+    ctx->rng = rng_seed((options->seed != 0) ? options->seed : (uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) ctx);
+    if (options->initial_kernels != NULL) {
+        // A warm start, the kernels are copied since they are moved in place.
+        for (ki = 0; ki < ctx->k; ki++) {
+            memcpy(ctx->kernels[ki], options->initial_kernels[ki], sizeof(double) * m);
+        }
+    } else if (options->generate_kernels) {
+        quantile_kernels(data_rows, n, m, ctx->k, options->row_weights, ctx->scratch, ctx->kernels);
+    } else {
+        kmeans_status status = pick_rows(data_rows, n, m, ctx->k, options->row_weights, &ctx->rng,
+                (double*) ctx->scratch, ctx->previous, ctx->kernels);
+        if (status != KMEANS_OK) {
+            return status;
         }
-        // Assign each row to a kernel.
+    }
+
+    // Spherical k-means needs the row norms.
+    if (options->metric == METRIC_COSINE) {
         for (ri = 0; ri < n; ri++) {
-            double* row = data_rows[ri];
-            double closest_distance = INFINITY;
-            double distance = 0.0;
-            size_t closest_kernel = 0;
-            for (ki = 0; ki < k; ki++) {
-                distance = distf64v(row, kernels[ki], m);
-                if (distance < closest_distance) {
-                    closest_distance = distance;
-                    closest_kernel = ki;
-                }
-            }
-            kernel_followers[ri] = closest_kernel;
-            kernel_follower_count[closest_kernel] += 1;
+            double norm = 0.0;
             for (vi = 0; vi < m; vi++) {
-                kernel_follower_sum[closest_kernel][vi] += row[vi];
+                norm += data_rows[ri][vi] * data_rows[ri][vi];
             }
+            ctx->inverse_norms[ri] = (norm > 0.0) ? 1.0 / sqrt(norm) : 0.0;
+        }
+        for (ki = 0; ki < ctx->k; ki++) {
+            normalize_kernel(ctx->kernels[ki], m);
         }
+    }
+    ctx->iterations = options->first_iteration;
+    ctx->movement = INFINITY;
+    return KMEANS_OK;
+}
 
-        // Update kernels to their new means.
-        for (ki = 0; ki < k; ki++) {
-            for (vi = 0; vi < m; vi++) {
-                if (kernel_follower_count[ki] <= 0) {
-                    //printf("Kernel %zu had no followers??", ki);
-                    continue;
-                }
-                kernels[ki][vi] = (kernel_follower_sum[ki][vi]) / ((double) kernel_follower_count[ki]);
+kmeans_status kmeans_step(kmeans_ctx* ctx) {
+    const size_t k = ctx->k, m = ctx->m;
+    size_t ki, vi;
+    ctx->iterations += 1;
+    memcpy(ctx->previous_kernels, ctx->kernel_values, sizeof(double) * k * m);
+    // Assign each row to a kernel.
+    ctx->assign(ctx->data_rows, ctx->n, m, ctx->kernels, k, ctx->options.column_weights, ctx->labels);
+
+    // Update kernels to their new centers.
+    switch (ctx->options.metric) {
+        case METRIC_MANHATTAN:
+            update_medians(ctx);
+            break;
+        case METRIC_COSINE:
+            update_means(ctx, ctx->inverse_norms);
+            for (ki = 0; ki < k; ki++) {
+                normalize_kernel(ctx->kernels[ki], m);
             }
+            break;
+        default:
+            update_means(ctx, NULL);
+            break;
+    }
+
+    // Update movement.
+    double movement = 0.0;
+    for (ki = 0; ki < k; ki++) {
+        double sum = 0.0;
+        for (vi = 0; vi < m; vi++) {
+            double d = ctx->previous_kernels[ki * m + vi] - ctx->kernel_values[ki * m + vi];
+            sum += d * d;
         }
-        movement = 0.0;
-        double prev_movement = 0.0;
-        double current_movement = 0.0;
-        // Update movement.
-        for (ki = 0; ki < k; ki++) {
-            prev_movement = movement;
-            current_movement = distf64v(prev_means[ki], kernels[ki], m);
-            movement += current_movement;
-            if (movement != movement) {
-                //Movement is nan??
-                failwithf("Movment was nan: %lf, prev_movement was %lf and current was %lf\n", movement, prev_movement, current_movement);
-            }
+        movement += sqrt(sum);
+    }
+    ctx->movement = movement;
+    return (movement != movement) ? KMEANS_ERROR_NAN : KMEANS_OK;
+}
+
+bool kmeans_converged(const kmeans_ctx* ctx) {
+    return ctx->movement < DBL_EPSILON || ctx->iterations >= K_MEANS_MAX_ITERATIONS;
+}
+
+double kmeans_movement(const kmeans_ctx* ctx) {
+    return ctx->movement;
+}
+
+size_t kmeans_iterations(const kmeans_ctx* ctx) {
+    return ctx->iterations;
+}
+
+double* const* kmeans_kernels(const kmeans_ctx* ctx) {
+    return ctx->kernels;
+}
+
+/**
+ * @brief Copy the kernels to the kernels_out of the options, if there is one.
+ */
+static void copy_kernels_out(kmeans_ctx* ctx) {
+    size_t ki;
+    if (ctx->options.kernels_out != NULL) {
+        for (ki = 0; ki < ctx->k; ki++) {
+            memcpy(ctx->options.kernels_out[ki], ctx->kernels[ki], sizeof(double) * ctx->m);
         }
     }
-    // Free memory that we're not using any longer.
-    for (ki = 0; ki < k; ki++) {
-        free(prev_means[ki]);
-        free(kernels[ki]);
-        free(kernel_follower_sum[ki]);
+}
+
+kmeans_status kmeans_finish(kmeans_ctx* ctx) {
+    // The labels are those of the previous kernels, one more assignment makes them match the current kernels.
+    ctx->assign(ctx->data_rows, ctx->n, ctx->m, ctx->kernels, ctx->k, ctx->options.column_weights, ctx->labels);
+    copy_kernels_out(ctx);
+    return KMEANS_OK;
+}
+
+kmeans_status kmeans_run(kmeans_ctx* ctx) {
+    const k_means_options* options = &ctx->options;
+    if (kmeans_converged(ctx)) {
+        // A context resumed from a checkpoint of its last iteration takes no step, but still needs its labels.
+        return kmeans_finish(ctx);
     }
-    free(prev_means);
-    free(kernels);
-    free(kernel_follower_count);
-    free(kernel_follower_sum);
+    while (!kmeans_converged(ctx)) { //Until the kernels stop moving:
+        kmeans_status status = kmeans_step(ctx);
+        if (status != KMEANS_OK) {
+            return status;
+        }
+        if (options->on_iteration != NULL
+                && !options->on_iteration(ctx->iterations, ctx->movement, ctx->kernels, ctx->k, ctx->m, options->iteration_context)) {
+            return kmeans_finish(ctx);
+        }
+    }
+    copy_kernels_out(ctx);
+    return KMEANS_OK;
+}
+
+void kmeans_free(kmeans_ctx* ctx) {
+    free(ctx->owned_workspace);
+    ctx->owned_workspace = NULL;
+}
 
-    return kernel_followers;
+size_t* k_means(const size_t k, double** data_rows, size_t n, size_t m, bool generate_kernels) {
+    k_means_options options = k_means_default_options(k, generate_kernels);
+    return k_means_with_options(&options, data_rows, n, m);
 }
 
+size_t* k_means_with_options(const k_means_options* options, double** data_rows, size_t n, size_t m) {
+    size_t* labels = malloc(sizeof(size_t) * n);
+    kmeans_ctx ctx;
+    kmeans_status status = kmeans_ctx_init(&ctx, options, data_rows, n, m, labels, NULL, 0);
+    if (status == KMEANS_OK) {
+        status = kmeans_run(&ctx);
+    }
+    kmeans_free(&ctx);
+    if (status != KMEANS_OK) {
+        failwithf("Could not cluster %zu rows into %zu kernels: %s!\n", n, options->k, kmeans_status_message(status));
+    }
+    return labels;
+}
+
+void k_means_assign(const k_means_options* options, double** data_rows, size_t n, size_t m, double** kernels, size_t* labels) {
+    if (options->metric == METRIC_WEIGHTED && options->column_weights == NULL) {
+        failwith("The weighted metric needs a weight for every column!\n");
+    }
+    pick_assign(options->metric)(data_rows, n, m, kernels, options->k, options->column_weights, labels);
+}
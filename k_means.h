@@ -5,6 +5,137 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/**
+ * @brief The distance measures that rows can be clustered by.
+ */
+typedef enum {
+    METRIC_EUCLIDEAN, // The default, kernels are the means of their rows.
+    METRIC_MANHATTAN, // Sum of absolute differences, kernels are the per-column medians of their rows (k-medians).
+    METRIC_COSINE,    // Angle between rows, rows and kernels are compared at unit length (spherical k-means).
+    METRIC_WEIGHTED   // Euclidean distance with a weight per column.
+} metric_t;
+
+/**
+ * @brief Called after every iteration of a k-means run, e.g. to save progress.
+ *
+ * @param iteration The amount of iterations done, counting those of a resumed run.
+ * @param movement How far the kernels moved in this iteration, summed over the kernels.
+ * @param kernels The k kernels of m values after this iteration, they must not be changed.
+ * @param context The iteration_context of the options.
+ *
+ * @return Whether to go on, returning false stops the run and labels the rows with the kernels as they are.
+ */
+typedef bool (*k_means_iteration_fn)(size_t iteration, double movement, double** kernels, size_t k, size_t m, void* context);
+
+/**
+ * @brief The settings of a k-means run, start from k_means_default_options and change what you need.
+ */
+typedef struct {
+    size_t k;                     // The amount of clusters to generate.
+    bool generate_kernels;        // Whether kernels should be generated or selected randomly from the data.
+    metric_t metric;              // The distance measure.
+    const double* column_weights; // A weight per column, required by METRIC_WEIGHTED.
+    const double* row_weights;    // A weight per row (e.g. a count of identical records), NULL weighs all rows equally.
+    double** kernels_out;         // When not NULL, k caller-allocated rows of m columns that receive the final kernels.
+    double** initial_kernels;     // When not NULL, k rows of m columns to start from, instead of seeding.
+    unsigned int seed;            // The seed of the random seeding, 0 picks one from the clock.
+    size_t first_iteration;       // The iterations already done, when resuming a run from its kernels.
+    k_means_iteration_fn on_iteration; // When not NULL, called after every iteration.
+    void* iteration_context;      // Passed to on_iteration.
+} k_means_options;
+
+// A run stops after this many iterations, even when the kernels still move.
+#define K_MEANS_MAX_ITERATIONS 2500
+
+// Every buffer in a workspace starts at a multiple of this many bytes.
+#define KMEANS_WORKSPACE_ALIGNMENT 64
+
+/**
+ * @brief What went wrong in a k-means context, the context functions return these instead of exiting.
+ */
+typedef enum {
+    KMEANS_OK = 0,
+    KMEANS_ERROR_ARGUMENT,  // k, n or m is 0, a pointer is missing, or the weighted metric has no column weights.
+    KMEANS_ERROR_ROWS,      // Fewer rows (with a weight above 0) than kernels to pick from them.
+    KMEANS_ERROR_WORKSPACE, // The workspace given is smaller than kmeans_workspace_size.
+    KMEANS_ERROR_MEMORY,    // No workspace was given, and allocating one failed.
+    KMEANS_ERROR_NAN        // The kernels moved by nan, the rows hold nan or infinite values.
+} kmeans_status;
+
+/**
+ * @brief Labels the n rows of an n by m matrix with the closest of k kernels.
+ */
+typedef void (*k_means_assign_fn)(double** data_rows, size_t n, size_t m, double** kernels, size_t k,
+        const double* column_weights, size_t* labels);
+
+/**
+ * @brief The state of one k-means run, which lives in memory owned by the caller.
+ *
+ * A context shares nothing with other contexts, not even the random generator, so any amount of them
+ * can run at the same time in one process. Its buffers are carved out of a single workspace,
+ * given by the caller (nothing is allocated then) or allocated once by kmeans_ctx_init.
+ * The fields are read-only to callers.
+ */
+typedef struct {
+    k_means_options options;
+    double** data_rows;
+    size_t k;
+    size_t n;
+    size_t m;
+    size_t* labels;           // The kernel of each row, given by the caller.
+    double** kernels;         // The k kernels, pointing into kernel_values.
+    double* kernel_values;    // k by m.
+    double* previous_kernels; // k by m, the kernels before the last iteration.
+    double* counts;           // The (weighted) amount of rows of each kernel.
+    double* sums;             // k by m, the (weighted) sums of the rows of each kernel.
+    size_t* previous;         // k indices, the rows picked by random seeding.
+    double* inverse_norms;    // The inverse norm of each row, METRIC_COSINE only.
+    size_t* order;            // The rows sorted by kernel, METRIC_MANHATTAN only.
+    size_t* starts;           // Where the rows of each kernel start in order, METRIC_MANHATTAN only.
+    void* scratch;            // Room to sort n values for seeding and medians.
+    uint64_t rng;             // The state of the random generator, see rng.h.
+    k_means_assign_fn assign;
+    size_t iterations;
+    double movement;
+    void* owned_workspace;    // The workspace allocated by kmeans_ctx_init, if any.
+} kmeans_ctx;
+
+/**
+ * @brief The options of a plain euclidean k-means run.
+ */
+k_means_options k_means_default_options(size_t k, bool generate_kernels);
+
+/**
+ * @brief Pick random kernels from the data_rows.
+ *
+ * @param data_rows The data rows.
+ * @param n The number of rows available in the data_rows pointer.
+ * @param m The number of columns available in each row of the data_rows pointer.
+ * @param k The amount of kernels to pick out.
+ * @param row_weights The weight of each row, rows are picked with a probability proportional to their weight. NULL weighs all rows equally.
+ *
+ * @return A set of k kernel (vectors of length m), selected from the data_rows set.
+ */
+double** pick_random_kernels(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights);
+
+/**
+ * @brief Generate kernels based on the data rows by sorting along each axis of all the data rows.
+ *
+ * @param data_rows The data rows.
+ * @param n The number of rows available in the data_rows pointer.
+ * @param m The number of columns in each row of the data_rows pointer.
+ * @param k The amount of kernels to generate.
+ * @param row_weights The weight of each row, kernels are picked at evenly spaced weighted quantiles. NULL weighs all rows equally.
+ *
+ * @return A set of k kernels.
+ */
+double** generate_mean_kernels(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights);
+
+/**
+ * @brief The euclidean distance between two 64-bit float vectors of length m.
+ */
+double distf64v(double* p, double* q, size_t m);
+
 /**
  * @brief Run K-means clustering.
  *
@@ -16,4 +147,115 @@
  */
 size_t* k_means(size_t k, double** data_rows, size_t n, size_t m, bool generate_kernels);
 
+/**
+ * @brief Run K-means clustering with the given options.
+ *
+ * @param options The settings of the run, see k_means_options.
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ *
+ * @return The kernel (0 .. k - 1) of each row.
+ */
+size_t* k_means_with_options(const k_means_options* options, double** data_rows, size_t n, size_t m);
+
+/**
+ * @brief Label rows by their closest kernel, using the metric (and column weights) of the options.
+ *
+ * This is the assignment step of k_means_with_options on its own, e.g. to label all rows
+ * with the kernels found on a sample of them (see kernels_out).
+ *
+ * @param options The metric and column weights to compare by, the other settings are ignored.
+ * @param kernels The k kernels (vectors of length m), cosine kernels must be unit length like those of kernels_out.
+ * @param labels Filled with the closest kernel (0 .. k - 1) of each row.
+ */
+void k_means_assign(const k_means_options* options, double** data_rows, size_t n, size_t m, double** kernels, size_t* labels);
+
+/**
+ * @brief The bytes of workspace a context needs, to be given to kmeans_ctx_init.
+ *
+ * It depends on the metric, the seeding and whether there are row weights, besides k, n and m.
+ */
+size_t kmeans_workspace_size(const k_means_options* options, size_t n, size_t m);
+
+/**
+ * @brief Prepare a k-means run and seed its kernels, the same run as k_means_with_options.
+ *
+ * @param ctx The context to fill in, e.g. on the stack.
+ * @param options The settings of the run, which are copied.
+ * @param data_rows The data in an n by m matrix, which must stay around until the run is done.
+ * @param labels Room for n labels, filled with the kernel (0 .. k - 1) of each row.
+ * @param workspace At least workspace_size bytes, aligned to KMEANS_WORKSPACE_ALIGNMENT,
+ *        or NULL to let the context allocate it (once) itself.
+ * @param workspace_size The size of the workspace, see kmeans_workspace_size.
+ *
+ * @return KMEANS_OK, or what is wrong. The context must be freed with kmeans_free either way.
+ */
+kmeans_status kmeans_ctx_init(kmeans_ctx* ctx, const k_means_options* options, double** data_rows, size_t n, size_t m,
+        size_t* labels, void* workspace, size_t workspace_size);
+
+/**
+ * @brief Iterate until the kernels stop moving, and fill in the labels (and kernels_out of the options).
+ *
+ * Nothing is allocated, and the kernels remain readable through kmeans_kernels afterwards.
+ * This is kmeans_step until kmeans_converged, calling on_iteration after every step.
+ */
+kmeans_status kmeans_run(kmeans_ctx* ctx);
+
+/*
+ * A run can also be driven one iteration at a time, e.g. to interleave many runs on a few threads,
+ * to stop on other criteria, or to look at the kernels as they move:
+ *
+ *     while (!kmeans_converged(&ctx) && kmeans_step(&ctx) == KMEANS_OK && !good_enough(kmeans_kernels(&ctx))) {
+ *     }
+ *     kmeans_finish(&ctx);
+ *
+ * Steps never allocate, and a context can be stepped from any thread, as long as only one thread uses it at a time.
+ */
+
+/**
+ * @brief Do one iteration, assign every row to its closest kernel and move the kernels to the centers of their rows.
+ *
+ * The labels after a step are those of the kernels before it, kmeans_finish makes them match the kernels.
+ * The on_iteration callback of the options is not called, the caller decides whether to go on.
+ */
+kmeans_status kmeans_step(kmeans_ctx* ctx);
+
+/**
+ * @brief Whether the kernels stopped moving in the last step, or the run took K_MEANS_MAX_ITERATIONS.
+ */
+bool kmeans_converged(const kmeans_ctx* ctx);
+
+/**
+ * @brief How far the kernels moved in the last step, summed over the kernels, INFINITY before the first step.
+ */
+double kmeans_movement(const kmeans_ctx* ctx);
+
+/**
+ * @brief The iterations done so far, counting the first_iteration of the options.
+ */
+size_t kmeans_iterations(const kmeans_ctx* ctx);
+
+/**
+ * @brief The k current kernels of m values, they may be read between steps, but not changed.
+ */
+double* const* kmeans_kernels(const kmeans_ctx* ctx);
+
+/**
+ * @brief Stop stepping, label every row with the current kernels and fill in the kernels_out of the options.
+ *
+ * A converged run does not need this, its labels already match its kernels.
+ */
+kmeans_status kmeans_finish(kmeans_ctx* ctx);
+
+/**
+ * @brief Free the workspace when the context allocated it, the labels and data belong to the caller.
+ */
+void kmeans_free(kmeans_ctx* ctx);
+
+/**
+ * @brief A human readable description of a status.
+ */
+const char* kmeans_status_message(kmeans_status status);
+
 #endif
@@ -0,0 +1,407 @@
+/**
+ *
+ * This module performs k-medoids clustering using FasterPAM (Schubert & Rousseeuw, 2021).
+ *
+ * Classic PAM evaluates every (medoid, non-medoid) swap separately, which costs O(k * n^2) per iteration.
+ * FasterPAM evaluates the swaps of one candidate row against all k medoids at once in O(n),
+ * by caching the nearest and second nearest medoid of every row, and performs a swap as soon as
+ * it improves the clustering (eager swapping) instead of searching for the best one first.
+ *
+ */
+
+#include "kmedoids.h"
+#include "k_means.h"
+#include "parallel.h"
+#include "rng.h"
+#include "fail.h"
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <time.h>
+
+// The amount of candidates each thread evaluates before the results are checked for a swap.
+#define PAM_CANDIDATES_PER_THREAD 4
+
+// A swap has to improve the total deviation by more than this to count, so rounding cannot cause endless swapping.
+#define PAM_EPSILON 1e-12
+
+typedef struct {
+    double** rows;
+    size_t n;
+    size_t m;
+    size_t k;
+    size_t* medoids;     // k row indices.
+    bool* is_medoid;     // n.
+    size_t* nearest;     // n, index into medoids.
+    size_t* second;      // n, index into medoids.
+    double* dn;          // n, distance to the nearest medoid.
+    double* ds;          // n, distance to the second nearest medoid.
+    double* removal_loss; // k, the change in deviation when a medoid is removed without replacement.
+    // Candidate evaluation, one slot per candidate in the current batch.
+    size_t* candidates;
+    size_t* best_medoid;
+    double* best_delta;
+    double** deltas;     // One k-sized scratch array per thread.
+} pam_state;
+
+static void find_nearest_two(pam_state* pam, size_t o) {
+    size_t i;
+    double* row = pam->rows[o];
+    pam->dn[o] = INFINITY;
+    pam->ds[o] = INFINITY;
+    for (i = 0; i < pam->k; i++) {
+        double d = distf64v(row, pam->rows[pam->medoids[i]], pam->m);
+        if (d < pam->dn[o]) {
+            pam->second[o] = pam->nearest[o];
+            pam->ds[o] = pam->dn[o];
+            pam->nearest[o] = i;
+            pam->dn[o] = d;
+        } else if (d < pam->ds[o]) {
+            pam->second[o] = i;
+            pam->ds[o] = d;
+        }
+    }
+}
+
+static void find_second(pam_state* pam, size_t o) {
+    size_t i;
+    double* row = pam->rows[o];
+    pam->ds[o] = INFINITY;
+    for (i = 0; i < pam->k; i++) {
+        if (i == pam->nearest[o]) {
+            continue;
+        }
+        double d = distf64v(row, pam->rows[pam->medoids[i]], pam->m);
+        if (d < pam->ds[o]) {
+            pam->second[o] = i;
+            pam->ds[o] = d;
+        }
+    }
+}
+
+static void compute_removal_loss(pam_state* pam) {
+    size_t o;
+    memset(pam->removal_loss, 0, sizeof(double) * pam->k);
+    for (o = 0; o < pam->n; o++) {
+        pam->removal_loss[pam->nearest[o]] += pam->ds[o] - pam->dn[o];
+    }
+}
+
+static void nearest_chunk(size_t from, size_t to, size_t worker, void* context) {
+    size_t o;
+    for (o = from; o < to; o++) {
+        find_nearest_two(context, o);
+    }
+}
+
+// Evaluate swapping each candidate in with every medoid at once, keeping the best medoid to swap out.
+static void candidate_chunk(size_t from, size_t to, size_t worker, void* context) {
+    pam_state* pam = context;
+    double* delta = pam->deltas[worker];
+    size_t c, o, i;
+    for (c = from; c < to; c++) {
+        size_t candidate = pam->candidates[c];
+        if (pam->is_medoid[candidate]) {
+            pam->best_medoid[c] = 0;
+            pam->best_delta[c] = 0.0;
+            continue;
+        }
+        double* candidate_row = pam->rows[candidate];
+        double shared = 0.0;
+        memcpy(delta, pam->removal_loss, sizeof(double) * pam->k);
+        for (o = 0; o < pam->n; o++) {
+            double d = distf64v(pam->rows[o], candidate_row, pam->m);
+            if (d < pam->dn[o]) {
+                // The candidate becomes the nearest medoid, whichever medoid is removed.
+                shared += d - pam->dn[o];
+                delta[pam->nearest[o]] += pam->dn[o] - pam->ds[o];
+            } else if (d < pam->ds[o]) {
+                // The candidate replaces the nearest medoid only when that one is removed.
+                delta[pam->nearest[o]] += d - pam->ds[o];
+            }
+        }
+        size_t best = 0;
+        for (i = 1; i < pam->k; i++) {
+            if (delta[i] < delta[best]) {
+                best = i;
+            }
+        }
+        pam->best_medoid[c] = best;
+        pam->best_delta[c] = delta[best] + shared;
+    }
+}
+
+static void swap_medoid(pam_state* pam, size_t i, size_t candidate) {
+    size_t o;
+    pam->is_medoid[pam->medoids[i]] = false;
+    pam->is_medoid[candidate] = true;
+    pam->medoids[i] = candidate;
+    double* candidate_row = pam->rows[candidate];
+    for (o = 0; o < pam->n; o++) {
+        double d = distf64v(pam->rows[o], candidate_row, pam->m);
+        if (pam->nearest[o] == i) {
+            if (d <= pam->ds[o]) {
+                pam->dn[o] = d;
+            } else {
+                find_nearest_two(pam, o);
+            }
+        } else if (pam->second[o] == i) {
+            if (d < pam->dn[o]) {
+                pam->second[o] = pam->nearest[o];
+                pam->ds[o] = pam->dn[o];
+                pam->nearest[o] = i;
+                pam->dn[o] = d;
+            } else {
+                find_second(pam, o);
+            }
+        } else if (d < pam->dn[o]) {
+            pam->second[o] = pam->nearest[o];
+            pam->ds[o] = pam->dn[o];
+            pam->nearest[o] = i;
+            pam->dn[o] = d;
+        } else if (d < pam->ds[o]) {
+            pam->second[o] = i;
+            pam->ds[o] = d;
+        }
+    }
+    compute_removal_loss(pam);
+}
+
+/**
+ * @brief Improve the medoids with FasterPAM until no swap improves the total deviation.
+ *
+ * The candidates are evaluated in parallel batches, but swaps are applied in candidate order
+ * and the rest of a batch is discarded after a swap, so the result is the same as sequential eager swapping.
+ *
+ * @param medoids The k initial medoids (row indices), they are updated in place.
+ *
+ * @return The total deviation, the summed distance of every row to its nearest medoid.
+ */
+static double faster_pam(double** rows, size_t n, size_t m, size_t k, size_t* medoids) {
+    size_t threads = parallel_threads();
+    size_t batch = threads * PAM_CANDIDATES_PER_THREAD;
+    size_t i, t, o;
+    pam_state pam;
+    pam.rows = rows;
+    pam.n = n;
+    pam.m = m;
+    pam.k = k;
+    pam.medoids = medoids;
+    pam.is_medoid = calloc(n, sizeof(bool));
+    pam.nearest = malloc(sizeof(size_t) * n);
+    pam.second = malloc(sizeof(size_t) * n);
+    pam.dn = malloc(sizeof(double) * n);
+    pam.ds = malloc(sizeof(double) * n);
+    pam.removal_loss = malloc(sizeof(double) * k);
+    pam.candidates = malloc(sizeof(size_t) * batch);
+    pam.best_medoid = malloc(sizeof(size_t) * batch);
+    pam.best_delta = malloc(sizeof(double) * batch);
+    pam.deltas = malloc(sizeof(double*) * threads);
+    for (t = 0; t < threads; t++) {
+        pam.deltas[t] = malloc(sizeof(double) * k);
+    }
+    for (i = 0; i < k; i++) {
+        pam.is_medoid[medoids[i]] = true;
+    }
+    parallel_for(n, nearest_chunk, &pam);
+    compute_removal_loss(&pam);
+
+    // Cycle through the rows as candidates, until a full cycle passes without a swap.
+    size_t next = 0;
+    size_t since_swap = 0;
+    while (since_swap < n) {
+        size_t count = 0;
+        while (count < batch && since_swap + count < n) {
+            size_t candidate = (next + count) % n;
+            pam.candidates[count] = candidate;
+            count += 1;
+        }
+        parallel_for(count, candidate_chunk, &pam);
+
+        size_t c;
+        bool swapped = false;
+        for (c = 0; c < count; c++) {
+            size_t candidate = pam.candidates[c];
+            if (pam.is_medoid[candidate] || pam.best_delta[c] >= -PAM_EPSILON) {
+                continue;
+            }
+            swap_medoid(&pam, pam.best_medoid[c], candidate);
+            next = (candidate + 1) % n;
+            since_swap = 0;
+            swapped = true;
+            break;
+        }
+        if (!swapped) {
+            next = (next + count) % n;
+            since_swap += count;
+        }
+    }
+
+    double deviation = 0.0;
+    for (o = 0; o < n; o++) {
+        deviation += pam.dn[o];
+    }
+    for (t = 0; t < threads; t++) {
+        free(pam.deltas[t]);
+    }
+    free(pam.deltas);
+    free(pam.is_medoid);
+    free(pam.nearest);
+    free(pam.second);
+    free(pam.dn);
+    free(pam.ds);
+    free(pam.removal_loss);
+    free(pam.candidates);
+    free(pam.best_medoid);
+    free(pam.best_delta);
+    return deviation;
+}
+
+/**
+ * @brief Pick k distinct rows out of n with a partial Fisher-Yates shuffle.
+ *
+ * @param order Scratch space for n indices, the picked rows end up in its first k entries.
+ * @param keep The amount of leading entries of order that are already picked and must be kept.
+ */
+static void pick_distinct(size_t* order, size_t n, size_t k, size_t keep, uint64_t* rng) {
+    size_t i;
+    for (i = keep; i < k; i++) {
+        size_t pick = i + rng_index(rng, n - i);
+        size_t swap = order[i];
+        order[i] = order[pick];
+        order[pick] = swap;
+    }
+}
+
+typedef struct {
+    double** data_rows;
+    size_t m;
+    size_t k;
+    size_t* medoids;
+    size_t* labels;      // NULL when only the deviation is needed.
+    double* deviations;  // One per thread.
+} assign_context;
+
+static void assign_chunk(size_t from, size_t to, size_t worker, void* context) {
+    assign_context* a = context;
+    size_t ri, i;
+    double deviation = 0.0;
+    for (ri = from; ri < to; ri++) {
+        double closest_distance = INFINITY;
+        size_t closest = 0;
+        for (i = 0; i < a->k; i++) {
+            double d = distf64v(a->data_rows[ri], a->data_rows[a->medoids[i]], a->m);
+            if (d < closest_distance) {
+                closest_distance = d;
+                closest = i;
+            }
+        }
+        deviation += closest_distance;
+        if (a->labels != NULL) {
+            a->labels[ri] = closest;
+        }
+    }
+    a->deviations[worker] += deviation;
+}
+
+// Assign every row to its closest medoid, returning the total deviation.
+static double assign_medoids(double** data_rows, size_t n, size_t m, size_t k, size_t* medoids, size_t* labels) {
+    size_t threads = parallel_threads();
+    size_t t;
+    assign_context a;
+    a.data_rows = data_rows;
+    a.m = m;
+    a.k = k;
+    a.medoids = medoids;
+    a.labels = labels;
+    a.deviations = calloc(threads, sizeof(double));
+    parallel_for(n, assign_chunk, &a);
+    double deviation = 0.0;
+    for (t = 0; t < threads; t++) {
+        deviation += a.deviations[t];
+    }
+    free(a.deviations);
+    return deviation;
+}
+
+size_t* k_medoids(size_t k, double** data_rows, size_t n, size_t m, size_t clara_samples, size_t clara_size) {
+    if (n <= k) {
+        failwithf("Cannot find %zu medoids in %zu rows!\n", k, n);
+    }
+    uint64_t rng = rng_seed((uint64_t) time(NULL));
+    size_t* labels = malloc(sizeof(size_t) * n);
+    size_t* medoids = malloc(sizeof(size_t) * k);
+    size_t* order = malloc(sizeof(size_t) * n);
+    size_t i, s;
+    for (i = 0; i < n; i++) {
+        order[i] = i;
+    }
+
+    if (clara_samples == 0) {
+        pick_distinct(order, n, k, 0, &rng);
+        memcpy(medoids, order, sizeof(size_t) * k);
+        faster_pam(data_rows, n, m, k, medoids);
+        assign_medoids(data_rows, n, m, k, medoids, labels);
+        free(medoids);
+        free(order);
+        return labels;
+    }
+
+    // CLARA, cluster samples of the rows and keep the medoids that fit all rows best.
+    if (clara_size == 0) {
+        clara_size = 100 + 5 * k;
+    }
+    clara_size = (clara_size > n) ? n : clara_size;
+    if (clara_size <= k) {
+        failwithf("A CLARA sample of %zu rows cannot hold %zu medoids!\n", clara_size, k);
+    }
+    double** sample_rows = malloc(sizeof(double*) * clara_size);
+    size_t* sample_medoids = malloc(sizeof(size_t) * k);
+    size_t* best = malloc(sizeof(size_t) * k);
+    bool* is_best = malloc(sizeof(bool) * n);
+    double best_deviation = INFINITY;
+    for (s = 0; s < clara_samples; s++) {
+        // Every sample after the first includes the best medoids so far, so the result can only improve.
+        size_t keep = 0;
+        if (s > 0) {
+            size_t filled = k;
+            memset(is_best, 0, sizeof(bool) * n);
+            for (i = 0; i < k; i++) {
+                order[i] = best[i];
+                is_best[best[i]] = true;
+            }
+            for (i = 0; i < n; i++) {
+                if (!is_best[i]) {
+                    order[filled] = i;
+                    filled += 1;
+                }
+            }
+            keep = k;
+        }
+        pick_distinct(order, n, clara_size, keep, &rng);
+        for (i = 0; i < clara_size; i++) {
+            sample_rows[i] = data_rows[order[i]];
+        }
+        // Start from the best medoids (the first k sample rows) or from random sample rows.
+        for (i = 0; i < k; i++) {
+            sample_medoids[i] = i;
+        }
+        faster_pam(sample_rows, clara_size, m, k, sample_medoids);
+        for (i = 0; i < k; i++) {
+            medoids[i] = order[sample_medoids[i]];
+        }
+        double deviation = assign_medoids(data_rows, n, m, k, medoids, NULL);
+        if (deviation < best_deviation) {
+            best_deviation = deviation;
+            memcpy(best, medoids, sizeof(size_t) * k);
+        }
+    }
+    assign_medoids(data_rows, n, m, k, best, labels);
+    free(sample_rows);
+    free(sample_medoids);
+    free(best);
+    free(is_best);
+    free(medoids);
+    free(order);
+    return labels;
+}
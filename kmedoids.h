@@ -0,0 +1,23 @@
+#ifndef KMEDOIDS_H
+#define KMEDOIDS_H
+
+#include <stdlib.h>
+
+/**
+ * @brief Run k-medoids clustering using FasterPAM.
+ *
+ * Unlike k-means, every cluster is represented by one of the rows (its medoid), and the sum of distances
+ * (not squared distances) to the medoids is minimized, which makes the clustering robust to outliers.
+ *
+ * @param k The amount of clusters to generate.
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param clara_samples When greater than 0, cluster this many random samples of the rows (CLARA) and keep the best medoids.
+ * @param clara_size The amount of rows in each sample, 0 picks 100 + 5 * k.
+ *
+ * @return The index (0 .. k - 1) of the closest medoid of each row.
+ */
+size_t* k_medoids(size_t k, double** data_rows, size_t n, size_t m, size_t clara_samples, size_t clara_size);
+
+#endif
@@ -0,0 +1,111 @@
+#include "linalg.h"
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+// Jacobi converges quadratically, this is only a safety net.
+#define JACOBI_MAX_SWEEPS 100
+
+void orthonormalize_columns(double* a, size_t rows, size_t cols) {
+    size_t i, j, r;
+    for (j = 0; j < cols; j++) {
+        // Two passes of projections keep the result orthogonal even when columns are nearly dependent.
+        int pass;
+        for (pass = 0; pass < 2; pass++) {
+            for (i = 0; i < j; i++) {
+                double dot = 0.0;
+                for (r = 0; r < rows; r++) {
+                    dot += a[r * cols + i] * a[r * cols + j];
+                }
+                for (r = 0; r < rows; r++) {
+                    a[r * cols + j] -= dot * a[r * cols + i];
+                }
+            }
+        }
+        double norm = 0.0;
+        for (r = 0; r < rows; r++) {
+            norm += a[r * cols + j] * a[r * cols + j];
+        }
+        norm = sqrt(norm);
+        double scale = (norm > DBL_EPSILON) ? 1.0 / norm : 0.0;
+        for (r = 0; r < rows; r++) {
+            a[r * cols + j] *= scale;
+        }
+    }
+}
+
+void symmetric_eigen(double* a, size_t d, double* values, double* vectors) {
+    size_t i, j, p, q, sweep;
+    for (i = 0; i < d; i++) {
+        for (j = 0; j < d; j++) {
+            vectors[i * d + j] = (i == j) ? 1.0 : 0.0;
+        }
+    }
+    for (sweep = 0; sweep < JACOBI_MAX_SWEEPS; sweep++) {
+        double off = 0.0;
+        double diagonal = 0.0;
+        for (p = 0; p < d; p++) {
+            diagonal += a[p * d + p] * a[p * d + p];
+            for (q = p + 1; q < d; q++) {
+                off += a[p * d + q] * a[p * d + q];
+            }
+        }
+        if (off <= DBL_EPSILON * DBL_EPSILON * diagonal) {
+            break;
+        }
+        for (p = 0; p < d; p++) {
+            for (q = p + 1; q < d; q++) {
+                double apq = a[p * d + q];
+                if (fabs(apq) < DBL_MIN) {
+                    continue;
+                }
+                // Pick the rotation that zeroes a[p][q].
+                double theta = (a[q * d + q] - a[p * d + p]) / (2.0 * apq);
+                double t = ((theta >= 0.0) ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                double c = 1.0 / sqrt(t * t + 1.0);
+                double s = t * c;
+                for (i = 0; i < d; i++) {
+                    double aip = a[i * d + p];
+                    double aiq = a[i * d + q];
+                    a[i * d + p] = c * aip - s * aiq;
+                    a[i * d + q] = s * aip + c * aiq;
+                }
+                for (i = 0; i < d; i++) {
+                    double api = a[p * d + i];
+                    double aqi = a[q * d + i];
+                    a[p * d + i] = c * api - s * aqi;
+                    a[q * d + i] = s * api + c * aqi;
+                }
+                for (i = 0; i < d; i++) {
+                    double vip = vectors[i * d + p];
+                    double viq = vectors[i * d + q];
+                    vectors[i * d + p] = c * vip - s * viq;
+                    vectors[i * d + q] = s * vip + c * viq;
+                }
+            }
+        }
+    }
+    for (i = 0; i < d; i++) {
+        values[i] = a[i * d + i];
+    }
+    // Selection sort, d is small and the columns of vectors have to follow along.
+    for (i = 0; i < d; i++) {
+        size_t largest = i;
+        for (j = i + 1; j < d; j++) {
+            if (values[j] > values[largest]) {
+                largest = j;
+            }
+        }
+        if (largest == i) {
+            continue;
+        }
+        double swap = values[i];
+        values[i] = values[largest];
+        values[largest] = swap;
+        for (p = 0; p < d; p++) {
+            swap = vectors[p * d + i];
+            vectors[p * d + i] = vectors[p * d + largest];
+            vectors[p * d + largest] = swap;
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef LINALG_H
+#define LINALG_H
+
+#include <stdlib.h>
+
+/**
+ * @brief Small dense linear algebra helpers, all matrices are row-major arrays of doubles.
+ */
+
+/**
+ * @brief Make the columns of a rows by cols matrix orthonormal, in place, using modified Gram-Schmidt.
+ *
+ * Columns that turn out to be linearly dependent on the previous ones are set to 0.
+ */
+void orthonormalize_columns(double* a, size_t rows, size_t cols);
+
+/**
+ * @brief Find the eigenvalues and eigenvectors of a symmetric d by d matrix using cyclic Jacobi rotations.
+ *
+ * @param a The symmetric matrix, it is overwritten.
+ * @param d The dimension of the matrix.
+ * @param values Receives the d eigenvalues, sorted from largest to smallest.
+ * @param vectors Receives a d by d matrix whose column j is the eigenvector of values[j].
+ */
+void symmetric_eigen(double* a, size_t d, double* values, double* vectors);
+
+#endif
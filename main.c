@@ -21,17 +21,41 @@
 #include <stdbool.h> // boolean macros like true and false and the bool type.
 #include <stdint.h>  // integer types such as int8_t, uint8_t, int16_t, uint16_t, etc.
 #include <unistd.h>  // standard unix header, includes lots of stuff, I use it for easy flag parsing.
+#include <getopt.h>  // getopt_long, for the flags that are too specific to deserve a single letter.
 #include <string.h>  // string-manipulation
 #include <limits.h>  // gives us the max and min sizes of integers
+#include <time.h>    // seeds for the random seeding, and the clock of --deadline
+#include <signal.h>  // stopping cleanly on SIGINT & SIGTERM
 
 #include "fail.h"    // Generic custom header file for F#-like failures (with stacktraces if you compile with -ggdb!)
 #include "util.h"    // Utility functions
 #include "k_means.h" // K-means implementation
+#include "pq.h"      // Product-quantized k-means
+#include "reduce.h"  // Dimensionality reduction before clustering
+#include "parallel.h" // Thread count for the parallel parts
+#include "nystrom.h" // Feature maps for kernel k-means
+#include "gmm.h"     // Gaussian mixtures
+#include "kmedoids.h" // k-medoids (FasterPAM)
+#include "dedup.h"   // Collapsing identical rows
+#include "grid.h"    // Grid pre-clustering
+#include "coreset.h" // Sensitivity sampled coresets
+#include "birch.h"   // Clustering-feature trees
+#include "stream.h"  // Online k-means over unbounded input
+#include "model.h"   // Saved kernels
+#include "checkpoint.h" // Saved progress of long runs
+#include "incremental.h" // Clustering appended rows in place
+#include "serve.h"       // The resident mode
+#include "procs.h"       // Worker processes
+#include "distributed.h" // Distributed runs over TCP
+#include "manifest.h"    // Many jobs in one process
+#include "share.h"       // Rows shared between processes
+#include "parse.h"       // Parsing rows and columns
 
 // define flags
 
 // -k flag
 size_t kernels = 2; //The minimum amount of kernels is 2.
+bool kernels_given = false;
 
 // -g, -i, -e & -r
 bool generate_kernels = false; //False is the default value, but it is nicer to be explicit.
@@ -43,25 +67,261 @@ bool use_ranges = false;
 char* field_separator = ",";
 char num_separator = '.';
 
-// Columns are given as individual arguments or ranges, e.g. 5-9
+// -a, the clustering algorithm (engine) to use.
+typedef enum {
+    ALGORITHM_LLOYD,
+    ALGORITHM_PQ,
+    ALGORITHM_NYSTROM,
+    ALGORITHM_GMM,
+    ALGORITHM_PAM
+} algorithm_t;
+algorithm_t algorithm = ALGORITHM_LLOYD;
+
+// --pq-subspaces & --pq-shortlist, 0 sub-spaces lets the pq-module decide.
+size_t pq_subspaces = 0;
+size_t pq_shortlist = 8;
+
+// --reduce, --reduce-method & --reduce-refine, 0 dimensions means no reduction.
+size_t reduce_to = 0;
+reduce_method_t reduce_method = REDUCE_JL;
+bool reduce_refine = false;
+
+// --landmarks, --nystrom-kernel, --gamma, --degree & --coef0, used by '-a nystrom'.
+size_t landmarks = 100;
+nystrom_params nystrom = { NYSTROM_RBF, 0.0, 2.0, 1.0 };
+
+// --gmm-init & --soft, used by '-a gmm'.
+bool gmm_kmeans_init = false;
+bool soft_output = false;
+
+// --clara & --clara-size, used by '-a pam', 0 samples means clustering all rows at once.
+size_t clara_samples = 0;
+size_t clara_size = 0;
+
+// --metric & --metric-weights, the weights are given as a comma separated list with one weight per column.
+metric_t metric = METRIC_EUCLIDEAN;
+double* metric_weights = NULL;
+size_t metric_weight_count = 0;
+
+// Long-only flags get values outside of the char range, so they never collide with the short flags.
+enum {
+    OPT_PQ_SUBSPACES = 256,
+    OPT_PQ_SHORTLIST,
+    OPT_REDUCE,
+    OPT_REDUCE_METHOD,
+    OPT_REDUCE_REFINE,
+    OPT_LANDMARKS,
+    OPT_NYSTROM_KERNEL,
+    OPT_GAMMA,
+    OPT_DEGREE,
+    OPT_COEF0,
+    OPT_GMM_INIT,
+    OPT_SOFT,
+    OPT_CLARA,
+    OPT_CLARA_SIZE,
+    OPT_METRIC,
+    OPT_METRIC_WEIGHTS,
+    OPT_DEDUP,
+    OPT_GRID,
+    OPT_CORESET,
+    OPT_BIRCH,
+    OPT_STREAM,
+    OPT_DECAY,
+    OPT_WINDOW,
+    OPT_SNAPSHOT,
+    OPT_SAVE_MODEL,
+    OPT_PREDICT,
+    OPT_INIT,
+    OPT_CHECKPOINT,
+    OPT_EVERY,
+    OPT_RESUME,
+    OPT_DEADLINE,
+    OPT_STATE,
+    OPT_APPEND,
+    OPT_SERVE,
+    OPT_PROCS,
+    OPT_COORDINATE,
+    OPT_WORKERS,
+    OPT_JOIN,
+    OPT_MANIFEST,
+    OPT_SHARE
+};
+
+struct option long_options[] = {
+    {"algorithm",     required_argument, NULL, 'a'},
+    {"pq-subspaces",  required_argument, NULL, OPT_PQ_SUBSPACES},
+    {"pq-shortlist",  required_argument, NULL, OPT_PQ_SHORTLIST},
+    {"reduce",        required_argument, NULL, OPT_REDUCE},
+    {"reduce-method", required_argument, NULL, OPT_REDUCE_METHOD},
+    {"reduce-refine", no_argument,       NULL, OPT_REDUCE_REFINE},
+    {"landmarks",     required_argument, NULL, OPT_LANDMARKS},
+    {"nystrom-kernel", required_argument, NULL, OPT_NYSTROM_KERNEL},
+    {"gamma",         required_argument, NULL, OPT_GAMMA},
+    {"degree",        required_argument, NULL, OPT_DEGREE},
+    {"coef0",         required_argument, NULL, OPT_COEF0},
+    {"gmm-init",      required_argument, NULL, OPT_GMM_INIT},
+    {"soft",          no_argument,       NULL, OPT_SOFT},
+    {"clara",         required_argument, NULL, OPT_CLARA},
+    {"clara-size",    required_argument, NULL, OPT_CLARA_SIZE},
+    {"metric",        required_argument, NULL, OPT_METRIC},
+    {"metric-weights", required_argument, NULL, OPT_METRIC_WEIGHTS},
+    {"dedup",         no_argument,       NULL, OPT_DEDUP},
+    {"grid",          required_argument, NULL, OPT_GRID},
+    {"coreset",       required_argument, NULL, OPT_CORESET},
+    {"birch",         required_argument, NULL, OPT_BIRCH},
+    {"stream",        no_argument,       NULL, OPT_STREAM},
+    {"decay",         required_argument, NULL, OPT_DECAY},
+    {"window",        required_argument, NULL, OPT_WINDOW},
+    {"snapshot",      required_argument, NULL, OPT_SNAPSHOT},
+    {"save-model",    required_argument, NULL, OPT_SAVE_MODEL},
+    {"predict",       required_argument, NULL, OPT_PREDICT},
+    {"init",          required_argument, NULL, OPT_INIT},
+    {"checkpoint",    required_argument, NULL, OPT_CHECKPOINT},
+    {"every",         required_argument, NULL, OPT_EVERY},
+    {"resume",        no_argument,       NULL, OPT_RESUME},
+    {"deadline",      required_argument, NULL, OPT_DEADLINE},
+    {"state",         required_argument, NULL, OPT_STATE},
+    {"append",        no_argument,       NULL, OPT_APPEND},
+    {"serve",         required_argument, NULL, OPT_SERVE},
+    {"procs",         required_argument, NULL, OPT_PROCS},
+    {"coordinate",    required_argument, NULL, OPT_COORDINATE},
+    {"workers",       required_argument, NULL, OPT_WORKERS},
+    {"join",          required_argument, NULL, OPT_JOIN},
+    {"manifest",      required_argument, NULL, OPT_MANIFEST},
+    {"share",         no_argument,       NULL, OPT_SHARE},
+    {"threads",       required_argument, NULL, 't'},
+    {"weights",       required_argument, NULL, 'w'},
+    {"help",          no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+// -w, the column holding the weight of each row, e.g. the count of a pre-aggregated record.
+bool use_weights = false;
+size_t weight_column = 0;
+
+// Columns are given as individual arguments, ranges or lists, e.g. 5-9 or 0,2,5-7
 size_t column_count;
 size_t* columns = NULL;
 
+// The flags above that decide how a line becomes a row, set once the arguments are parsed.
+parse_settings row_format;
+
 // define data storage
 
 double** data_rows;
 size_t data_row_cap = 1024;
 size_t data_row_count = 0;
 
+// The weight of each row when '-w' or '--dedup' is used, NULL otherwise.
+double* row_weights = NULL;
+
+// --dedup, identical rows are stored once and weighted by their count.
+// row_index maps every parsed line to the stored row it was collapsed into, so labels can be expanded again.
+bool deduplicate = false;
+dedup_table* dedup = NULL;
+size_t* row_index = NULL;
+size_t row_index_cap = 1024;
+size_t parsed_row_count = 0;
+
+// --grid, the amount of bins per column, 0 means no grid.
+// The range of each column is tracked while parsing, so the grid can be laid out without another pass.
+size_t grid_bins = 0;
+double* column_minimum = NULL;
+double* column_maximum = NULL;
+
+// --coreset, the amount of rows sampled into a coreset, 0 means clustering all rows.
+size_t coreset_samples = 0;
+
+// --birch, the most leaf entries of the clustering-feature tree, 0 means storing every row.
+// The rows are summarized while parsing and never stored, so the kernels are printed instead of labels.
+size_t birch_entries = 0;
+cf_tree* birch = NULL;
+
+// --stream, --decay, --window & --snapshot, rows are labeled as they arrive and never stored.
+// A snapshot of the kernels is printed to stderr every snapshot_every rows, 0 means never.
+bool streaming = false;
+double stream_decay = 0.999;
+size_t stream_window = 0;
+size_t snapshot_every = 0;
+stream_state* stream = NULL;
+
+// --save-model & --predict, the predict mode labels rows with saved kernels, in batches of PREDICT_BATCH rows.
+#define PREDICT_BATCH 1024
+char* save_model_path = NULL;
+char* predict_path = NULL;
+cluster_model* model = NULL;
+
+// --init, kernels to start '-a lloyd' from (csv or a model file), instead of seeding.
+char* init_path = NULL;
+double** initial_kernels = NULL;
+
+// --checkpoint, --every & --resume, the progress of '-a lloyd' is saved every checkpoint_every iterations.
+char* checkpoint_path = NULL;
+size_t checkpoint_every = 10;
+bool resume = false;
+checkpoint progress;
+size_t history_cap = 0;
+
+// --deadline, SIGINT & SIGTERM, '-a lloyd' stops after the iteration that is running,
+// and labels the rows with the kernels found so far. The deadline counts from the start of the program.
+double deadline = 0.0;
+struct timespec started;
+double iteration_started = 0.0;
+double predicted_iteration = 0.0;
+volatile sig_atomic_t stop_signal = 0;
+
+// --state & --append, a '-a lloyd' run saves its rows, kernels and bounds to state_path,
+// and with appending the rows read are added to that state instead, which is updated in place.
+char* state_path = NULL;
+bool appending = false;
+
+// --serve, instead of reading stdin, cluster the jobs sent to a unix domain socket, with one worker per thread (-t).
+char* serve_path = NULL;
+
+// --procs, '-a lloyd' runs in this many forked worker processes, that share the rows and their partial sums.
+size_t processes = 1;
+
+// --coordinate, --workers & --join, '-a lloyd' runs over TCP between a coordinator on coordinate_port,
+// which prints the kernels, and as many workers, which each read a shard of the rows and print its labels.
+unsigned int coordinate_port = 0;
+size_t distributed_workers = 0;
+char* join_address = NULL;
+
+// --manifest, instead of reading stdin, cluster every input listed in this file, each into its own output.
+char* manifest_path = NULL;
+
+// --share, the parsed rows of the file on stdin are published in shared memory, or attached to when already published.
+bool sharing = false;
+
 void preallocate_data_rows() {
     int i;
     data_rows = malloc(sizeof(double*) * data_row_cap);
     for (i = 0; i < data_row_cap; i++) {
         data_rows[i] = malloc(sizeof(double) * column_count);
     }
+    if (use_weights || deduplicate) {
+        row_weights = malloc(sizeof(double) * data_row_cap);
+    }
+    if (deduplicate) {
+        dedup = dedup_create(column_count);
+        row_index = malloc(sizeof(size_t) * row_index_cap);
+    }
+    if (birch_entries > 0) {
+        birch = cf_create(column_count, birch_entries);
+    }
+    if (streaming) {
+        stream = stream_create(kernels, column_count, stream_decay, stream_window);
+    }
+    if (grid_bins > 0) {
+        column_minimum = malloc(sizeof(double) * column_count);
+        column_maximum = malloc(sizeof(double) * column_count);
+    }
 }
 
 void trim_data_rows() {
+    if (data_row_count == 0) {
+        failwith("No rows could be parsed from the input!\n");
+    }
     int i;
     for (i = data_row_count; i < data_row_cap; i++) {
         free(data_rows[i]);
@@ -70,14 +330,15 @@ void trim_data_rows() {
     if (data_rows == NULL) {
         failwith("Trimming the data_rows with realloc caused an error!\n");
     }
+    if (row_weights != NULL) {
+        row_weights = realloc(row_weights, sizeof(double) * data_row_count);
+        if (row_weights == NULL) {
+            failwith("Trimming the row_weights with realloc caused an error!\n");
+        }
+    }
 }
 
 void parse_data_row(char* line, size_t line_number) {
-    // Make sure that decimal-points are parseable!
-    if (num_separator != '.') {
-        char_replace(line, num_separator, '.');
-    }
-    
     if (data_row_count == data_row_cap) {
         if (data_row_cap == (ULONG_MAX / 2)) {
             // We can't fit anymore data in a single pointer :(
@@ -92,43 +353,79 @@ void parse_data_row(char* line, size_t line_number) {
             data_rows[i] = malloc(sizeof(double) * column_count);
             i += 1;
         }
+        if (row_weights != NULL) {
+            row_weights = realloc(row_weights, sizeof(double) * data_row_cap);
+            if (row_weights == NULL) {
+                failwith("Growing the row_weights with realloc caused an error!\n");
+            }
+        }
     }
 
-    size_t fsep_len = strlen(field_separator);
     size_t r = data_row_count;
-    size_t i, j = 0;
-    char* line_pointer = line;
-
-    for (i = 0; i < column_count; i++) {
-        size_t column = columns[i];
-        // Move the line_pointer to the next separator
-        while (j < column) {
-            // strstr moves a char pointer to the next instance of a string.
-            line_pointer = strstr(line_pointer, field_separator);
-            if (line_pointer == NULL) {
-                // We ran out of separators while looking for the next column, the data is missing.
-                if (fail_on_errors) {
-                    failwithf("Could not find column %zu in line %zu'%s'\n", column, line_number + 1, line);
-                } else {
-                    return;
-                }
-            }
-            if (fsep_len > strlen(line_pointer)) {
-                failwithf("The remainder of the line was less than the length of the field_separator...\n");
-            }
-            line_pointer += fsep_len; //Skip over the field_separator
-            j += 1;
+    size_t i, column;
+    double weight;
+    parse_status status = parse_row(&row_format, line, data_rows[r], &weight, &column);
+    if (status != PARSE_OK) {
+        if (!fail_on_errors) {
+            // We ignore the error and leave what we've parsed in memory, the slot is reused by the next line.
+            return;
+        }
+        switch (status) {
+            case PARSE_BAD_WEIGHT:
+                failwithf("Could not parse a non-negative weight from column %zu of line %zu:'%s'\n", column, line_number + 1, line);
+            case PARSE_MISSING_COLUMN:
+                failwithf("Could not find column %zu in line %zu'%s'\n", column, line_number + 1, line);
+            default:
+                failwithf("Could not parse columns off of line %zu:'%s'\n", line_number + 1, line);
         }
-        
-        int res = sscanf(line_pointer, "%lf", &(data_rows[r][i]));
+    }
 
-        if (!res && fail_on_errors) {
-            failwithf("Could not parse columns off of line %zu:'%s'\n", line_number + 1, line);
-        } else if(!res) {
-            // We ignore the error and leave what we've parsed in memory, we'll realloc later.
+    if (stream != NULL) {
+        // The label is needed right away, the next line may be a long time coming.
+        printf("%zu\n", stream_update(stream, data_rows[r], weight));
+        fflush(stdout);
+        if (snapshot_every > 0 && stream_rows(stream) % snapshot_every == 0) {
+            fprintf(stderr, "# kernels after %zu rows\n", stream_rows(stream));
+            stream_print_kernels(stream, stderr, field_separator);
+        }
+        return;
+    }
+    if (birch != NULL) {
+        // The row is only summarized, so its slot is reused by the next line.
+        cf_insert(birch, data_rows[r], weight);
+        return;
+    }
+    if (deduplicate) {
+        if (parsed_row_count == row_index_cap) {
+            row_index_cap *= 2;
+            row_index = realloc(row_index, sizeof(size_t) * row_index_cap);
+            if (row_index == NULL) {
+                failwith("Growing the row_index with realloc caused an error!\n");
+            }
+        }
+        bool inserted;
+        size_t unique = dedup_insert(dedup, data_rows[r], r, &inserted);
+        row_index[parsed_row_count] = unique;
+        parsed_row_count += 1;
+        if (!inserted) {
+            // The row is already stored, so it only adds its weight, and its slot is reused by the next line.
+            row_weights[unique] += weight;
             return;
         }
     }
+    if (row_weights != NULL) {
+        row_weights[r] = weight;
+    }
+    if (grid_bins > 0) {
+        for (i = 0; i < column_count; i++) {
+            if (data_row_count == 0 || data_rows[r][i] < column_minimum[i]) {
+                column_minimum[i] = data_rows[r][i];
+            }
+            if (data_row_count == 0 || data_rows[r][i] > column_maximum[i]) {
+                column_maximum[i] = data_rows[r][i];
+            }
+        }
+    }
     data_row_count += 1;
 }
 
@@ -155,38 +452,10 @@ void add_column_index(size_t index) {
     column_count += 1;
 }
 
-void add_column(char* column) {
-    size_t c;
-    int res = sscanf(column, "%zu", &c);
-    if (!res) {
-        failwithf("Could not parse column '%s' as an unsigned integer!\n", column);
-    }
-    add_column_index(c);
-}
-
-void add_column_range(char* range) {
-    size_t from;
-    size_t to;
-    int res = sscanf(range, "%zu-%zu", &from, &to);
-
-    if (!res) {
-        failwithf("Could not parse range '%s', make sure that it is of the format <digit>-<digit>\n", range);
-    }
-
-    if (to <= from) {
-        failwithf("Invalid range '%s'\n", range);
-    }
-
-    size_t i;
-    for (i = from; i <= to; i++) {
-        add_column_index(i);
-    }
-}
-
 void parse_args(int argc, char** argv) {
 
     if (argc == 1) {
-        fprintf(stderr, "Usage: %s [-kgierfnh] [range|columns...]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-katwgierfnh] [range|columns...]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -201,12 +470,13 @@ void parse_args(int argc, char** argv) {
 
     // getopt needs all possible flags given in a single string literal.
     // The ':' indicates that a flag takes a string argument.
-    while ((opt = getopt(argc, argv, "k:gierf:n:h")) != -1) {
+    // Long flags are listed in the long_options table instead.
+    while ((opt = getopt_long(argc, argv, "k:a:t:w:gierf:n:h", long_options, NULL)) != -1) {
         switch(opt) {
             case 'h': {
                           // With printf, leave no trailing commas at the end of each string to concatenate into a multiline string.
                           printf(
-                                  "Usage: %s [-kgierfnh] [range|columns...]\nCluster data into k classes\n\n"
+                                  "Usage: %s [-katwgierfnh] [range|columns...]\nCluster data into k classes\n\n"
                                   "%s reads columnar data from stdin and uses k-means clustering\n"
                                   " to sort the data into a set number of groups (also known as clusters/classes).\n"
                                   "The amount of groups is determined by the amount of kernels used (controlled by the flag '-k'),\n"
@@ -222,17 +492,72 @@ void parse_args(int argc, char** argv) {
                                   "Finally, the program expects either a set of columns indices or a range of column indices\n"
                                   " that should be used to determine the class of each row.\n"
                                   "These are given as either separate parameters or a single range, e.g. 0-9\n"
-                                  "\n\n"
+                                  "\n\n",
+                                  argv[0],
+                                  argv[0]
+                          );
+                          // The flag table is printed on its own, C99 compilers only have to support string literals of 4095 chars.
+                          printf(
                                   " flag <parameter>                              description:\n"
                                   "  -k  <32-bit integer greater than 2>          set kernels amount\n"
+                                  "  -a  <lloyd|pq|nystrom|gmm|pam>               clustering algorithm, lloyd is the default\n"
+                                  "      --metric <euclidean|manhattan|cosine|weighted> distance measure used by '-a lloyd'\n"
+                                  "      --metric-weights <float,float,...>       one weight per column for '--metric weighted'\n"
+                                  "      --pq-subspaces <integer>                 sub-spaces used by '-a pq', defaults to one per 4 columns\n"
+                                  "      --pq-shortlist <integer>                 kernels compared exactly per row by '-a pq', default 8\n"
+                                  "      --landmarks <integer>                    landmark rows used by '-a nystrom' (kernel k-means), default 100\n"
+                                  "      --nystrom-kernel <rbf|poly>              kernel function used by '-a nystrom', default rbf\n"
+                                  "      --gamma <float>                          kernel function scale, defaults to 1 / columns\n"
+                                  "      --degree <float> & --coef0 <float>       polynomial kernel degree (default 2) and offset (default 1)\n"
+                                  "      --gmm-init <random|kmeans>               start '-a gmm' from the kernels alone or from a k-means run\n"
+                                  "      --soft                                   print the probability of each cluster instead of a label ('-a gmm')\n"
+                                  "      --clara <integer>                        cluster this many samples with '-a pam' (k-medoids), for large inputs\n"
+                                  "      --clara-size <integer>                   rows in each '--clara' sample, defaults to 100 + 5 * k\n"
+                                  "      --reduce <integer>                       cluster the rows projected to fewer dimensions\n"
+                                  "      --reduce-method <jl|pca>                 random projection (jl, default) or randomized pca\n"
+                                  "      --reduce-refine                          finish with one exact iteration in the original space,\n"
+                                  "                                               only with the euclidean metric\n"
+                                  "  -t  <integer>                                threads used by parallel parts, default one per cpu\n"
+                                  "  -w  <integer>                                column holding the weight (e.g. count) of each row\n"
+                          );
+                          printf(
+                                  "      --dedup                                  cluster identical rows once, weighted by their count\n"
+                                  "      --grid <integer>                         cluster grid cells of this many bins per column, then assign exactly (at most 4 columns)\n"
+                                  "      --coreset <integer>                      cluster a weighted sample of this many rows, then assign exactly\n"
+                                  "      --birch <integer>                        summarize rows into at most this many entries while reading,\n"
+                                  "                                               and print the k kernels instead of a label per row\n"
+                                  "      --stream                                 label every row as it arrives with online k-means, for unbounded input\n"
+                                  "      --decay <float>                          factor that old rows are forgotten by per row when streaming, default 0.999\n"
+                                  "      --window <integer>                       only let the latest rows count when streaming, instead of --decay\n"
+                                  "      --snapshot <integer>                     print the kernels to stderr every this many rows when streaming\n"
+                                  "      --save-model <file>                      save the kernels, metric and columns to a model file ('-a lloyd')\n"
+                                  "      --predict <file>                         label rows with the kernels of a model file instead of clustering,\n"
+                                  "                                               the columns default to those of the model\n"
+                                  "      --init <file>                            start '-a lloyd' from these kernels (csv, one per line, or a model file)\n"
+                                  "      --checkpoint <file>                      save the progress of '-a lloyd' to this file while it runs\n"
+                                  "      --every <integer>                        iterations between checkpoints, default 10\n"
+                                  "      --resume                                 continue from the checkpoint, if there is one for the same data\n"
+                                  "      --deadline <duration>                    stop '-a lloyd' in time (e.g. 500ms, 30s or 5m) with the kernels so far\n"
+                                  "      --state <file>                           save the rows, kernels and bounds of a '-a lloyd' run to this file\n"
+                                  "      --append                                 add the rows to the --state and update its clustering in place,\n"
+                                  "                                               printing the labels of all rows in the state\n"
+                                  "      --serve <socket>                         keep running, and cluster the jobs sent to this unix socket\n"
+                                  "                                               (see serve.h and c_means_client) until killed\n"
+                                  "      --procs <integer>                        run '-a lloyd' in this many worker processes instead of one\n"
+                                  "      --coordinate <port>                      coordinate a '-a lloyd' run over TCP, printing its kernels\n"
+                                  "      --workers <integer>                      the amount of workers to coordinate\n"
+                                  "      --join <host:port>                       cluster the rows as a worker of a coordinated run,\n"
+                                  "                                               printing the labels of these rows\n"
+                                  "      --manifest <file>                        cluster every job listed in the file, one per line as\n"
+                                  "                                               '<input> <output> <columns> <k>', on -t threads\n"
+                                  "      --share                                  publish the parsed rows of the file on stdin in shared memory,\n"
+                                  "                                               or use those of another run on the same file and columns\n"
                                   "  -g                                           generate kernels\n"
                                   "  -i                                           ignore header\n"
                                   "  -e                                           fail on parse error\n"
                                   "  -f  <char>                                   use a different column/field separator char\n"
                                   "  -n  <char>                                   use a different decimal separator char\n"
-                                  "  -h                                           display this message\n",
-                                  argv[0],
-                                  argv[0]
+                                  "  -h                                           display this message\n"
                           );
                           exit(EXIT_SUCCESS);
                       }
@@ -244,6 +569,267 @@ void parse_args(int argc, char** argv) {
                           if (kernels < 2) {
                               failwithf("Kernel amount must be at least 2!\n");
                           }
+                          kernels_given = true;
+                      } break;
+
+            case 'a': {
+                          if (strcmp(optarg, "lloyd") == 0) {
+                              algorithm = ALGORITHM_LLOYD;
+                          } else if (strcmp(optarg, "pq") == 0) {
+                              algorithm = ALGORITHM_PQ;
+                          } else if (strcmp(optarg, "nystrom") == 0) {
+                              algorithm = ALGORITHM_NYSTROM;
+                          } else if (strcmp(optarg, "gmm") == 0) {
+                              algorithm = ALGORITHM_GMM;
+                          } else if (strcmp(optarg, "pam") == 0) {
+                              algorithm = ALGORITHM_PAM;
+                          } else {
+                              failwithf("Unknown algorithm '%s', expected lloyd, pq, nystrom, gmm or pam!\n", optarg);
+                          }
+                      } break;
+            case OPT_PQ_SUBSPACES: {
+                          int res = sscanf(optarg, "%zu", &pq_subspaces);
+                          if (res != 1 || pq_subspaces == 0) {
+                              failwithf("Could not convert sub-space amount '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_PQ_SHORTLIST: {
+                          int res = sscanf(optarg, "%zu", &pq_shortlist);
+                          if (res != 1 || pq_shortlist == 0) {
+                              failwithf("Could not convert short-list length '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_LANDMARKS: {
+                          int res = sscanf(optarg, "%zu", &landmarks);
+                          if (res != 1 || landmarks == 0) {
+                              failwithf("Could not convert landmark amount '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_NYSTROM_KERNEL: {
+                          if (strcmp(optarg, "rbf") == 0) {
+                              nystrom.function = NYSTROM_RBF;
+                          } else if (strcmp(optarg, "poly") == 0) {
+                              nystrom.function = NYSTROM_POLY;
+                          } else {
+                              failwithf("Unknown kernel function '%s', expected rbf or poly!\n", optarg);
+                          }
+                      } break;
+            case OPT_GAMMA: {
+                          if (sscanf(optarg, "%lf", &nystrom.gamma) != 1 || nystrom.gamma <= 0.0) {
+                              failwithf("Could not convert gamma '%s' to a positive number!\n", optarg);
+                          }
+                      } break;
+            case OPT_DEGREE: {
+                          if (sscanf(optarg, "%lf", &nystrom.degree) != 1) {
+                              failwithf("Could not convert degree '%s' to a number!\n", optarg);
+                          }
+                      } break;
+            case OPT_COEF0: {
+                          if (sscanf(optarg, "%lf", &nystrom.coef0) != 1) {
+                              failwithf("Could not convert coef0 '%s' to a number!\n", optarg);
+                          }
+                      } break;
+            case OPT_GMM_INIT: {
+                          if (strcmp(optarg, "random") == 0) {
+                              gmm_kmeans_init = false;
+                          } else if (strcmp(optarg, "kmeans") == 0) {
+                              gmm_kmeans_init = true;
+                          } else {
+                              failwithf("Unknown gmm initialization '%s', expected random or kmeans!\n", optarg);
+                          }
+                      } break;
+            case OPT_SOFT: {
+                          soft_output = true;
+                      } break;
+            case OPT_METRIC: {
+                          if (strcmp(optarg, "euclidean") == 0) {
+                              metric = METRIC_EUCLIDEAN;
+                          } else if (strcmp(optarg, "manhattan") == 0) {
+                              metric = METRIC_MANHATTAN;
+                          } else if (strcmp(optarg, "cosine") == 0) {
+                              metric = METRIC_COSINE;
+                          } else if (strcmp(optarg, "weighted") == 0) {
+                              metric = METRIC_WEIGHTED;
+                          } else {
+                              failwithf("Unknown metric '%s', expected euclidean, manhattan, cosine or weighted!\n", optarg);
+                          }
+                      } break;
+            case OPT_METRIC_WEIGHTS: {
+                          char* list = strdup(optarg);
+                          char* weight = strtok(list, ",");
+                          while (weight != NULL) {
+                              metric_weights = realloc(metric_weights, sizeof(double) * (metric_weight_count + 1));
+                              if (metric_weights == NULL) {
+                                  failwith("realloc of metric_weights failed!\n");
+                              }
+                              if (sscanf(weight, "%lf", &metric_weights[metric_weight_count]) != 1
+                                      || metric_weights[metric_weight_count] < 0.0) {
+                                  failwithf("Could not convert column weight '%s' to a non-negative number!\n", weight);
+                              }
+                              metric_weight_count += 1;
+                              weight = strtok(NULL, ",");
+                          }
+                          free(list);
+                      } break;
+            case OPT_CLARA: {
+                          int res = sscanf(optarg, "%zu", &clara_samples);
+                          if (res != 1 || clara_samples == 0) {
+                              failwithf("Could not convert sample amount '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_CLARA_SIZE: {
+                          int res = sscanf(optarg, "%zu", &clara_size);
+                          if (res != 1 || clara_size == 0) {
+                              failwithf("Could not convert sample size '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_REDUCE: {
+                          int res = sscanf(optarg, "%zu", &reduce_to);
+                          if (res != 1 || reduce_to == 0) {
+                              failwithf("Could not convert reduced dimensions '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_REDUCE_METHOD: {
+                          if (strcmp(optarg, "jl") == 0) {
+                              reduce_method = REDUCE_JL;
+                          } else if (strcmp(optarg, "pca") == 0) {
+                              reduce_method = REDUCE_PCA;
+                          } else {
+                              failwithf("Unknown reduction method '%s', expected jl or pca!\n", optarg);
+                          }
+                      } break;
+            case OPT_REDUCE_REFINE: {
+                          reduce_refine = true;
+                      } break;
+            case 't': {
+                          size_t threads;
+                          int res = sscanf(optarg, "%zu", &threads);
+                          if (res != 1 || threads == 0) {
+                              failwithf("Could not convert thread amount '%s' to a positive integer!\n", optarg);
+                          }
+                          parallel_set_threads(threads);
+                      } break;
+            case 'w': {
+                          int res = sscanf(optarg, "%zu", &weight_column);
+                          if (res != 1) {
+                              failwithf("Could not convert weight column '%s' to an unsigned integer!\n", optarg);
+                          }
+                          use_weights = true;
+                      } break;
+
+            case OPT_DEDUP: {
+                          deduplicate = true;
+                      } break;
+            case OPT_GRID: {
+                          int res = sscanf(optarg, "%zu", &grid_bins);
+                          if (res != 1 || grid_bins == 0 || grid_bins > GRID_MAX_BINS) {
+                              failwithf("Could not convert bin amount '%s' to an integer between 1 and %d!\n", optarg, GRID_MAX_BINS);
+                          }
+                      } break;
+            case OPT_BIRCH: {
+                          int res = sscanf(optarg, "%zu", &birch_entries);
+                          if (res != 1 || birch_entries < BIRCH_BRANCHING) {
+                              failwithf("Could not convert leaf entry amount '%s' to an integer of at least %d!\n", optarg, BIRCH_BRANCHING);
+                          }
+                      } break;
+            case OPT_STREAM: {
+                          streaming = true;
+                      } break;
+            case OPT_DECAY: {
+                          if (sscanf(optarg, "%lf", &stream_decay) != 1 || !(stream_decay > 0.0 && stream_decay <= 1.0)) {
+                              failwithf("Could not convert decay '%s' to a number within (0, 1]!\n", optarg);
+                          }
+                      } break;
+            case OPT_WINDOW: {
+                          int res = sscanf(optarg, "%zu", &stream_window);
+                          if (res != 1 || stream_window == 0) {
+                              failwithf("Could not convert window length '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_SNAPSHOT: {
+                          int res = sscanf(optarg, "%zu", &snapshot_every);
+                          if (res != 1 || snapshot_every == 0) {
+                              failwithf("Could not convert snapshot interval '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_SAVE_MODEL: {
+                          save_model_path = strdup(optarg);
+                      } break;
+            case OPT_PREDICT: {
+                          predict_path = strdup(optarg);
+                      } break;
+            case OPT_INIT: {
+                          init_path = strdup(optarg);
+                      } break;
+            case OPT_CHECKPOINT: {
+                          checkpoint_path = strdup(optarg);
+                      } break;
+            case OPT_EVERY: {
+                          int res = sscanf(optarg, "%zu", &checkpoint_every);
+                          if (res != 1 || checkpoint_every == 0) {
+                              failwithf("Could not convert checkpoint interval '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_RESUME: {
+                          resume = true;
+                      } break;
+            case OPT_DEADLINE: {
+                          char unit[3] = "s";
+                          int res = sscanf(optarg, "%lf%2s", &deadline, unit);
+                          if (res < 1 || !(deadline > 0.0)) {
+                              failwithf("Could not convert deadline '%s' to a positive duration, e.g. 30s!\n", optarg);
+                          }
+                          if (strcmp(unit, "ms") == 0) {
+                              deadline /= 1000.0;
+                          } else if (strcmp(unit, "m") == 0) {
+                              deadline *= 60.0;
+                          } else if (strcmp(unit, "h") == 0) {
+                              deadline *= 3600.0;
+                          } else if (strcmp(unit, "s") != 0) {
+                              failwithf("Unknown unit in deadline '%s', expected ms, s, m or h!\n", optarg);
+                          }
+                      } break;
+            case OPT_STATE: {
+                          state_path = strdup(optarg);
+                      } break;
+            case OPT_APPEND: {
+                          appending = true;
+                      } break;
+            case OPT_SERVE: {
+                          serve_path = strdup(optarg);
+                      } break;
+            case OPT_PROCS: {
+                          int res = sscanf(optarg, "%zu", &processes);
+                          if (res != 1 || processes == 0) {
+                              failwithf("Could not convert process amount '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_COORDINATE: {
+                          int res = sscanf(optarg, "%u", &coordinate_port);
+                          if (res != 1 || coordinate_port == 0 || coordinate_port > 65535) {
+                              failwithf("Could not convert port '%s' to an integer from 1 to 65535!\n", optarg);
+                          }
+                      } break;
+            case OPT_WORKERS: {
+                          int res = sscanf(optarg, "%zu", &distributed_workers);
+                          if (res != 1 || distributed_workers == 0) {
+                              failwithf("Could not convert worker amount '%s' to a positive integer!\n", optarg);
+                          }
+                      } break;
+            case OPT_JOIN: {
+                          join_address = strdup(optarg);
+                      } break;
+            case OPT_MANIFEST: {
+                          manifest_path = strdup(optarg);
+                      } break;
+            case OPT_SHARE: {
+                          sharing = true;
+                      } break;
+            case OPT_CORESET: {
+                          int res = sscanf(optarg, "%zu", &coreset_samples);
+                          if (res != 1 || coreset_samples == 0) {
+                              failwithf("Could not convert coreset size '%s' to a positive integer!\n", optarg);
+                          }
                       } break;
 
             case 'g': {
@@ -267,51 +853,588 @@ void parse_args(int argc, char** argv) {
                           num_separator = optarg[0];
                       } break;
             default:  {
-                          fprintf(stderr, "Usage: %s [-kgierfnh] [range|columns...]\n", argv[0]);
+                          fprintf(stderr, "Usage: %s [-katwgierfnh] [range|columns...]\n", argv[0]);
                           exit(EXIT_FAILURE);
                       }
         }
     }
 
+    if (soft_output && algorithm != ALGORITHM_GMM) {
+        failwith("Only '-a gmm' can print probabilities (--soft)!\n");
+    }
+
     //Now we can work with the positional arguments
-    if (optind >= argc) {
+    if (optind >= argc && predict_path == NULL && serve_path == NULL && coordinate_port == 0
+            && manifest_path == NULL) {
         fprintf(stderr, "A set or range of columns/fields is required!");
     }
     int i;
-    char* param;
     for (i = optind; i < argc; i++) {
-        param = argv[i];
-        if (char_in_string(param, '-')) {
-            add_column_range(param);
-            continue;
+        if (!parse_columns(argv[i], &columns, &column_count)) {
+            failwithf("Could not parse columns '%s', give a column, a range like 0-9 or a list like 0,2,5-7!\n", argv[i]);
+        }
+    }
+
+    if (predict_path != NULL) {
+        // The model decides everything about the clustering, only the input format is up to the flags.
+        if (algorithm != ALGORITHM_LLOYD || reduce_to > 0 || deduplicate || grid_bins > 0 || coreset_samples > 0
+                || birch_entries > 0 || streaming || save_model_path != NULL || soft_output) {
+            failwith("Predicting (--predict) labels rows with a saved model, it cannot be combined with flags that train one!\n");
         }
-        add_column(param);
+        model = model_load(predict_path);
+        if (column_count == 0) {
+            for (i = 0; i < (int) model->m; i++) {
+                add_column_index(model->columns[i]);
+            }
+        } else if (column_count != model->m || memcmp(columns, model->columns, sizeof(size_t) * column_count) != 0) {
+            failwithf("The columns do not match the %zu columns that the model '%s' was saved with!\n", model->m, predict_path);
+        }
+        kernels = model->k;
+        metric = model->metric;
+        metric_weights = model->column_weights;
+        metric_weight_count = model->m;
+    }
+    if (init_path != NULL) {
+        if (algorithm != ALGORITHM_LLOYD || reduce_to > 0 || streaming || predict_path != NULL) {
+            failwith("Only '-a lloyd' without --reduce, --stream or --predict can start from given kernels (--init)!\n");
+        }
+        size_t init_kernels;
+        initial_kernels = model_read_kernels(init_path, column_count, columns, field_separator, num_separator, &init_kernels);
+        if (kernels_given && init_kernels != kernels) {
+            failwithf("'%s' holds %zu kernels, but %zu kernels were asked for (-k)!\n", init_path, init_kernels, kernels);
+        }
+        if (init_kernels < 2) {
+            failwithf("Kernel amount must be at least 2, '%s' holds %zu!\n", init_path, init_kernels);
+        }
+        kernels = init_kernels;
+    }
+    if (checkpoint_path != NULL && (algorithm != ALGORITHM_LLOYD || reduce_to > 0 || grid_bins > 0 || coreset_samples > 0
+                || birch_entries > 0 || streaming || predict_path != NULL)) {
+        failwith("Only '-a lloyd' on all rows (no --reduce, --grid, --coreset, --birch, --stream or --predict)"
+                " can be checkpointed (--checkpoint)!\n");
+    }
+    if (deadline > 0.0 && algorithm != ALGORITHM_LLOYD) {
+        failwith("Only '-a lloyd' can stop at a deadline (--deadline)!\n");
+    }
+    if (resume && checkpoint_path == NULL) {
+        failwith("--resume needs the --checkpoint to resume from!\n");
+    }
+    if (state_path != NULL && (algorithm != ALGORITHM_LLOYD || metric != METRIC_EUCLIDEAN || reduce_to > 0 || grid_bins > 0
+                || coreset_samples > 0 || birch_entries > 0 || streaming || predict_path != NULL || deduplicate)) {
+        failwith("Only euclidean '-a lloyd' on all rows (no --reduce, --grid, --coreset, --birch, --stream, --predict or --dedup)"
+                " can keep a state (--state)!\n");
+    }
+    if (processes > 1 && (algorithm != ALGORITHM_LLOYD || metric == METRIC_MANHATTAN || grid_bins > 0 || coreset_samples > 0
+                || birch_entries > 0 || streaming || predict_path != NULL || appending)) {
+        failwith("Only '-a lloyd' on all rows (no --grid, --coreset, --birch, --stream, --predict or --append)"
+                " without the manhattan metric can run in worker processes (--procs)!\n");
+    }
+    if ((coordinate_port != 0 || join_address != NULL) && (algorithm != ALGORITHM_LLOYD || metric != METRIC_EUCLIDEAN
+                || reduce_to > 0 || deduplicate || grid_bins > 0 || coreset_samples > 0 || birch_entries > 0 || streaming
+                || predict_path != NULL || state_path != NULL || init_path != NULL || checkpoint_path != NULL
+                || save_model_path != NULL || processes > 1)) {
+        failwith("Only euclidean '-a lloyd' on all rows, without flags that change how or where it runs,"
+                " can be distributed (--coordinate or --join)!\n");
+    }
+    if (coordinate_port != 0 && join_address != NULL) {
+        failwith("A process either coordinates (--coordinate) or joins (--join) a distributed run!\n");
+    }
+    if (coordinate_port != 0 && distributed_workers == 0) {
+        failwith("--coordinate needs the amount of workers to wait for (--workers)!\n");
+    }
+    if (distributed_workers > 0 && coordinate_port == 0) {
+        failwith("--workers is the amount of workers a coordinator (--coordinate) waits for!\n");
+    }
+    if (manifest_path != NULL && (algorithm != ALGORITHM_LLOYD || metric == METRIC_WEIGHTED || column_count > 0
+                || reduce_to > 0 || deduplicate || use_weights || grid_bins > 0 || coreset_samples > 0 || birch_entries > 0
+                || streaming || predict_path != NULL || state_path != NULL || init_path != NULL || checkpoint_path != NULL
+                || save_model_path != NULL || deadline > 0.0 || processes > 1 || serve_path != NULL || coordinate_port != 0
+                || join_address != NULL)) {
+        failwith("The jobs of a manifest (--manifest) bring their own columns and k, and are clustered by '-a lloyd'"
+                " with only -g, -i, -e, -f, -n, -t and --metric (not weighted) applied to each!\n");
+    }
+    if (sharing && (deduplicate || grid_bins > 0 || birch_entries > 0 || streaming || predict_path != NULL
+                || serve_path != NULL || manifest_path != NULL || coordinate_port != 0)) {
+        failwith("Only rows that are kept as parsed (no --dedup, --grid, --birch, --stream or --predict)"
+                " can be shared (--share)!\n");
+    }
+    if (appending && state_path == NULL) {
+        failwith("--append needs the --state to append to!\n");
+    }
+    if (appending && (init_path != NULL || checkpoint_path != NULL || save_model_path != NULL)) {
+        failwith("Appending (--append) updates the kernels of the state, it cannot take --init, --checkpoint or --save-model!\n");
+    }
+    if (save_model_path != NULL && (algorithm != ALGORITHM_LLOYD || reduce_to > 0 || streaming)) {
+        failwith("Only '-a lloyd' without --reduce or --stream can save its kernels (--save-model)!\n");
+    }
+
+    if (metric != METRIC_EUCLIDEAN && algorithm != ALGORITHM_LLOYD) {
+        failwith("Only '-a lloyd' supports other metrics than euclidean!\n");
+    }
+    if (use_weights && algorithm != ALGORITHM_LLOYD) {
+        failwith("Only '-a lloyd' supports row weights (-w)!\n");
+    }
+    if (deduplicate && algorithm != ALGORITHM_LLOYD) {
+        failwith("Only '-a lloyd' can cluster collapsed rows (--dedup), the other algorithms do not take row weights!\n");
+    }
+    if (grid_bins > 0 && (algorithm != ALGORITHM_LLOYD || metric != METRIC_EUCLIDEAN || reduce_to > 0)) {
+        failwith("The grid (--grid) only works with '-a lloyd', the euclidean metric and no --reduce!\n");
+    }
+    if (grid_bins > 0 && column_count > GRID_MAX_COLUMNS) {
+        failwithf("The grid (--grid) is meant for low-dimensional data, at most %d columns, got %zu!\n", GRID_MAX_COLUMNS, column_count);
+    }
+    if (coreset_samples > 0 && (algorithm != ALGORITHM_LLOYD || metric != METRIC_EUCLIDEAN || grid_bins > 0)) {
+        failwith("The coreset (--coreset) only works with '-a lloyd', the euclidean metric and no --grid!\n");
+    }
+    if (birch_entries > 0 && (algorithm != ALGORITHM_LLOYD || metric != METRIC_EUCLIDEAN
+                || deduplicate || grid_bins > 0 || coreset_samples > 0 || reduce_to > 0)) {
+        failwith("The clustering-feature tree (--birch) only works with '-a lloyd', the euclidean metric"
+                " and none of --dedup, --grid, --coreset or --reduce!\n");
+    }
+    if (streaming && (algorithm != ALGORITHM_LLOYD || metric != METRIC_EUCLIDEAN || deduplicate
+                || grid_bins > 0 || coreset_samples > 0 || birch_entries > 0 || reduce_to > 0)) {
+        failwith("Streaming (--stream) only works with '-a lloyd', the euclidean metric"
+                " and none of --dedup, --grid, --coreset, --birch or --reduce!\n");
+    }
+    if (!streaming && (stream_window > 0 || snapshot_every > 0)) {
+        failwith("--window and --snapshot are only used when streaming (--stream)!\n");
+    }
+    if (metric == METRIC_WEIGHTED && metric_weight_count != column_count) {
+        failwithf("The weighted metric needs one weight per column, got %zu weights for %zu columns!\n",
+                metric_weight_count, column_count);
+    }
+    if (metric == METRIC_WEIGHTED && reduce_to > 0) {
+        failwith("Column weights cannot be combined with --reduce, the reduced columns are not the selected ones!\n");
+    }
+    if (reduce_refine && metric != METRIC_EUCLIDEAN) {
+        failwith("--reduce-refine finishes with a euclidean iteration, it only works with the euclidean metric!\n");
     }
 }
 
-char line_buffer[2048];
+char* line_buffer = NULL;
+size_t line_capacity = 0;
 int ignore;
 
+/**
+ * Records the movement of every iteration, and writes a checkpoint every checkpoint_every iterations,
+ * or right away when the run is stopping early.
+ */
+void save_progress(size_t iteration, double movement, double** kernels, checkpoint* saved, bool stopping) {
+    if (saved->history_count == history_cap) {
+        history_cap = (history_cap == 0) ? 64 : history_cap * 2;
+        saved->history = realloc(saved->history, sizeof(double) * history_cap);
+        if (saved->history == NULL) {
+            failwith("Growing the convergence history with realloc caused an error!\n");
+        }
+    }
+    saved->history[saved->history_count] = movement;
+    saved->history_count += 1;
+    saved->iteration = iteration;
+    if (stopping || iteration % checkpoint_every == 0) {
+        saved->kernels = kernels;
+        checkpoint_write(checkpoint_path, saved);
+    }
+}
+
+void handle_stop_signal(int signal_number) {
+    stop_signal = signal_number;
+}
+
+double elapsed_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - started.tv_sec) + (double) (now.tv_nsec - started.tv_nsec) / 1e9;
+}
+
+/**
+ * Called after every iteration of '-a lloyd', saves checkpoints and decides whether there is time for another iteration.
+ */
+bool iteration_done(size_t iteration, double movement, double** kernels, size_t k, size_t m, void* context) {
+    bool go_on = true;
+    if (stop_signal != 0) {
+        fprintf(stderr, "Stopped after %zu iterations by signal %d, the labels are those of the kernels so far.\n",
+                iteration, (int) stop_signal);
+        go_on = false;
+    } else if (deadline > 0.0) {
+        // The next iteration is predicted to take as long as the slowest of this one and the running average.
+        // Stopping after it costs one more assignment, which is most of an iteration, so two have to fit.
+        double now = elapsed_seconds();
+        double duration = now - iteration_started;
+        iteration_started = now;
+        predicted_iteration = (predicted_iteration == 0.0) ? duration : 0.5 * predicted_iteration + 0.5 * duration;
+        double next = (duration > predicted_iteration) ? duration : predicted_iteration;
+        if (now + 2.0 * next > deadline) {
+            fprintf(stderr, "Stopped after %zu iterations to meet the deadline, the labels are those of the kernels so far.\n",
+                    iteration);
+            go_on = false;
+        }
+    }
+    if (checkpoint_path != NULL) {
+        // A preempted run (SIGTERM) must not lose the iterations since the last checkpoint.
+        save_progress(iteration, movement, kernels, &progress, !go_on);
+    }
+    return go_on;
+}
+
+/**
+ * Lets a '-a lloyd' run stop cleanly on SIGINT, SIGTERM or the deadline, instead of dying without output.
+ */
+void watch_iterations(k_means_options* options) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    // A second signal is not caught, so a run can still be killed right away.
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    iteration_started = elapsed_seconds();
+    options->on_iteration = iteration_done;
+}
+
+/**
+ * Sets up the checkpoints of a run, and picks up the saved progress when resuming.
+ * Returns the saved progress, which holds the kernels to start from until the run is done, or NULL.
+ */
+checkpoint* prepare_checkpoints(k_means_options* options, double** rows, size_t n, size_t m) {
+    progress.fingerprint = checkpoint_fingerprint(rows, n, m, row_weights);
+    progress.seed = (uint64_t) time(NULL);
+    progress.iteration = 0;
+    progress.k = options->k;
+    progress.m = m;
+    progress.history_count = 0;
+    progress.history = NULL;
+    progress.kernels = NULL;
+    checkpoint* saved = (resume) ? checkpoint_read(checkpoint_path) : NULL;
+    if (saved != NULL) {
+        if (saved->fingerprint != progress.fingerprint) {
+            failwithf("The checkpoint '%s' was made on other data, remove it or drop --resume to start over!\n", checkpoint_path);
+        }
+        if (saved->k != options->k || saved->m != m) {
+            failwithf("The checkpoint '%s' holds %zu kernels of %zu columns, but this run has %zu kernels of %zu columns!\n",
+                    checkpoint_path, saved->k, saved->m, options->k, m);
+        }
+        progress.seed = saved->seed;
+        progress.iteration = saved->iteration;
+        progress.history_count = saved->history_count;
+        history_cap = saved->history_count;
+        progress.history = malloc(sizeof(double) * (history_cap + 1));
+        memcpy(progress.history, saved->history, sizeof(double) * saved->history_count);
+        options->initial_kernels = saved->kernels;
+        options->first_iteration = saved->iteration;
+    }
+    options->seed = (unsigned int) progress.seed;
+    return saved;
+}
+
+/**
+ * Labels the parsed rows with the kernels of the model and starts a new batch.
+ */
+void predict_batch() {
+    static size_t labels[PREDICT_BATCH];
+    size_t ri;
+    k_means_options options = k_means_default_options(model->k, false);
+    options.metric = model->metric;
+    options.column_weights = model->column_weights;
+    k_means_assign(&options, data_rows, data_row_count, column_count, model->kernels, labels);
+    for (ri = 0; ri < data_row_count; ri++) {
+        printf("%zu\n", labels[ri]);
+    }
+    fflush(stdout);
+    data_row_count = 0;
+}
+
 int main(int argc, char** argv) {
+    clock_gettime(CLOCK_MONOTONIC, &started);
     parse_args(argc, argv);
+    if (serve_path != NULL) {
+        // The jobs bring their own data and settings.
+        serve(serve_path, parallel_threads());
+    }
+    if (manifest_path != NULL) {
+        manifest_settings settings;
+        settings.generate_kernels = generate_kernels;
+        settings.ignore_header = ignore_header;
+        settings.fail_on_errors = fail_on_errors;
+        settings.field_separator = field_separator;
+        settings.num_separator = num_separator;
+        settings.metric = metric;
+        exit((manifest_run(manifest_path, &settings) == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (coordinate_port != 0) {
+        // The workers hold the rows, the coordinator only keeps the kernels.
+        k_means_options options = k_means_default_options(kernels, generate_kernels);
+        watch_iterations(&options);
+        distributed_coordinate(coordinate_port, distributed_workers, &options, field_separator);
+        return 0;
+    }
+
+    row_format.field_separator = field_separator;
+    row_format.num_separator = num_separator;
+    row_format.columns = columns;
+    row_format.column_count = column_count;
+    row_format.use_weights = use_weights;
+    row_format.weight_column = weight_column;
 
-    preallocate_data_rows();
+    share* shared = NULL;
+    share_role role = SHARE_UNAVAILABLE;
+    if (sharing) {
+        // Everything but the columns that changes the parsed rows is part of the key.
+        char settings[96];
+        snprintf(settings, sizeof(settings), "f=%.32s n=%c i=%d e=%d w=%d:%zu", field_separator, num_separator,
+                ignore_header, fail_on_errors, use_weights, weight_column);
+        shared = share_open(STDIN_FILENO, columns, column_count, settings, &role);
+    }
+    if (role == SHARE_ATTACHED) {
+        data_rows = share_rows(shared, &data_row_count, (const double**) &row_weights);
+    } else {
+        preallocate_data_rows();
+    }
     
     int i = 0;
+    if (streaming || model != NULL) {
+        // scanf would wait for the start of the next line before returning this one,
+        // so lines are read whole with getline, and labels are printed as soon as their lines (or batch) end.
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t length;
+        bool header = ignore_header;
+        while ((length = getline(&line, &line_cap, stdin)) != -1) {
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+                line[--length] = '\0';
+            }
+            if (header) {
+                header = false;
+                printf("%skernel\n", field_separator);
+                continue;
+            }
+            if (length > 0) {
+                parse_data_row(line, i);
+            }
+            if (model != NULL && data_row_count == PREDICT_BATCH) {
+                predict_batch();
+            }
+            i++;
+        }
+        free(line);
+        if (model != NULL) {
+            predict_batch();
+            model_free(model);
+        } else {
+            stream_free(stream);
+        }
+        return 0;
+    }
     if (ignore_header) {
         // If we are ignoring a header, 
         // that means we should add a header to the output.
         // Otherwise, the output will be offset by a line.
-        ignore = scanf("%s\n", line_buffer);
-        printf("%skernel\n", field_separator);
+        if (role != SHARE_ATTACHED) {
+            ignore = parse_next_line(stdin, &line_buffer, &line_capacity);
+        }
+        if (soft_output) {
+            size_t ki;
+            for (ki = 0; ki < kernels; ki++) {
+                printf("%skernel%zu", (ki == 0) ? "" : field_separator, ki);
+            }
+            printf("\n");
+        } else if (birch == NULL) {
+            printf("%skernel\n", field_separator);
+        }
     }
-    while(scanf("%s\n", line_buffer) != EOF) {
+    while(role != SHARE_ATTACHED && parse_next_line(stdin, &line_buffer, &line_capacity)) {
         parse_data_row(line_buffer, i);
         i++;
     }
-    trim_data_rows();
-    size_t* by_kernel = k_means(kernels, data_rows, data_row_count, column_count, generate_kernels);
+    free(line_buffer);
+    if (birch != NULL) {
+        // Cluster the leaf entries as weighted rows, every input row is represented by one of them.
+        size_t count, ki, vi;
+        double* weights;
+        double** leaf_rows = cf_leaf_rows(birch, &count, &weights);
+        cf_free(birch);
+        k_means_options options = k_means_default_options(kernels, generate_kernels);
+        options.row_weights = weights;
+        options.initial_kernels = initial_kernels;
+        watch_iterations(&options);
+        options.kernels_out = allocate_rows(kernels, column_count);
+        free(k_means_with_options(&options, leaf_rows, count, column_count));
+        for (ki = 0; ki < kernels; ki++) {
+            for (vi = 0; vi < column_count; vi++) {
+                printf("%s%lf", (vi == 0) ? "" : field_separator, options.kernels_out[ki][vi]);
+            }
+            printf("\n");
+        }
+        if (save_model_path != NULL) {
+            model_save(save_model_path, METRIC_EUCLIDEAN, kernels, column_count, columns, NULL, options.kernels_out);
+        }
+        free_rows(options.kernels_out, kernels);
+        free_rows(leaf_rows, count);
+        free(weights);
+        return 0;
+    }
+    if (role != SHARE_ATTACHED) {
+        trim_data_rows();
+    }
+    if (role == SHARE_PUBLISH && share_publish(shared, data_rows, data_row_count, row_weights)) {
+        // From now on this process reads the published rows too, so they are in memory once.
+        free_rows(data_rows, data_row_count);
+        free(row_weights);
+        data_rows = share_rows(shared, &data_row_count, (const double**) &row_weights);
+    }
+    if (dedup != NULL) {
+        dedup_free(dedup);
+    }
+    if (appending) {
+        size_t total, ri;
+        size_t* labels = incremental_append(state_path, data_rows, data_row_count, column_count, row_weights, columns, &total);
+        for (ri = 0; ri < total; ri++) {
+            printf("%zu\n", labels[ri]);
+        }
+        free(labels);
+        return 0;
+    }
+    if (join_address != NULL) {
+        size_t ri;
+        size_t* labels = distributed_work(join_address, data_rows, data_row_count, column_count, row_weights);
+        for (ri = 0; ri < data_row_count; ri++) {
+            printf("%zu\n", labels[ri]);
+        }
+        free(labels);
+        return 0;
+    }
+
+    // Clustering may happen in a reduced space, the original rows are kept around for refinement.
+    double** cluster_rows = data_rows;
+    size_t cluster_columns = column_count;
+    if (reduce_to > 0) {
+        cluster_rows = reduce_rows(data_rows, data_row_count, column_count, reduce_to, reduce_method);
+        cluster_columns = reduce_to;
+    }
+
+    size_t* by_kernel;
+    double* probabilities = NULL;
+    double** model_kernels = (save_model_path != NULL || state_path != NULL) ? allocate_rows(kernels, column_count) : NULL;
+    switch (algorithm) {
+        case ALGORITHM_PQ:
+            by_kernel = pq_k_means(kernels, cluster_rows, data_row_count, cluster_columns, generate_kernels, pq_subspaces, pq_shortlist);
+            break;
+        case ALGORITHM_NYSTROM: {
+            // Kernel k-means is plain k-means on the Nyström features.
+            size_t features;
+            size_t sample = (landmarks < data_row_count) ? landmarks : data_row_count;
+            double** feature_rows = nystrom_features(cluster_rows, data_row_count, cluster_columns, sample, nystrom, &features);
+            by_kernel = k_means(kernels, feature_rows, data_row_count, features, generate_kernels);
+            free_rows(feature_rows, data_row_count);
+        } break;
+        case ALGORITHM_GMM: {
+            if (soft_output) {
+                probabilities = malloc(sizeof(double) * data_row_count * kernels);
+            }
+            by_kernel = gmm(kernels, cluster_rows, data_row_count, cluster_columns, generate_kernels, gmm_kmeans_init, probabilities);
+        } break;
+        case ALGORITHM_PAM:
+            by_kernel = k_medoids(kernels, cluster_rows, data_row_count, cluster_columns, clara_samples, clara_size);
+            break;
+        default: {
+            k_means_options options = k_means_default_options(kernels, generate_kernels);
+            options.metric = metric;
+            options.column_weights = metric_weights;
+            options.initial_kernels = initial_kernels;
+            watch_iterations(&options);
+            if (grid_bins > 0) {
+                // Cluster the weighted cell centroids, then clean up with one exact iteration over every row.
+                size_t cells, ri;
+                double* cell_weights;
+                size_t* cell_of = malloc(sizeof(size_t) * data_row_count);
+                double** cell_rows = grid_cells(data_rows, data_row_count, column_count, row_weights,
+                        column_minimum, column_maximum, grid_bins, cell_of, &cells, &cell_weights);
+                options.row_weights = cell_weights;
+                // The cells are the weighted means of their rows, so the kernels of the cells are those of the rows.
+                options.kernels_out = model_kernels;
+                size_t* cell_labels = k_means_with_options(&options, cell_rows, cells, column_count);
+                by_kernel = malloc(sizeof(size_t) * data_row_count);
+                for (ri = 0; ri < data_row_count; ri++) {
+                    by_kernel[ri] = cell_labels[cell_of[ri]];
+                }
+                // The rows are labeled by the refined kernels, so those are the ones saved.
+                refine_labels(data_rows, data_row_count, column_count, kernels, row_weights, by_kernel, model_kernels);
+                free_rows(cell_rows, cells);
+                free(cell_weights);
+                free(cell_labels);
+                free(cell_of);
+                break;
+            }
+            if (coreset_samples > 0) {
+                // Find the kernels on the coreset alone, and only label all rows with them.
+                size_t size;
+                double* coreset_weights;
+                double** coreset = coreset_rows(cluster_rows, data_row_count, cluster_columns, kernels, row_weights,
+                        coreset_samples, &size, &coreset_weights);
+                options.row_weights = coreset_weights;
+                options.kernels_out = (model_kernels != NULL) ? model_kernels : allocate_rows(kernels, cluster_columns);
+                free(k_means_with_options(&options, coreset, size, cluster_columns));
+                by_kernel = malloc(sizeof(size_t) * data_row_count);
+                k_means_assign(&options, cluster_rows, data_row_count, cluster_columns, options.kernels_out, by_kernel);
+                if (model_kernels == NULL) {
+                    free_rows(options.kernels_out, kernels);
+                }
+                free_rows(coreset, size);
+                free(coreset_weights);
+                break;
+            }
+            options.row_weights = row_weights;
+            options.kernels_out = model_kernels;
+            checkpoint* saved = NULL;
+            if (checkpoint_path != NULL) {
+                saved = prepare_checkpoints(&options, cluster_rows, data_row_count, cluster_columns);
+            }
+            if (processes > 1) {
+                by_kernel = procs_k_means(&options, cluster_rows, data_row_count, cluster_columns, processes);
+            } else {
+                by_kernel = k_means_with_options(&options, cluster_rows, data_row_count, cluster_columns);
+            }
+            if (saved != NULL) {
+                checkpoint_free(saved);
+            }
+        } break;
+    }
+    if (model_kernels != NULL) {
+        if (save_model_path != NULL) {
+            model_save(save_model_path, metric, kernels, column_count, columns,
+                    (metric == METRIC_WEIGHTED) ? metric_weights : NULL, model_kernels);
+        }
+        if (state_path != NULL) {
+            incremental_create(state_path, data_rows, data_row_count, column_count, row_weights, columns, model_kernels, kernels);
+        }
+        free_rows(model_kernels, kernels);
+    }
+
+    if (reduce_to > 0) {
+        free_rows(cluster_rows, data_row_count);
+        if (reduce_refine) {
+            refine_labels(data_rows, data_row_count, column_count, kernels, row_weights, by_kernel, NULL);
+        }
+    }
     size_t ri;
+    if (probabilities != NULL) {
+        size_t ki;
+        for (ri = 0; ri < data_row_count; ri++) {
+            for (ki = 0; ki < kernels; ki++) {
+                printf("%s%lf", (ki == 0) ? "" : field_separator, probabilities[ri * kernels + ki]);
+            }
+            printf("\n");
+        }
+        free(probabilities);
+        return 0;
+    }
+    if (deduplicate) {
+        // Every parsed line gets the label of the row it was collapsed into.
+        for (ri = 0; ri < parsed_row_count; ri++) {
+            printf("%zu\n", by_kernel[row_index[ri]]);
+        }
+        return 0;
+    }
     for (ri = 0; ri < data_row_count; ri++) {
         printf("%zu\n", by_kernel[ri]);
     }
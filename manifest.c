@@ -0,0 +1,316 @@
+/**
+ *
+ * This module runs the jobs of a manifest (--manifest) in one process, see manifest.h for the format.
+ *
+ * Every thread of the parallel-module is a worker, which takes the next job of the manifest until none are left:
+ * it reads and parses the input with the parse-module, exactly like a normal run parses stdin, clusters the rows
+ * and writes the labels. Taking a job also asks the kernel to read the input of the job MANIFEST_READ_AHEAD rounds
+ * later into the page cache, so the workers rarely wait for the disk. Every worker keeps its values, row pointers
+ * and workspace between jobs, so a long manifest of small jobs soon stops allocating.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "manifest.h"
+#include "parse.h"
+#include "parallel.h"
+#include "fail.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// How many jobs per worker the inputs are read ahead.
+#define MANIFEST_READ_AHEAD 2
+#define MANIFEST_ERROR_LENGTH 128
+
+typedef struct {
+    size_t line;       // Of the manifest.
+    char* input;
+    char* output;
+    size_t* columns;
+    size_t m;
+    size_t k;
+    size_t n;
+    size_t iterations;
+    double parse_seconds;
+    double cluster_seconds;
+    double write_seconds;
+    bool failed;
+    char error[MANIFEST_ERROR_LENGTH];
+} job;
+
+typedef struct {
+    char* line;
+    size_t line_capacity;
+    double* values;
+    size_t values_capacity;
+    double** rows;
+    size_t rows_capacity;
+    char* arena;
+    size_t arena_size;
+} worker_state;
+
+typedef struct {
+    const manifest_settings* settings;
+    job* jobs;
+    size_t count;
+    size_t next;     // The next job to take, taken atomically.
+    size_t workers;
+} manifest;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+static void fail_job(job* j, const char* message, ...) __attribute__((format(printf, 2, 3)));
+
+static void fail_job(job* j, const char* message, ...) {
+    va_list arguments;
+    va_start(arguments, message);
+    vsnprintf(j->error, sizeof(j->error), message, arguments);
+    va_end(arguments);
+    j->failed = true;
+}
+
+static job* read_manifest(const char* path, size_t* count) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        failwithf("Could not open the manifest '%s'!\n", path);
+    }
+    size_t cap = 64, line_number = 0;
+    job* jobs = malloc(sizeof(job) * cap);
+    char* line = NULL;
+    size_t line_cap = 0;
+    *count = 0;
+    while (getline(&line, &line_cap, file) != -1) {
+        line_number += 1;
+        char* fields[5];
+        char* save;
+        size_t found = 0;
+        char* field = strtok_r(line, " \t\r\n", &save);
+        if (field == NULL || field[0] == '#') {
+            continue;
+        }
+        while (field != NULL && found < 5) {
+            fields[found++] = field;
+            field = strtok_r(NULL, " \t\r\n", &save);
+        }
+        if (found != 4) {
+            failwithf("Line %zu of the manifest should be '<input> <output> <columns> <k>'!\n", line_number);
+        }
+        if (*count == cap) {
+            cap *= 2;
+            jobs = realloc(jobs, sizeof(job) * cap);
+        }
+        job* j = &jobs[*count];
+        memset(j, 0, sizeof(job));
+        j->line = line_number;
+        j->input = strdup(fields[0]);
+        j->output = strdup(fields[1]);
+        if (!parse_columns(fields[2], &j->columns, &j->m)) {
+            failwithf("Could not parse the columns '%s' on line %zu of the manifest!\n", fields[2], line_number);
+        }
+        char* end;
+        j->k = strtoull(fields[3], &end, 10);
+        if (*end != '\0' || j->k < 2) {
+            failwithf("The kernel amount '%s' on line %zu of the manifest must be an integer of at least 2!\n", fields[3], line_number);
+        }
+        *count += 1;
+    }
+    free(line);
+    fclose(file);
+    return jobs;
+}
+
+/**
+ * @brief Let the kernel read an input into the page cache in the background.
+ */
+static void read_ahead(const job* j) {
+    int fd = open(j->input, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+/**
+ * @brief Parse the input of a job into the values of a worker, line by line like a normal run parses stdin.
+ */
+static void parse_job(const manifest_settings* settings, worker_state* w, job* j) {
+    const size_t m = j->m;
+    FILE* file = fopen(j->input, "r");
+    if (file == NULL) {
+        fail_job(j, "could not open the input");
+        return;
+    }
+    parse_settings format;
+    format.field_separator = settings->field_separator;
+    format.num_separator = settings->num_separator;
+    format.columns = j->columns;
+    format.column_count = m;
+    format.use_weights = false;
+    format.weight_column = 0;
+    size_t line_number = 0, n = 0, column;
+    if (settings->ignore_header && parse_next_line(file, &w->line, &w->line_capacity)) {
+        line_number += 1;
+    }
+    while (parse_next_line(file, &w->line, &w->line_capacity)) {
+        line_number += 1;
+        if ((n + 1) * m > w->values_capacity) {
+            w->values_capacity = (w->values_capacity < 1024) ? 1024 : w->values_capacity * 2;
+            while (w->values_capacity < (n + 1) * m) {
+                w->values_capacity *= 2;
+            }
+            w->values = realloc(w->values, sizeof(double) * w->values_capacity);
+            if (w->values == NULL) {
+                failwith("Growing the values of a manifest worker with realloc caused an error!\n");
+            }
+        }
+        double weight;
+        parse_status status = parse_row(&format, w->line, w->values + n * m, &weight, &column);
+        if (status == PARSE_OK) {
+            n += 1;
+        } else if (settings->fail_on_errors) {
+            fail_job(j, (status == PARSE_MISSING_COLUMN) ? "could not find column %zu on line %zu"
+                    : "could not parse column %zu on line %zu", column, line_number);
+            break;
+        }
+    }
+    fclose(file);
+    if (w->rows_capacity < n) {
+        w->rows_capacity = n + n / 2;
+        w->rows = realloc(w->rows, sizeof(double*) * w->rows_capacity);
+    }
+    size_t ri;
+    for (ri = 0; ri < n; ri++) {
+        w->rows[ri] = w->values + ri * m;
+    }
+    j->n = n;
+}
+
+/**
+ * @brief Cluster the parsed rows of a job in the arena of a worker, which holds the labels and then the workspace.
+ */
+static void cluster_job(const manifest_settings* settings, worker_state* w, job* j) {
+    k_means_options options = k_means_default_options(j->k, settings->generate_kernels);
+    options.metric = settings->metric;
+    if (j->n < j->k) {
+        fail_job(j, "%zu rows cannot be clustered into %zu kernels", j->n, j->k);
+        return;
+    }
+    size_t workspace_size = kmeans_workspace_size(&options, j->n, j->m);
+    size_t workspace_offset = (sizeof(size_t) * j->n + KMEANS_WORKSPACE_ALIGNMENT - 1) & ~((size_t) KMEANS_WORKSPACE_ALIGNMENT - 1);
+    size_t needed = workspace_offset + workspace_size;
+    if (needed > w->arena_size) {
+        free(w->arena);
+        w->arena_size = needed + needed / 2;
+        if (posix_memalign((void**) &w->arena, KMEANS_WORKSPACE_ALIGNMENT, w->arena_size) != 0) {
+            failwithf("Could not allocate %zu bytes for the workspace of a manifest worker!\n", w->arena_size);
+        }
+    }
+    kmeans_ctx ctx;
+    kmeans_status status = kmeans_ctx_init(&ctx, &options, w->rows, j->n, j->m, (size_t*) w->arena,
+            w->arena + workspace_offset, workspace_size);
+    if (status == KMEANS_OK) {
+        status = kmeans_run(&ctx);
+        j->iterations = kmeans_iterations(&ctx);
+        kmeans_free(&ctx);
+    }
+    if (status != KMEANS_OK) {
+        fail_job(j, "%s", kmeans_status_message(status));
+    }
+}
+
+static void write_job(const manifest_settings* settings, worker_state* w, job* j) {
+    FILE* file = fopen(j->output, "w");
+    if (file == NULL) {
+        fail_job(j, "could not create the output");
+        return;
+    }
+    const size_t* labels = (const size_t*) w->arena;
+    size_t ri;
+    if (settings->ignore_header) {
+        fprintf(file, "%skernel\n", settings->field_separator);
+    }
+    for (ri = 0; ri < j->n; ri++) {
+        fprintf(file, "%zu\n", labels[ri]);
+    }
+    if (fclose(file) != 0) {
+        fail_job(j, "could not write the output");
+    }
+}
+
+/**
+ * @brief A worker, one per thread of the parallel-module, that takes jobs until none are left.
+ */
+static void run_jobs(size_t from, size_t to, size_t worker, void* context) {
+    manifest* p = context;
+    worker_state w;
+    memset(&w, 0, sizeof(w));
+    while (true) {
+        size_t ji = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        if (ji >= p->count) {
+            break;
+        }
+        if (ji + MANIFEST_READ_AHEAD * p->workers < p->count) {
+            read_ahead(&p->jobs[ji + MANIFEST_READ_AHEAD * p->workers]);
+        }
+        job* j = &p->jobs[ji];
+        double started = now();
+        parse_job(p->settings, &w, j);
+        double parsed = now();
+        j->parse_seconds = parsed - started;
+        if (!j->failed) {
+            cluster_job(p->settings, &w, j);
+        }
+        double clustered = now();
+        j->cluster_seconds = clustered - parsed;
+        if (!j->failed) {
+            write_job(p->settings, &w, j);
+            j->write_seconds = now() - clustered;
+        }
+    }
+    free(w.line);
+    free(w.values);
+    free(w.rows);
+    free(w.arena);
+}
+
+size_t manifest_run(const char* path, const manifest_settings* settings) {
+    manifest p;
+    memset(&p, 0, sizeof(p));
+    p.settings = settings;
+    p.jobs = read_manifest(path, &p.count);
+    p.workers = parallel_threads();
+    size_t ji;
+    for (ji = 0; ji < p.count && ji < MANIFEST_READ_AHEAD * p.workers; ji++) {
+        read_ahead(&p.jobs[ji]);
+    }
+
+    double started = now();
+    parallel_for(p.workers, run_jobs, &p);
+    double seconds = now() - started;
+
+    size_t failed = 0, rows = 0;
+    fprintf(stderr, "line\tinput\trows\tk\titerations\tparse_ms\tcluster_ms\twrite_ms\tstatus\n");
+    for (ji = 0; ji < p.count; ji++) {
+        job* j = &p.jobs[ji];
+        fprintf(stderr, "%zu\t%s\t%zu\t%zu\t%zu\t%.3lf\t%.3lf\t%.3lf\t%s\n", j->line, j->input, j->n, j->k, j->iterations,
+                j->parse_seconds * 1e3, j->cluster_seconds * 1e3, j->write_seconds * 1e3, j->failed ? j->error : "ok");
+        failed += j->failed ? 1 : 0;
+        rows += j->n;
+        free(j->input);
+        free(j->output);
+        free(j->columns);
+    }
+    fprintf(stderr, "Clustered %zu of %zu jobs (%zu rows) in %.3lf s with %zu workers.\n",
+            p.count - failed, p.count, rows, seconds, p.workers);
+    free(p.jobs);
+    return failed;
+}
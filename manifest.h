@@ -0,0 +1,39 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "k_means.h"
+
+/**
+ * @brief How every job of a manifest is parsed and clustered, the flags of the command line that apply to each job.
+ */
+typedef struct {
+    bool generate_kernels;       // -g
+    bool ignore_header;          // -i, every input has a header line, and every output gets one.
+    bool fail_on_errors;         // -e, a line that cannot be parsed fails its job, instead of being skipped.
+    const char* field_separator; // -f
+    char num_separator;          // -n
+    metric_t metric;             // --metric, every metric but the weighted one.
+} manifest_settings;
+
+/**
+ * @brief Cluster every job of a manifest in this process (--manifest), and print a timing summary to stderr.
+ *
+ * Every non-empty line of the manifest that does not start with '#' is a job, of four fields separated by whitespace:
+ *
+ *   <input csv> <output file> <columns, e.g. 0-15 or 0,2,5-7> <k>
+ *
+ * Every thread of the parallel-module is a worker that takes the next job, parses its input like a normal run parses
+ * stdin, clusters it and writes the labels, one per line like a normal run. The inputs of later jobs are read ahead
+ * into the page cache meanwhile, and each worker keeps its buffers and workspace between jobs. A job that fails (e.g. a missing input, or fewer rows than kernels) is reported
+ * in the summary, and does not stop the others.
+ *
+ * @param path The manifest.
+ * @param settings See manifest_settings.
+ *
+ * @return The amount of jobs that failed.
+ */
+size_t manifest_run(const char* path, const manifest_settings* settings);
+
+#endif
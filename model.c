@@ -0,0 +1,212 @@
+/**
+ *
+ * This module saves kernels to versioned binary model files, and maps them back into memory for labeling.
+ *
+ * Loading is a single mmap and some validation, nothing is parsed or copied apart from the column list,
+ * so labeling new rows with a saved model costs the same as a single assignment step.
+ *
+ */
+
+#include "model.h"
+#include "reduce.h"
+#include "util.h"
+#include "fail.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MODEL_HEADER_SIZE 32
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t metric;
+    uint64_t k;
+    uint64_t m;
+} model_header;
+
+static void write_or_fail(const void* data, size_t size, FILE* file, const char* path) {
+    if (size > 0 && fwrite(data, size, 1, file) != 1) {
+        failwithf("Could not write the model to '%s'!\n", path);
+    }
+}
+
+void model_save(const char* path, metric_t metric, size_t k, size_t m, const size_t* columns,
+        const double* column_weights, double** kernels) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        failwithf("Could not open '%s' to write the model!\n", path);
+    }
+    size_t i;
+    model_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.metric = (uint32_t) metric;
+    header.k = k;
+    header.m = m;
+    write_or_fail(&header, sizeof(header), file, path);
+    for (i = 0; i < m; i++) {
+        uint64_t column = columns[i];
+        write_or_fail(&column, sizeof(column), file, path);
+    }
+    for (i = 0; i < m; i++) {
+        double weight = (column_weights != NULL) ? column_weights[i] : 1.0;
+        write_or_fail(&weight, sizeof(weight), file, path);
+    }
+    for (i = 0; i < k; i++) {
+        write_or_fail(kernels[i], sizeof(double) * m, file, path);
+    }
+    if (fclose(file) != 0) {
+        failwithf("Could not finish writing the model to '%s'!\n", path);
+    }
+}
+
+cluster_model* model_load(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        failwithf("Could not open the model '%s'!\n", path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < MODEL_HEADER_SIZE) {
+        failwithf("'%s' is too small to be a model!\n", path);
+    }
+    size_t size = (size_t) info.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        failwithf("Could not map the model '%s' into memory!\n", path);
+    }
+
+    model_header header;
+    memcpy(&header, mapping, sizeof(header));
+    if (memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0) {
+        failwithf("'%s' is not a model file!\n", path);
+    }
+    if (header.version != MODEL_VERSION) {
+        failwithf("The model '%s' has version %u, but only version %d can be read!\n", path, header.version, MODEL_VERSION);
+    }
+    if (header.metric > METRIC_WEIGHTED) {
+        failwithf("The model '%s' uses an unknown metric (%u)!\n", path, header.metric);
+    }
+    // Both bounds are checked before the expected size is computed, so it cannot overflow.
+    size_t available = (size - MODEL_HEADER_SIZE) / sizeof(double);
+    if (header.k == 0 || header.m == 0 || header.m > available / 2 || header.k > available / header.m - 2
+            || size != MODEL_HEADER_SIZE + sizeof(double) * (2 + header.k) * header.m) {
+        failwithf("The model '%s' is truncated or has trailing data!\n", path);
+    }
+
+    size_t i;
+    cluster_model* model = malloc(sizeof(cluster_model));
+    model->metric = (metric_t) header.metric;
+    model->k = header.k;
+    model->m = header.m;
+    model->mapping = mapping;
+    model->mapping_size = size;
+    const uint64_t* columns = (const uint64_t*) ((char*) mapping + MODEL_HEADER_SIZE);
+    model->columns = malloc(sizeof(size_t) * model->m);
+    for (i = 0; i < model->m; i++) {
+        model->columns[i] = (size_t) columns[i];
+    }
+    model->column_weights = (double*) (columns + model->m);
+    model->kernels = malloc(sizeof(double*) * model->k);
+    for (i = 0; i < model->k; i++) {
+        model->kernels[i] = model->column_weights + (1 + i) * model->m;
+    }
+    return model;
+}
+
+double** model_read_kernels(const char* path, size_t m, const size_t* columns, const char* separator,
+        char decimal_point, size_t* k) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        failwithf("Could not open the kernels '%s'!\n", path);
+    }
+    char magic[sizeof(MODEL_MAGIC)];
+    size_t ki, vi;
+    if (fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) == 0) {
+        fclose(file);
+        cluster_model* model = model_load(path);
+        if (model->m != m || memcmp(model->columns, columns, sizeof(size_t) * m) != 0) {
+            failwithf("The model '%s' was saved with other columns than the selected ones!\n", path);
+        }
+        double** kernels = allocate_rows(model->k, m);
+        for (ki = 0; ki < model->k; ki++) {
+            memcpy(kernels[ki], model->kernels[ki], sizeof(double) * m);
+        }
+        *k = model->k;
+        model_free(model);
+        return kernels;
+    }
+
+    rewind(file);
+    size_t separator_length = strlen(separator);
+    size_t capacity = 16;
+    double** kernels = malloc(sizeof(double*) * capacity);
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t length;
+    size_t line_number = 0;
+    ki = 0;
+    while ((length = getline(&line, &line_cap, file)) != -1) {
+        line_number += 1;
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (decimal_point != '.') {
+            char_replace(line, decimal_point, '.');
+        }
+        if (ki == capacity) {
+            capacity *= 2;
+            kernels = realloc(kernels, sizeof(double*) * capacity);
+            if (kernels == NULL) {
+                failwith("Growing the initial kernels with realloc caused an error!\n");
+            }
+        }
+        kernels[ki] = malloc(sizeof(double) * m);
+        char* position = line;
+        for (vi = 0; vi < m; vi++) {
+            char* end;
+            kernels[ki][vi] = strtod(position, &end);
+            if (end == position) {
+                failwithf("Line %zu of '%s' has fewer than the %zu values of the selected columns!\n", line_number, path, m);
+            }
+            position = end;
+            if (vi + 1 < m) {
+                if (strncmp(position, separator, separator_length) != 0) {
+                    failwithf("Line %zu of '%s' has fewer than the %zu values of the selected columns!\n", line_number, path, m);
+                }
+                position += separator_length;
+            }
+        }
+        while (*position == ' ' || *position == '\t') {
+            position++;
+        }
+        if (*position != '\0') {
+            failwithf("Line %zu of '%s' has more than the %zu values of the selected columns!\n", line_number, path, m);
+        }
+        ki += 1;
+    }
+    free(line);
+    fclose(file);
+    if (ki == 0) {
+        failwithf("'%s' does not hold any kernels!\n", path);
+    }
+    *k = ki;
+    return kernels;
+}
+
+void model_free(cluster_model* model) {
+    if (model->mapping != NULL) {
+        munmap(model->mapping, model->mapping_size);
+    }
+    free(model->columns);
+    free(model->kernels);
+    free(model);
+}
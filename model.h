@@ -0,0 +1,73 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "k_means.h"
+
+// The first 8 bytes of every model file.
+#define MODEL_MAGIC "CMEANSM"
+#define MODEL_VERSION 1
+
+/**
+ * @brief A clustering saved to (or loaded from) a model file: the kernels and how rows are compared to them.
+ *
+ * The file is laid out in native byte order as:
+ *   char magic[8], uint32 version, uint32 metric, uint64 k, uint64 m,
+ *   uint64 columns[m], double column_weights[m], double kernels[k][m]
+ * so every array is 8-byte aligned, and a loaded model points straight into the mapped file.
+ */
+typedef struct {
+    metric_t metric;
+    size_t k;
+    size_t m;
+    size_t* columns;         // The input columns the kernels were found on, in order.
+    double* column_weights;  // One weight per column, used by METRIC_WEIGHTED and 1 otherwise.
+    double** kernels;        // k kernels of m values.
+    void* mapping;           // The mapped file, NULL when the model was not loaded from a file.
+    size_t mapping_size;
+} cluster_model;
+
+/**
+ * @brief Write kernels to a model file.
+ *
+ * @param path Where to write the model.
+ * @param metric The metric the kernels were found with.
+ * @param k The amount of kernels.
+ * @param m The amount of columns.
+ * @param columns The input column of each of the m values.
+ * @param column_weights The weight of each column, NULL when the metric does not weigh columns.
+ * @param kernels The k kernels.
+ */
+void model_save(const char* path, metric_t metric, size_t k, size_t m, const size_t* columns,
+        const double* column_weights, double** kernels);
+
+/**
+ * @brief Map a model file into memory, failing when it is not a valid model.
+ */
+cluster_model* model_load(const char* path);
+
+/**
+ * @brief Read kernels to start from, either from a model file or from a csv file with one kernel per line.
+ *
+ * The format is recognized by the magic bytes of model files. The kernels must have one value per selected column,
+ * and the columns of a model file must be the selected ones.
+ *
+ * @param path The file to read.
+ * @param m The amount of selected columns.
+ * @param columns The selected columns.
+ * @param separator The field separator of a csv file.
+ * @param decimal_point The decimal point character of a csv file.
+ * @param k Set to the amount of kernels read.
+ *
+ * @return The kernels, free them with free_rows.
+ */
+double** model_read_kernels(const char* path, size_t m, const size_t* columns, const char* separator,
+        char decimal_point, size_t* k);
+
+/**
+ * @brief Unmap and free a model.
+ */
+void model_free(cluster_model* model);
+
+#endif
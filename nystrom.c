@@ -0,0 +1,136 @@
+/**
+ *
+ * This module maps rows to Nyström features, so that kernel k-means can run on the regular k-means machinery.
+ *
+ * Kernel k-means clusters in the (possibly infinite) feature space of a kernel function,
+ * which normally needs the full n by n kernel matrix. With s landmark rows, the kernel matrix is approximated
+ * by K_ns K_ss^-1 K_sn, and that is exactly the inner product of the features K_ss^-1/2 k_s(x).
+ *
+ */
+
+#include "nystrom.h"
+#include "reduce.h"
+#include "linalg.h"
+#include "parallel.h"
+#include "rng.h"
+#include "fail.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+// Eigenvalues this much smaller than the largest one are numerical noise, their directions are dropped.
+#define NYSTROM_RCOND 1e-10
+
+static double kernel_function(const nystrom_params* params, double* p, double* q, size_t m) {
+    size_t i;
+    double sum = 0.0;
+    if (params->function == NYSTROM_RBF) {
+        for (i = 0; i < m; i++) {
+            sum += (p[i] - q[i]) * (p[i] - q[i]);
+        }
+        return exp(-params->gamma * sum);
+    }
+    for (i = 0; i < m; i++) {
+        sum += p[i] * q[i];
+    }
+    return pow(params->gamma * sum + params->coef0, params->degree);
+}
+
+typedef struct {
+    double** data_rows;
+    double** features;
+    size_t m;
+    size_t landmarks;
+    size_t r;
+    size_t* landmark_rows;
+    double* map;  // landmarks by r.
+    nystrom_params params;
+} nystrom_context;
+
+static void nystrom_chunk(size_t from, size_t to, size_t worker, void* context) {
+    nystrom_context* ny = context;
+    double* similarities = malloc(sizeof(double) * ny->landmarks);
+    size_t ri, li, j;
+    for (ri = from; ri < to; ri++) {
+        double* row = ny->data_rows[ri];
+        for (li = 0; li < ny->landmarks; li++) {
+            similarities[li] = kernel_function(&ny->params, row, ny->data_rows[ny->landmark_rows[li]], ny->m);
+        }
+        double* out = ny->features[ri];
+        memset(out, 0, sizeof(double) * ny->r);
+        for (li = 0; li < ny->landmarks; li++) {
+            for (j = 0; j < ny->r; j++) {
+                out[j] += similarities[li] * ny->map[li * ny->r + j];
+            }
+        }
+    }
+    free(similarities);
+}
+
+double** nystrom_features(double** data_rows, size_t n, size_t m, size_t landmarks, nystrom_params params, size_t* features) {
+    if (landmarks == 0 || landmarks > n) {
+        failwithf("Cannot pick %zu landmarks out of %zu rows!\n", landmarks, n);
+    }
+    if (params.gamma == 0.0) {
+        params.gamma = 1.0 / (double) m;
+    }
+    size_t i, j, li;
+    uint64_t rng = rng_seed((uint64_t) time(NULL));
+
+    // Pick distinct landmark rows with a partial Fisher-Yates shuffle.
+    size_t* order = malloc(sizeof(size_t) * n);
+    for (i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    for (i = 0; i < landmarks; i++) {
+        size_t pick = i + rng_index(&rng, n - i);
+        size_t swap = order[i];
+        order[i] = order[pick];
+        order[pick] = swap;
+    }
+
+    double* kernel_matrix = malloc(sizeof(double) * landmarks * landmarks);
+    for (i = 0; i < landmarks; i++) {
+        for (j = 0; j <= i; j++) {
+            double similarity = kernel_function(&params, data_rows[order[i]], data_rows[order[j]], m);
+            kernel_matrix[i * landmarks + j] = similarity;
+            kernel_matrix[j * landmarks + i] = similarity;
+        }
+    }
+    double* values = malloc(sizeof(double) * landmarks);
+    double* vectors = malloc(sizeof(double) * landmarks * landmarks);
+    symmetric_eigen(kernel_matrix, landmarks, values, vectors);
+
+    // The eigenvalues are sorted, so the usable directions are the leading ones.
+    size_t r = 0;
+    while (r < landmarks && values[r] > NYSTROM_RCOND * values[0]) {
+        r += 1;
+    }
+    if (r == 0) {
+        failwith("The landmark rows are all alike under the kernel function, try another gamma!\n");
+    }
+
+    nystrom_context ny;
+    ny.data_rows = data_rows;
+    ny.m = m;
+    ny.landmarks = landmarks;
+    ny.r = r;
+    ny.landmark_rows = order;
+    ny.params = params;
+    ny.map = malloc(sizeof(double) * landmarks * r);
+    for (li = 0; li < landmarks; li++) {
+        for (j = 0; j < r; j++) {
+            ny.map[li * r + j] = vectors[li * landmarks + j] / sqrt(values[j]);
+        }
+    }
+    ny.features = allocate_rows(n, r);
+    parallel_for(n, nystrom_chunk, &ny);
+
+    free(order);
+    free(kernel_matrix);
+    free(values);
+    free(vectors);
+    free(ny.map);
+    *features = r;
+    return ny.features;
+}
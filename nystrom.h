@@ -0,0 +1,41 @@
+#ifndef NYSTROM_H
+#define NYSTROM_H
+
+#include <stdlib.h>
+
+/**
+ * @brief The kernel functions (similarity measures) that kernel k-means can use.
+ */
+typedef enum {
+    NYSTROM_RBF,  // exp(-gamma * |x - y|^2)
+    NYSTROM_POLY  // (gamma * x . y + coef0)^degree
+} nystrom_kernel_t;
+
+/**
+ * @brief The kernel function and its parameters.
+ */
+typedef struct {
+    nystrom_kernel_t function;
+    double gamma;  // 0 means 1 / m.
+    double degree;
+    double coef0;
+} nystrom_params;
+
+/**
+ * @brief Build the Nyström feature map of the rows, so that kernel k-means becomes regular k-means on the features.
+ *
+ * The kernel matrix of all rows is approximated through s landmark rows, picked at random.
+ * Each row is mapped to at most s features, so the memory and time needed stay linear in n.
+ *
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param landmarks The amount of landmark rows (s), at most n.
+ * @param params The kernel function to approximate.
+ * @param features Receives the amount of features of each mapped row, directions the landmarks cannot tell apart are dropped.
+ *
+ * @return A newly allocated n by features matrix, free it with free_rows from the reduce-module.
+ */
+double** nystrom_features(double** data_rows, size_t n, size_t m, size_t landmarks, nystrom_params params, size_t* features);
+
+#endif
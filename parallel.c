@@ -0,0 +1,67 @@
+/**
+ *
+ * Fork-join parallelism over index ranges, using POSIX threads.
+ *
+ */
+
+#include "parallel.h"
+#include "fail.h"
+#include <pthread.h>
+#include <unistd.h>
+
+size_t thread_count = 0;
+
+typedef struct {
+    parallel_fn fn;
+    void* context;
+    size_t from;
+    size_t to;
+    size_t worker;
+} parallel_chunk;
+
+void parallel_set_threads(size_t threads) {
+    thread_count = threads;
+}
+
+size_t parallel_threads() {
+    if (thread_count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (online > 0) ? (size_t) online : 1;
+    }
+    return thread_count;
+}
+
+static void* run_chunk(void* argument) {
+    parallel_chunk* chunk = argument;
+    chunk->fn(chunk->from, chunk->to, chunk->worker, chunk->context);
+    return NULL;
+}
+
+void parallel_for(size_t n, parallel_fn fn, void* context) {
+    size_t threads = parallel_threads();
+    size_t t;
+    if (threads == 1 || n < 2) {
+        fn(0, n, 0, context);
+        return;
+    }
+    parallel_chunk* chunks = malloc(sizeof(parallel_chunk) * threads);
+    pthread_t* handles = malloc(sizeof(pthread_t) * threads);
+    for (t = 0; t < threads; t++) {
+        chunks[t].fn = fn;
+        chunks[t].context = context;
+        chunks[t].from = (n * t) / threads;
+        chunks[t].to = (n * (t + 1)) / threads;
+        chunks[t].worker = t;
+    }
+    for (t = 1; t < threads; t++) {
+        if (pthread_create(&handles[t], NULL, run_chunk, &chunks[t]) != 0) {
+            failwithf("Could not start thread %zu of %zu!\n", t, threads);
+        }
+    }
+    run_chunk(&chunks[0]);
+    for (t = 1; t < threads; t++) {
+        pthread_join(handles[t], NULL);
+    }
+    free(chunks);
+    free(handles);
+}
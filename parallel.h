@@ -0,0 +1,33 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdlib.h>
+
+/**
+ * @brief The work of a single thread, covering the indices from .. to - 1.
+ *
+ * @param from The first index of the chunk.
+ * @param to One past the last index of the chunk.
+ * @param worker The index of the thread (0 .. parallel_threads() - 1), handy for per-thread accumulators.
+ * @param context Whatever the caller passed to parallel_for.
+ */
+typedef void (*parallel_fn)(size_t from, size_t to, size_t worker, void* context);
+
+/**
+ * @brief Set the amount of threads used by parallel_for, 0 means one per online processor.
+ */
+void parallel_set_threads(size_t threads);
+
+/**
+ * @brief The amount of threads used by parallel_for.
+ */
+size_t parallel_threads();
+
+/**
+ * @brief Split the indices 0 .. n - 1 into one contiguous chunk per thread and run fn on each chunk.
+ *
+ * Returns when every chunk is done. The calling thread works on the first chunk itself.
+ */
+void parallel_for(size_t n, parallel_fn fn, void* context);
+
+#endif
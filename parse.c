@@ -0,0 +1,114 @@
+/**
+ *
+ * The parsing of input rows and column selections, see parse.h.
+ *
+ */
+
+#include "parse.h"
+#include "util.h"
+#include <string.h>
+#include <ctype.h>
+
+bool parse_next_line(FILE* file, char** line, size_t* capacity) {
+    ssize_t length;
+    while ((length = getline(line, capacity, file)) != -1) {
+        while (length > 0 && isspace((unsigned char) (*line)[length - 1])) {
+            (*line)[--length] = '\0';
+        }
+        if (length > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief The start of a field, counting from 0, or NULL when the line has fewer fields.
+ */
+static char* find_field(char* line, const char* separator, size_t separator_length, size_t field) {
+    size_t i;
+    for (i = 0; i < field && line != NULL; i++) {
+        line = strstr(line, separator);
+        if (line != NULL) {
+            line += separator_length;
+        }
+    }
+    return line;
+}
+
+parse_status parse_row(const parse_settings* settings, char* line, double* row, double* weight, size_t* column) {
+    // Make sure that decimal-points are parseable!
+    if (settings->num_separator != '.') {
+        char_replace(line, settings->num_separator, '.');
+    }
+    size_t separator_length = strlen(settings->field_separator);
+    *weight = 1.0;
+    if (settings->use_weights) {
+        // The weight column may be anywhere in the line, so it is looked up on its own.
+        char* field = find_field(line, settings->field_separator, separator_length, settings->weight_column);
+        if (field == NULL || sscanf(field, "%lf", weight) != 1 || !(*weight >= 0.0)) {
+            *column = settings->weight_column;
+            return PARSE_BAD_WEIGHT;
+        }
+    }
+
+    // The columns are usually ascending, so the search for the next one continues from the previous one.
+    char* field = line;
+    size_t at = 0, i;
+    for (i = 0; i < settings->column_count; i++) {
+        size_t wanted = settings->columns[i];
+        if (wanted < at) {
+            field = line;
+            at = 0;
+        }
+        field = find_field(field, settings->field_separator, separator_length, wanted - at);
+        at = wanted;
+        if (field == NULL) {
+            *column = wanted;
+            return PARSE_MISSING_COLUMN;
+        }
+        if (sscanf(field, "%lf", &row[i]) != 1) {
+            *column = wanted;
+            return PARSE_BAD_VALUE;
+        }
+    }
+    return PARSE_OK;
+}
+
+/**
+ * @brief Parse an unsigned integer that starts right at the text, without the sign and space that strtoull allows.
+ */
+static bool parse_index(const char* text, const char** end, size_t* index) {
+    if (!isdigit((unsigned char) *text)) {
+        return false;
+    }
+    char* after;
+    *index = strtoull(text, &after, 10);
+    *end = after;
+    return true;
+}
+
+bool parse_columns(const char* selection, size_t** columns, size_t* count) {
+    const char* at = selection;
+    do {
+        size_t from, to;
+        if (!parse_index(at, &at, &from)) {
+            return false;
+        }
+        to = from;
+        if (*at == '-' && (!parse_index(at + 1, &at, &to) || to <= from)) {
+            return false;
+        }
+        if (*at != ',' && *at != '\0') {
+            return false;
+        }
+        *columns = realloc(*columns, sizeof(size_t) * (*count + to - from + 1));
+        if (*columns == NULL) {
+            return false;
+        }
+        for (; from <= to; from++) {
+            (*columns)[(*count)++] = from;
+        }
+    } while (*at++ == ',');
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * @brief Parsing of the input rows and of column selections, shared by a normal run (stdin) and the jobs of a manifest.
+ *
+ * Nothing in here keeps state, so any amount of threads can parse at once.
+ */
+
+/**
+ * @brief How the fields of a line are separated and which of them are read.
+ */
+typedef struct {
+    const char* field_separator; // -f
+    char num_separator;          // -n, replaced by '.' before the values are read.
+    const size_t* columns;       // The columns to read, in the order they are stored in a row.
+    size_t column_count;
+    bool use_weights;            // -w, the weight of the row is read from weight_column.
+    size_t weight_column;
+} parse_settings;
+
+typedef enum {
+    PARSE_OK,
+    PARSE_BAD_WEIGHT,     // The weight column is missing, not a number or negative.
+    PARSE_MISSING_COLUMN, // The line has fewer fields than a selected column needs.
+    PARSE_BAD_VALUE       // A selected field is not a number.
+} parse_status;
+
+/**
+ * @brief Read the next non-empty line of input whole, however long it is, without its trailing whitespace.
+ *
+ * @param file Where to read from.
+ * @param line The line, grown with getline, may start as NULL.
+ * @param capacity The size of the line, may start as 0.
+ *
+ * @return Whether there was a line.
+ */
+bool parse_next_line(FILE* file, char** line, size_t* capacity);
+
+/**
+ * @brief Parse the selected columns of a line into a row.
+ *
+ * @param settings See parse_settings.
+ * @param line The line, its decimal separators are replaced in place.
+ * @param row Room for column_count values.
+ * @param weight Where to store the weight of the row, 1 unless use_weights is set.
+ * @param column Where to store the column that could not be parsed, when the status is not PARSE_OK.
+ *
+ * @return PARSE_OK, or what went wrong, in which case the row is incomplete.
+ */
+parse_status parse_row(const parse_settings* settings, char* line, double* row, double* weight, size_t* column);
+
+/**
+ * @brief Append the columns of a selection, a column (3), a range (0-9) or a list of both (0,2,5-7).
+ *
+ * @param selection The selection.
+ * @param columns The columns so far, grown with realloc, may start as NULL.
+ * @param count The amount of columns so far.
+ *
+ * @return Whether the selection could be parsed, a range must end after it starts.
+ */
+bool parse_columns(const char* selection, size_t** columns, size_t* count);
+
+#endif
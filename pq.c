@@ -0,0 +1,397 @@
+/**
+ *
+ * This module performs k-means clustering with product-quantized (PQ) asymmetric distances.
+ *
+ * Every row is split into sub-spaces and each sub-vector is replaced by the index of its closest codeword,
+ * so a row becomes a short string of 4-bit codes.
+ * Since the codes only take 16 different values, the distance from a kernel to every codeword of a sub-space
+ * fits in a 16 entry table, which is exactly what a SIMD byte-shuffle can look up in a single instruction.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "pq.h"
+#include "k_means.h"
+#include "fail.h"
+#include <math.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <float.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define PQ_HAS_SSSE3
+#endif
+
+// Rows are encoded in blocks of 16, one row per byte lane of a 128-bit register.
+#define PQ_BLOCK 16
+
+// Codebooks are small, so a handful of Lloyd iterations is plenty.
+#define PQ_TRAIN_ITERATIONS 25
+
+static double sqdistf64v(const double* p, const double* q, size_t m) {
+    double sum = 0.0;
+    size_t i;
+    for (i = 0; i < m; i++) {
+        sum += (p[i] - q[i]) * (p[i] - q[i]);
+    }
+    return sum;
+}
+
+/**
+ * @brief Spread m columns over the sub-spaces as evenly as possible.
+ *
+ * @param offsets Receives subspaces + 1 offsets, sub-space s covers the columns offsets[s] .. offsets[s + 1] - 1.
+ */
+static void split_subspaces(size_t m, size_t subspaces, size_t* offsets) {
+    size_t s;
+    size_t width = m / subspaces;
+    size_t remainder = m % subspaces;
+    offsets[0] = 0;
+    for (s = 0; s < subspaces; s++) {
+        offsets[s + 1] = offsets[s] + width + (s < remainder ? 1 : 0);
+    }
+}
+
+/**
+ * @brief Train the codebook of a single sub-space with a few Lloyd iterations over the sub-vectors.
+ *
+ * @param codebook Receives codewords * width values.
+ */
+static void train_codebook(double** data_rows, size_t n, size_t from, size_t width, size_t codewords, double* codebook) {
+    size_t ri, ci, vi, iteration;
+    double* sums = malloc(sizeof(double) * codewords * width);
+    size_t* counts = malloc(sizeof(size_t) * codewords);
+
+    for (ci = 0; ci < codewords; ci++) {
+        size_t row = (size_t)(((double)(rand()) / ((double)(RAND_MAX) + 1.0)) * n);
+        memcpy(codebook + ci * width, data_rows[row] + from, sizeof(double) * width);
+    }
+
+    for (iteration = 0; iteration < PQ_TRAIN_ITERATIONS; iteration++) {
+        memset(sums, 0, sizeof(double) * codewords * width);
+        memset(counts, 0, sizeof(size_t) * codewords);
+        for (ri = 0; ri < n; ri++) {
+            double* sub = data_rows[ri] + from;
+            double closest_distance = INFINITY;
+            size_t closest = 0;
+            for (ci = 0; ci < codewords; ci++) {
+                double distance = sqdistf64v(sub, codebook + ci * width, width);
+                if (distance < closest_distance) {
+                    closest_distance = distance;
+                    closest = ci;
+                }
+            }
+            counts[closest] += 1;
+            for (vi = 0; vi < width; vi++) {
+                sums[closest * width + vi] += sub[vi];
+            }
+        }
+        double movement = 0.0;
+        for (ci = 0; ci < codewords; ci++) {
+            if (counts[ci] == 0) {
+                continue;
+            }
+            for (vi = 0; vi < width; vi++) {
+                double updated = sums[ci * width + vi] / (double) counts[ci];
+                movement += fabs(updated - codebook[ci * width + vi]);
+                codebook[ci * width + vi] = updated;
+            }
+        }
+        if (movement < DBL_EPSILON) {
+            break;
+        }
+    }
+    free(sums);
+    free(counts);
+}
+
+/**
+ * @brief Find the code of a sub-vector, i.e. the index of its closest codeword.
+ */
+static uint8_t encode_subvector(double* sub, double* codebook, size_t width, size_t codewords) {
+    size_t ci;
+    double closest_distance = INFINITY;
+    uint8_t closest = 0;
+    for (ci = 0; ci < codewords; ci++) {
+        double distance = sqdistf64v(sub, codebook + ci * width, width);
+        if (distance < closest_distance) {
+            closest_distance = distance;
+            closest = (uint8_t) ci;
+        }
+    }
+    return closest;
+}
+
+// The codes of a block are laid out per pair of sub-spaces as 16 bytes, one per row,
+// with the code of the even sub-space in the low nibble and the odd one in the high nibble.
+// The lookup tables of a kernel are laid out the same way: 32 bytes per pair, low table first.
+typedef void (*adc_scan_fn)(const uint8_t* codes, const uint8_t* lut, size_t pairs, uint16_t* out);
+
+static void adc_scan_scalar(const uint8_t* codes, const uint8_t* lut, size_t pairs, uint16_t* out) {
+    size_t p, lane;
+    for (lane = 0; lane < PQ_BLOCK; lane++) {
+        out[lane] = 0;
+    }
+    for (p = 0; p < pairs; p++) {
+        const uint8_t* c = codes + p * PQ_BLOCK;
+        const uint8_t* t = lut + p * 2 * PQ_CODEWORDS;
+        for (lane = 0; lane < PQ_BLOCK; lane++) {
+            out[lane] += t[c[lane] & 0x0f] + t[PQ_CODEWORDS + (c[lane] >> 4)];
+        }
+    }
+}
+
+#ifdef PQ_HAS_SSSE3
+__attribute__((target("ssse3")))
+static void adc_scan_ssse3(const uint8_t* codes, const uint8_t* lut, size_t pairs, uint16_t* out) {
+    const __m128i low_mask = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc_low = zero;
+    __m128i acc_high = zero;
+    size_t p;
+    for (p = 0; p < pairs; p++) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(codes + p * PQ_BLOCK));
+        __m128i even_table = _mm_loadu_si128((const __m128i*)(lut + p * 2 * PQ_CODEWORDS));
+        __m128i odd_table = _mm_loadu_si128((const __m128i*)(lut + p * 2 * PQ_CODEWORDS + PQ_CODEWORDS));
+        __m128i even = _mm_shuffle_epi8(even_table, _mm_and_si128(c, low_mask));
+        __m128i odd = _mm_shuffle_epi8(odd_table, _mm_and_si128(_mm_srli_epi16(c, 4), low_mask));
+        // Widen to 16 bits before summing, a byte would overflow after two sub-spaces.
+        acc_low = _mm_add_epi16(acc_low, _mm_unpacklo_epi8(even, zero));
+        acc_low = _mm_add_epi16(acc_low, _mm_unpacklo_epi8(odd, zero));
+        acc_high = _mm_add_epi16(acc_high, _mm_unpackhi_epi8(even, zero));
+        acc_high = _mm_add_epi16(acc_high, _mm_unpackhi_epi8(odd, zero));
+    }
+    _mm_storeu_si128((__m128i*)(out), acc_low);
+    _mm_storeu_si128((__m128i*)(out + 8), acc_high);
+}
+#endif
+
+static adc_scan_fn pick_adc_scan() {
+#ifdef PQ_HAS_SSSE3
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        return adc_scan_ssse3;
+    }
+#endif
+    return adc_scan_scalar;
+}
+
+/**
+ * @brief Build the quantized lookup tables of all kernels.
+ *
+ * All tables share a single scale (delta), so that the summed 8-bit entries can be compared between kernels.
+ * The smallest entry of every table is subtracted first and kept in the bias of the kernel instead.
+ * The approximate squared distance from a row to kernel ki is then bias[ki] + delta * (sum of entries).
+ */
+static double build_luts(double** kernels, size_t k, double** codebooks, size_t* offsets, size_t subspaces,
+        size_t codewords, size_t pairs, uint8_t* luts, double* bias) {
+    size_t ki, s, ci;
+    double table[PQ_CODEWORDS];
+    double widest = 0.0;
+
+    // First pass, find the widest table so that every entry fits in a byte.
+    for (ki = 0; ki < k; ki++) {
+        for (s = 0; s < subspaces; s++) {
+            size_t width = offsets[s + 1] - offsets[s];
+            double lowest = INFINITY;
+            double highest = 0.0;
+            for (ci = 0; ci < codewords; ci++) {
+                double d = sqdistf64v(kernels[ki] + offsets[s], codebooks[s] + ci * width, width);
+                lowest = (d < lowest) ? d : lowest;
+                highest = (d > highest) ? d : highest;
+            }
+            if (highest - lowest > widest) {
+                widest = highest - lowest;
+            }
+        }
+    }
+    double delta = (widest > 0.0) ? widest / 255.0 : 1.0;
+
+    memset(luts, 0, sizeof(uint8_t) * k * pairs * 2 * PQ_CODEWORDS);
+    for (ki = 0; ki < k; ki++) {
+        uint8_t* lut = luts + ki * pairs * 2 * PQ_CODEWORDS;
+        bias[ki] = 0.0;
+        for (s = 0; s < subspaces; s++) {
+            size_t width = offsets[s + 1] - offsets[s];
+            double lowest = INFINITY;
+            for (ci = 0; ci < codewords; ci++) {
+                table[ci] = sqdistf64v(kernels[ki] + offsets[s], codebooks[s] + ci * width, width);
+                lowest = (table[ci] < lowest) ? table[ci] : lowest;
+            }
+            bias[ki] += lowest;
+            for (ci = 0; ci < codewords; ci++) {
+                double q = floor((table[ci] - lowest) / delta + 0.5);
+                lut[s * PQ_CODEWORDS + ci] = (uint8_t)((q > 255.0) ? 255.0 : q);
+            }
+        }
+    }
+    return delta;
+}
+
+size_t* pq_k_means(const size_t k, double** data_rows, size_t n, size_t m, bool generate_kernels, size_t subspaces, size_t shortlist) {
+    if (subspaces == 0) {
+        subspaces = (m + 3) / 4;
+        subspaces = (subspaces > PQ_MAX_SUBSPACES) ? PQ_MAX_SUBSPACES : subspaces;
+    }
+    if (subspaces > m || subspaces > PQ_MAX_SUBSPACES) {
+        failwithf("Cannot split %zu columns into %zu sub-spaces, use at most %zu!\n",
+                m, subspaces, (m < PQ_MAX_SUBSPACES) ? m : (size_t) PQ_MAX_SUBSPACES);
+    }
+    if (shortlist == 0) {
+        failwith("The short-list must hold at least a single kernel!\n");
+    }
+    if (n < k) {
+        failwithf("Cannot find %zu kernels in %zu rows!\n", k, n);
+    }
+    shortlist = (shortlist > k) ? k : shortlist;
+
+    srand(time(NULL));
+    adc_scan_fn adc_scan = pick_adc_scan();
+
+    size_t s, ri, ki, vi, li, lane;
+    size_t codewords = (n < PQ_CODEWORDS) ? n : PQ_CODEWORDS;
+    size_t pairs = (subspaces + 1) / 2;
+    size_t blocks = (n + PQ_BLOCK - 1) / PQ_BLOCK;
+
+    // Train a codebook for every sub-space and encode all rows, this only happens once.
+    size_t* offsets = malloc(sizeof(size_t) * (subspaces + 1));
+    split_subspaces(m, subspaces, offsets);
+    double** codebooks = malloc(sizeof(double*) * subspaces);
+    for (s = 0; s < subspaces; s++) {
+        size_t width = offsets[s + 1] - offsets[s];
+        codebooks[s] = malloc(sizeof(double) * codewords * width);
+        train_codebook(data_rows, n, offsets[s], width, codewords, codebooks[s]);
+    }
+    uint8_t* codes = calloc(blocks * pairs * PQ_BLOCK, sizeof(uint8_t));
+    for (ri = 0; ri < n; ri++) {
+        uint8_t* block = codes + (ri / PQ_BLOCK) * pairs * PQ_BLOCK;
+        for (s = 0; s < subspaces; s++) {
+            size_t width = offsets[s + 1] - offsets[s];
+            uint8_t code = encode_subvector(data_rows[ri] + offsets[s], codebooks[s], width, codewords);
+            block[(s / 2) * PQ_BLOCK + ri % PQ_BLOCK] |= (s % 2 == 0) ? code : (uint8_t)(code << 4);
+        }
+    }
+
+    double** kernels = (generate_kernels) ? generate_mean_kernels(data_rows, n, m, k, NULL) : pick_random_kernels(data_rows, n, m, k, NULL);
+    size_t* kernel_followers = malloc(sizeof(size_t) * n);
+    size_t* kernel_follower_count = malloc(sizeof(size_t) * k);
+    double** kernel_follower_sum = malloc(sizeof(double*) * k);
+    double** prev_means = malloc(sizeof(double*) * k);
+    for (ki = 0; ki < k; ki++) {
+        prev_means[ki] = malloc(sizeof(double) * m);
+        kernel_follower_sum[ki] = malloc(sizeof(double) * m);
+    }
+    uint8_t* luts = malloc(sizeof(uint8_t) * k * pairs * 2 * PQ_CODEWORDS);
+    double* bias = malloc(sizeof(double) * k);
+    uint16_t sums[PQ_BLOCK];
+    double* candidate_distance = malloc(sizeof(double) * PQ_BLOCK * shortlist);
+    size_t* candidate_kernel = malloc(sizeof(size_t) * PQ_BLOCK * shortlist);
+
+    double movement = INFINITY;
+    size_t iterations = 0;
+    while (movement >= DBL_EPSILON && iterations < 2500) {
+        iterations += 1;
+        for (ki = 0; ki < k; ki++) {
+            memcpy(prev_means[ki], kernels[ki], sizeof(double) * m);
+            kernel_follower_count[ki] = 0;
+            memset(kernel_follower_sum[ki], 0, sizeof(double) * m);
+        }
+        double delta = build_luts(kernels, k, codebooks, offsets, subspaces, codewords, pairs, luts, bias);
+
+        size_t b;
+        for (b = 0; b < blocks; b++) {
+            const uint8_t* block = codes + b * pairs * PQ_BLOCK;
+            for (li = 0; li < PQ_BLOCK * shortlist; li++) {
+                candidate_distance[li] = INFINITY;
+                candidate_kernel[li] = 0;
+            }
+            // Rank the kernels for all 16 rows of the block at once, keeping the best few of each row.
+            for (ki = 0; ki < k; ki++) {
+                adc_scan(block, luts + ki * pairs * 2 * PQ_CODEWORDS, pairs, sums);
+                for (lane = 0; lane < PQ_BLOCK; lane++) {
+                    double approximate = bias[ki] + delta * (double) sums[lane];
+                    double* best = candidate_distance + lane * shortlist;
+                    size_t* best_kernel = candidate_kernel + lane * shortlist;
+                    if (approximate >= best[shortlist - 1]) {
+                        continue;
+                    }
+                    li = shortlist - 1;
+                    while (li > 0 && best[li - 1] > approximate) {
+                        best[li] = best[li - 1];
+                        best_kernel[li] = best_kernel[li - 1];
+                        li -= 1;
+                    }
+                    best[li] = approximate;
+                    best_kernel[li] = ki;
+                }
+            }
+            // Then settle each row with exact distances to its short-list.
+            for (lane = 0; lane < PQ_BLOCK; lane++) {
+                ri = b * PQ_BLOCK + lane;
+                if (ri >= n) {
+                    break;
+                }
+                double* row = data_rows[ri];
+                double closest_distance = INFINITY;
+                size_t closest_kernel = 0;
+                for (li = 0; li < shortlist; li++) {
+                    size_t candidate = candidate_kernel[lane * shortlist + li];
+                    double distance = distf64v(row, kernels[candidate], m);
+                    if (distance < closest_distance) {
+                        closest_distance = distance;
+                        closest_kernel = candidate;
+                    }
+                }
+                kernel_followers[ri] = closest_kernel;
+                kernel_follower_count[closest_kernel] += 1;
+                for (vi = 0; vi < m; vi++) {
+                    kernel_follower_sum[closest_kernel][vi] += row[vi];
+                }
+            }
+        }
+
+        // Update kernels to their new means.
+        for (ki = 0; ki < k; ki++) {
+            if (kernel_follower_count[ki] == 0) {
+                continue;
+            }
+            for (vi = 0; vi < m; vi++) {
+                kernels[ki][vi] = kernel_follower_sum[ki][vi] / ((double) kernel_follower_count[ki]);
+            }
+        }
+        movement = 0.0;
+        for (ki = 0; ki < k; ki++) {
+            movement += distf64v(prev_means[ki], kernels[ki], m);
+        }
+        if (movement != movement) {
+            failwithf("Movement was nan after %zu iterations\n", iterations);
+        }
+    }
+
+    // Free memory that we're not using any longer.
+    for (ki = 0; ki < k; ki++) {
+        free(prev_means[ki]);
+        free(kernels[ki]);
+        free(kernel_follower_sum[ki]);
+    }
+    for (s = 0; s < subspaces; s++) {
+        free(codebooks[s]);
+    }
+    free(prev_means);
+    free(kernels);
+    free(kernel_follower_count);
+    free(kernel_follower_sum);
+    free(codebooks);
+    free(offsets);
+    free(codes);
+    free(luts);
+    free(bias);
+    free(candidate_distance);
+    free(candidate_kernel);
+
+    return kernel_followers;
+}
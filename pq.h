@@ -0,0 +1,35 @@
+#ifndef PQ_H
+#define PQ_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief The amount of codewords in each sub-space codebook, codes are 4 bits wide.
+ */
+#define PQ_CODEWORDS 16
+
+/**
+ * @brief The largest amount of sub-spaces supported, this keeps the 16-bit lookup sums from overflowing.
+ */
+#define PQ_MAX_SUBSPACES 256
+
+/**
+ * @brief Run K-means clustering using product-quantized asymmetric distances for the assignment step.
+ *
+ * The columns are split into sub-spaces and every row is encoded once as a 4-bit code per sub-space.
+ * Each iteration then builds small lookup tables from the kernels and ranks the kernels for each row
+ * using table lookups, only the closest few (the short-list) are compared using exact distances.
+ *
+ * @param k The amount of clusters to generate.
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param generate_kernels Whether kernels should be generated or selected randomly from the data.
+ * @param subspaces The amount of sub-spaces to split the columns into, 0 picks one sub-space per 4 columns.
+ * @param shortlist The amount of candidate kernels that are compared exactly for each row.
+ */
+size_t* pq_k_means(size_t k, double** data_rows, size_t n, size_t m, bool generate_kernels, size_t subspaces, size_t shortlist);
+
+#endif
@@ -0,0 +1,305 @@
+/**
+ *
+ * This module runs Lloyd's algorithm in forked worker processes, which share one anonymous memory segment:
+ *
+ *   control   the barrier, the iteration, the movement and whether to stop,
+ *   kernels   k by m, written by the first worker between the two barriers of an iteration,
+ *   partials  per worker, k counts and k by m sums of its shard, each on its own cache lines,
+ *   labels    n, every worker writes those of its shard,
+ *   values    n by m, the rows, read by every worker.
+ *
+ * The barrier is a generation counter that waiting processes sleep on with FUTEX_WAIT,
+ * it is not process-private, since the workers are separate processes.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "procs.h"
+#include "fail.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <float.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define PROCS_CACHE_LINE 64
+
+// Values of control.stop.
+#define PROCS_GO_ON 0
+#define PROCS_CONVERGED 1
+#define PROCS_STOPPED 2 // Stopped by on_iteration, the rows are assigned once more to match the kernels.
+#define PROCS_FAILED 3  // The kernels moved by nan.
+
+typedef struct {
+    uint32_t arrived;
+    uint32_t generation;
+    uint32_t stop;
+    uint32_t reserved;
+    uint64_t iterations;
+    double movement;
+} procs_control;
+
+// Where everything is in the shared segment.
+typedef struct {
+    void* base;
+    size_t size;
+    procs_control* control;
+    double* kernels;
+    double* partials;
+    size_t partial_stride; // doubles per worker, k counts and then k * m sums.
+    size_t* labels;
+    double* values;
+} segment;
+
+static size_t round_up(size_t bytes) {
+    return (bytes + PROCS_CACHE_LINE - 1) & ~((size_t) PROCS_CACHE_LINE - 1);
+}
+
+static void futex_wait(uint32_t* address, uint32_t expected) {
+    syscall(SYS_futex, address, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t* address) {
+    syscall(SYS_futex, address, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief Wait until all parties arrived, the last one to arrive wakes the others.
+ */
+static void barrier_wait(procs_control* control, uint32_t parties) {
+    uint32_t generation = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&control->arrived, 1, __ATOMIC_ACQ_REL) == parties) {
+        __atomic_store_n(&control->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&control->generation, 1, __ATOMIC_RELEASE);
+        futex_wake(&control->generation);
+        return;
+    }
+    while (__atomic_load_n(&control->generation, __ATOMIC_ACQUIRE) == generation) {
+        // Returns at once when the generation moved on before sleeping.
+        futex_wait(&control->generation, generation);
+    }
+}
+
+/**
+ * @brief Sum the rows of a shard per kernel, into the partials of the worker.
+ */
+static void sum_shard(const segment* s, const k_means_options* options, double** rows, size_t from, size_t to, size_t m,
+        const double* inverse_norms, double* partial) {
+    const size_t k = options->k;
+    double* counts = partial;
+    double* sums = partial + k;
+    size_t ri, vi;
+    memset(partial, 0, sizeof(double) * k * (m + 1));
+    for (ri = from; ri < to; ri++) {
+        size_t kernel = s->labels[ri];
+        double weight = (options->row_weights != NULL) ? options->row_weights[ri] : 1.0;
+        double scale = (inverse_norms != NULL) ? weight * inverse_norms[ri - from] : weight;
+        counts[kernel] += weight;
+        for (vi = 0; vi < m; vi++) {
+            sums[kernel * m + vi] += scale * rows[ri - from][vi];
+        }
+    }
+}
+
+/**
+ * @brief Reduce the partials of every worker into new kernels, and decide whether to go on. Only the first worker does this.
+ */
+static void reduce_partials(const segment* s, const k_means_options* options, size_t m, size_t processes) {
+    const size_t k = options->k;
+    procs_control* control = s->control;
+    // The partials of the first worker collect those of the others.
+    double* total = s->partials;
+    size_t p, i, ki, vi;
+    for (p = 1; p < processes; p++) {
+        const double* partial = s->partials + p * s->partial_stride;
+        for (i = 0; i < k * (m + 1); i++) {
+            total[i] += partial[i];
+        }
+    }
+    double movement = 0.0;
+    for (ki = 0; ki < k; ki++) {
+        double* kernel = s->kernels + ki * m;
+        if (total[ki] <= 0.0) {
+            continue;
+        }
+        double norm = 0.0;
+        for (vi = 0; vi < m; vi++) {
+            double mean = total[k + ki * m + vi] / total[ki];
+            total[k + ki * m + vi] = mean;
+            norm += mean * mean;
+        }
+        // Spherical kernels are kept at unit length.
+        double scale = (options->metric == METRIC_COSINE && norm > 0.0) ? 1.0 / sqrt(norm) : 1.0;
+        double distance = 0.0;
+        for (vi = 0; vi < m; vi++) {
+            double moved = total[k + ki * m + vi] * scale;
+            distance += (moved - kernel[vi]) * (moved - kernel[vi]);
+            kernel[vi] = moved;
+        }
+        movement += sqrt(distance);
+    }
+    control->iterations += 1;
+    control->movement = movement;
+    if (movement != movement) {
+        control->stop = PROCS_FAILED;
+    } else if (movement < DBL_EPSILON || control->iterations >= K_MEANS_MAX_ITERATIONS) {
+        control->stop = PROCS_CONVERGED;
+    } else if (options->on_iteration != NULL) {
+        double* kernel_rows[k];
+        for (ki = 0; ki < k; ki++) {
+            kernel_rows[ki] = s->kernels + ki * m;
+        }
+        if (!options->on_iteration(control->iterations, movement, kernel_rows, k, m, options->iteration_context)) {
+            control->stop = PROCS_STOPPED;
+        }
+    }
+}
+
+/**
+ * @brief The life of a worker process, which never returns.
+ */
+static void work(const segment* s, const k_means_options* options, size_t n, size_t m, size_t processes, size_t worker) {
+    const size_t k = options->k;
+    size_t from = n * worker / processes;
+    size_t to = n * (worker + 1) / processes;
+    size_t ri, vi, ki;
+    // Private row and kernel pointers into the shared segment, for the assignment of the k_means-module.
+    double** rows = malloc(sizeof(double*) * (to - from + 1));
+    for (ri = from; ri < to; ri++) {
+        rows[ri - from] = s->values + ri * m;
+    }
+    double* kernel_rows[k];
+    for (ki = 0; ki < k; ki++) {
+        kernel_rows[ki] = s->kernels + ki * m;
+    }
+    double* inverse_norms = NULL;
+    if (options->metric == METRIC_COSINE) {
+        inverse_norms = malloc(sizeof(double) * (to - from + 1));
+        for (ri = from; ri < to; ri++) {
+            double norm = 0.0;
+            for (vi = 0; vi < m; vi++) {
+                norm += rows[ri - from][vi] * rows[ri - from][vi];
+            }
+            inverse_norms[ri - from] = (norm > 0.0) ? 1.0 / sqrt(norm) : 0.0;
+        }
+    }
+    double* partial = s->partials + worker * s->partial_stride;
+    while (true) {
+        k_means_assign(options, rows, to - from, m, kernel_rows, s->labels + from);
+        sum_shard(s, options, rows, from, to, m, inverse_norms, partial);
+        barrier_wait(s->control, processes);
+        if (worker == 0) {
+            reduce_partials(s, options, m, processes);
+        }
+        barrier_wait(s->control, processes);
+        uint32_t stop = s->control->stop;
+        if (stop == PROCS_STOPPED) {
+            k_means_assign(options, rows, to - from, m, kernel_rows, s->labels + from);
+        }
+        if (stop != PROCS_GO_ON) {
+            break;
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+size_t* procs_k_means(const k_means_options* options, double** data_rows, size_t n, size_t m, size_t processes) {
+    const size_t k = options->k;
+    size_t ri, ki, p;
+    if (options->metric == METRIC_MANHATTAN) {
+        failwith("The medians of the manhattan metric cannot be found by worker processes (--procs)!\n");
+    }
+    if (processes > n) {
+        processes = n;
+    }
+    size_t* labels = malloc(sizeof(size_t) * n);
+
+    // Seed exactly like a run in this process would.
+    kmeans_ctx ctx;
+    kmeans_status status = kmeans_ctx_init(&ctx, options, data_rows, n, m, labels, NULL, 0);
+    if (status != KMEANS_OK) {
+        failwithf("Could not cluster %zu rows into %zu kernels: %s!\n", n, k, kmeans_status_message(status));
+    }
+
+    segment s;
+    s.partial_stride = round_up(sizeof(double) * k * (m + 1)) / sizeof(double);
+    size_t control_offset = 0;
+    size_t kernels_offset = round_up(sizeof(procs_control));
+    size_t partials_offset = kernels_offset + round_up(sizeof(double) * k * m);
+    size_t labels_offset = partials_offset + sizeof(double) * s.partial_stride * processes;
+    size_t values_offset = labels_offset + round_up(sizeof(size_t) * n);
+    s.size = values_offset + sizeof(double) * n * m;
+    s.base = mmap(NULL, s.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s.base == MAP_FAILED) {
+        failwithf("Could not map %zu bytes of shared memory for the worker processes!\n", s.size);
+    }
+    s.control = (procs_control*) ((char*) s.base + control_offset);
+    s.kernels = (double*) ((char*) s.base + kernels_offset);
+    s.partials = (double*) ((char*) s.base + partials_offset);
+    s.labels = (size_t*) ((char*) s.base + labels_offset);
+    s.values = (double*) ((char*) s.base + values_offset);
+    for (ri = 0; ri < n; ri++) {
+        memcpy(s.values + ri * m, data_rows[ri], sizeof(double) * m);
+    }
+    for (ki = 0; ki < k; ki++) {
+        memcpy(s.kernels + ki * m, ctx.kernels[ki], sizeof(double) * m);
+    }
+    kmeans_free(&ctx);
+    s.control->iterations = options->first_iteration;
+
+    // Buffered output would be written once per process otherwise.
+    fflush(stdout);
+    fflush(stderr);
+    pid_t* workers = malloc(sizeof(pid_t) * processes);
+    for (p = 0; p < processes; p++) {
+        workers[p] = fork();
+        if (workers[p] < 0) {
+            failwith("Could not fork the worker processes!\n");
+        }
+        if (workers[p] == 0) {
+            work(&s, options, n, m, processes, p);
+        }
+    }
+    size_t running = processes;
+    while (running > 0) {
+        int outcome;
+        pid_t done = wait(&outcome);
+        if (done < 0 && errno == EINTR) {
+            // E.g. SIGINT, which the first worker handles through on_iteration.
+            continue;
+        }
+        if (done < 0) {
+            failwith("Lost track of the worker processes!\n");
+        }
+        running -= 1;
+        if (!WIFEXITED(outcome) || WEXITSTATUS(outcome) != EXIT_SUCCESS) {
+            // The others would wait at the barrier forever.
+            for (p = 0; p < processes; p++) {
+                kill(workers[p], SIGKILL);
+            }
+            failwithf("Worker process %d died, so the clustering failed!\n", (int) done);
+        }
+    }
+    free(workers);
+    if (s.control->stop == PROCS_FAILED) {
+        failwithf("Movement was nan after %llu iterations!\n", (unsigned long long) s.control->iterations);
+    }
+
+    memcpy(labels, s.labels, sizeof(size_t) * n);
+    if (options->kernels_out != NULL) {
+        for (ki = 0; ki < k; ki++) {
+            memcpy(options->kernels_out[ki], s.kernels + ki * m, sizeof(double) * m);
+        }
+    }
+    munmap(s.base, s.size);
+    return labels;
+}
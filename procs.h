@@ -0,0 +1,28 @@
+#ifndef PROCS_H
+#define PROCS_H
+
+#include <stdlib.h>
+#include "k_means.h"
+
+/**
+ * @brief Run K-means clustering (Lloyd's algorithm) in forked worker processes instead of threads (--procs).
+ *
+ * The rows are copied into a shared memory segment, and every worker process owns a contiguous shard of them.
+ * Per iteration, the workers assign their rows and write the sums and counts of their shard to the shared segment,
+ * meet at a futex barrier, and the first worker reduces them into the new kernels, which every worker then reads.
+ * A worker that dies takes the run down with an error, instead of leaving the others waiting.
+ *
+ * Every metric but manhattan is supported, since its medians cannot be reduced from sums.
+ * The on_iteration callback of the options is called in the first worker process.
+ *
+ * @param options The settings of the run, see k_means_options.
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param processes The amount of worker processes, at most n.
+ *
+ * @return The kernel (0 .. k - 1) of each row.
+ */
+size_t* procs_k_means(const k_means_options* options, double** data_rows, size_t n, size_t m, size_t processes);
+
+#endif
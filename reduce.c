@@ -0,0 +1,379 @@
+/**
+ *
+ * This module projects wide data to fewer dimensions before clustering.
+ *
+ * Distances are dominated by the amount of columns, so clustering in d instead of m dimensions
+ * makes every iteration roughly m / d times cheaper, at the cost of a single projection pass.
+ *
+ */
+
+#include "reduce.h"
+#include "k_means.h"
+#include "linalg.h"
+#include "parallel.h"
+#include "rng.h"
+#include "fail.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+// Rows are projected in small blocks, so the projection stays in cache while it is reused.
+#define REDUCE_BLOCK 32
+
+// Randomized PCA looks at a few more directions than it keeps, and refines them with a few power iterations.
+#define PCA_OVERSAMPLING 10
+#define PCA_POWER_ITERATIONS 2
+
+double** allocate_rows(size_t n, size_t m) {
+    size_t i;
+    double** rows = malloc(sizeof(double*) * n);
+    for (i = 0; i < n; i++) {
+        rows[i] = malloc(sizeof(double) * m);
+    }
+    return rows;
+}
+
+void free_rows(double** rows, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        free(rows[i]);
+    }
+    free(rows);
+}
+
+// The sparse projection is stored per output dimension as a list of (column, sign) entries.
+typedef struct {
+    double** data_rows;
+    double** projected;
+    size_t d;
+    size_t* starts;   // d + 1 offsets into columns and signs.
+    size_t* columns;
+    double* signs;
+    double scale;
+} jl_context;
+
+static void jl_project_chunk(size_t from, size_t to, size_t worker, void* context) {
+    jl_context* jl = context;
+    size_t block, ri, j, e;
+    for (block = from; block < to; block += REDUCE_BLOCK) {
+        size_t end = (block + REDUCE_BLOCK < to) ? block + REDUCE_BLOCK : to;
+        for (j = 0; j < jl->d; j++) {
+            for (ri = block; ri < end; ri++) {
+                double* row = jl->data_rows[ri];
+                double sum = 0.0;
+                for (e = jl->starts[j]; e < jl->starts[j + 1]; e++) {
+                    sum += jl->signs[e] * row[jl->columns[e]];
+                }
+                jl->projected[ri][j] = jl->scale * sum;
+            }
+        }
+    }
+}
+
+static double** reduce_jl(double** data_rows, size_t n, size_t m, size_t d, uint64_t* rng) {
+    // Very sparse random projections (Li, Hastie & Church) keep about 1 in sqrt(m) entries.
+    double sparsity = sqrt((double) m);
+    sparsity = (sparsity < 3.0) ? 3.0 : sparsity;
+
+    jl_context jl;
+    size_t capacity = 64;
+    size_t count = 0;
+    size_t j, c;
+    jl.data_rows = data_rows;
+    jl.d = d;
+    jl.starts = malloc(sizeof(size_t) * (d + 1));
+    jl.columns = malloc(sizeof(size_t) * capacity);
+    jl.signs = malloc(sizeof(double) * capacity);
+    jl.scale = sqrt(sparsity / (double) d);
+    for (j = 0; j < d; j++) {
+        jl.starts[j] = count;
+        for (c = 0; c < m; c++) {
+            double r = rng_uniform(rng) * sparsity;
+            if (r >= 1.0) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                jl.columns = realloc(jl.columns, sizeof(size_t) * capacity);
+                jl.signs = realloc(jl.signs, sizeof(double) * capacity);
+                if (jl.columns == NULL || jl.signs == NULL) {
+                    failwith("Growing the random projection with realloc caused an error!\n");
+                }
+            }
+            jl.columns[count] = c;
+            jl.signs[count] = (r < 0.5) ? -1.0 : 1.0;
+            count += 1;
+        }
+    }
+    jl.starts[d] = count;
+
+    jl.projected = allocate_rows(n, d);
+    parallel_for(n, jl_project_chunk, &jl);
+
+    free(jl.starts);
+    free(jl.columns);
+    free(jl.signs);
+    return jl.projected;
+}
+
+// Every pass of randomized PCA streams over the rows and sums a small matrix per thread.
+typedef struct {
+    double** data_rows;
+    size_t m;
+    size_t l;
+    double* mean;        // m values.
+    double* basis;       // m by l, the current approximation of the leading directions.
+    double** partials;   // One accumulator per thread.
+} pca_context;
+
+static void pca_mean_chunk(size_t from, size_t to, size_t worker, void* context) {
+    pca_context* pca = context;
+    double* sum = pca->partials[worker];
+    size_t ri, c;
+    for (ri = from; ri < to; ri++) {
+        for (c = 0; c < pca->m; c++) {
+            sum[c] += pca->data_rows[ri][c];
+        }
+    }
+}
+
+// Accumulates the sum of (x - mean) (x - mean)^T basis over the rows, an m by l matrix.
+static void pca_power_chunk(size_t from, size_t to, size_t worker, void* context) {
+    pca_context* pca = context;
+    double* sum = pca->partials[worker];
+    double* centered = malloc(sizeof(double) * pca->m);
+    double* coordinates = malloc(sizeof(double) * pca->l);
+    size_t ri, c, j;
+    for (ri = from; ri < to; ri++) {
+        for (c = 0; c < pca->m; c++) {
+            centered[c] = pca->data_rows[ri][c] - pca->mean[c];
+        }
+        memset(coordinates, 0, sizeof(double) * pca->l);
+        for (c = 0; c < pca->m; c++) {
+            for (j = 0; j < pca->l; j++) {
+                coordinates[j] += centered[c] * pca->basis[c * pca->l + j];
+            }
+        }
+        for (c = 0; c < pca->m; c++) {
+            for (j = 0; j < pca->l; j++) {
+                sum[c * pca->l + j] += centered[c] * coordinates[j];
+            }
+        }
+    }
+    free(centered);
+    free(coordinates);
+}
+
+// Accumulates the covariance of the rows within the basis, an l by l matrix.
+static void pca_covariance_chunk(size_t from, size_t to, size_t worker, void* context) {
+    pca_context* pca = context;
+    double* sum = pca->partials[worker];
+    double* coordinates = malloc(sizeof(double) * pca->l);
+    size_t ri, c, i, j;
+    for (ri = from; ri < to; ri++) {
+        memset(coordinates, 0, sizeof(double) * pca->l);
+        for (c = 0; c < pca->m; c++) {
+            double centered = pca->data_rows[ri][c] - pca->mean[c];
+            for (j = 0; j < pca->l; j++) {
+                coordinates[j] += centered * pca->basis[c * pca->l + j];
+            }
+        }
+        for (i = 0; i < pca->l; i++) {
+            for (j = 0; j < pca->l; j++) {
+                sum[i * pca->l + j] += coordinates[i] * coordinates[j];
+            }
+        }
+    }
+    free(coordinates);
+}
+
+// Run one accumulating pass and sum the per-thread results into out.
+static void pca_pass(pca_context* pca, size_t n, parallel_fn fn, size_t size, double* out) {
+    size_t threads = parallel_threads();
+    size_t t, i;
+    for (t = 0; t < threads; t++) {
+        memset(pca->partials[t], 0, sizeof(double) * size);
+    }
+    parallel_for(n, fn, pca);
+    memset(out, 0, sizeof(double) * size);
+    for (t = 0; t < threads; t++) {
+        for (i = 0; i < size; i++) {
+            out[i] += pca->partials[t][i];
+        }
+    }
+}
+
+typedef struct {
+    double** data_rows;
+    double** projected;
+    size_t m;
+    size_t d;
+    double* mean;
+    double* directions;  // m by d.
+} pca_projection;
+
+static void pca_project_chunk(size_t from, size_t to, size_t worker, void* context) {
+    pca_projection* p = context;
+    size_t ri, c, j;
+    for (ri = from; ri < to; ri++) {
+        double* out = p->projected[ri];
+        memset(out, 0, sizeof(double) * p->d);
+        for (c = 0; c < p->m; c++) {
+            double centered = p->data_rows[ri][c] - p->mean[c];
+            for (j = 0; j < p->d; j++) {
+                out[j] += centered * p->directions[c * p->d + j];
+            }
+        }
+    }
+}
+
+static double** reduce_pca(double** data_rows, size_t n, size_t m, size_t d, uint64_t* rng) {
+    size_t l = (d + PCA_OVERSAMPLING < m) ? d + PCA_OVERSAMPLING : m;
+    size_t threads = parallel_threads();
+    size_t largest = (m * l > l * l) ? m * l : l * l;
+    size_t i, j, c, t;
+
+    pca_context pca;
+    pca.data_rows = data_rows;
+    pca.m = m;
+    pca.l = l;
+    pca.mean = malloc(sizeof(double) * m);
+    pca.basis = malloc(sizeof(double) * m * l);
+    pca.partials = malloc(sizeof(double*) * threads);
+    for (t = 0; t < threads; t++) {
+        pca.partials[t] = malloc(sizeof(double) * largest);
+    }
+
+    pca_pass(&pca, n, pca_mean_chunk, m, pca.mean);
+    for (c = 0; c < m; c++) {
+        pca.mean[c] /= (double) n;
+    }
+
+    // Start from a random basis and pull it towards the leading directions of the covariance.
+    for (i = 0; i < m * l; i++) {
+        pca.basis[i] = rng_gaussian(rng);
+    }
+    orthonormalize_columns(pca.basis, m, l);
+    double* next = malloc(sizeof(double) * m * l);
+    for (i = 0; i < PCA_POWER_ITERATIONS; i++) {
+        pca_pass(&pca, n, pca_power_chunk, m * l, next);
+        orthonormalize_columns(next, m, l);
+        memcpy(pca.basis, next, sizeof(double) * m * l);
+    }
+    free(next);
+
+    // The eigenvectors of the small covariance within the basis rotate it onto the principal directions.
+    double* covariance = malloc(sizeof(double) * l * l);
+    double* values = malloc(sizeof(double) * l);
+    double* vectors = malloc(sizeof(double) * l * l);
+    pca_pass(&pca, n, pca_covariance_chunk, l * l, covariance);
+    symmetric_eigen(covariance, l, values, vectors);
+
+    pca_projection projection;
+    projection.data_rows = data_rows;
+    projection.m = m;
+    projection.d = d;
+    projection.mean = pca.mean;
+    projection.directions = calloc(m * d, sizeof(double));
+    for (c = 0; c < m; c++) {
+        for (j = 0; j < d; j++) {
+            for (i = 0; i < l; i++) {
+                projection.directions[c * d + j] += pca.basis[c * l + i] * vectors[i * l + j];
+            }
+        }
+    }
+    projection.projected = allocate_rows(n, d);
+    parallel_for(n, pca_project_chunk, &projection);
+
+    for (t = 0; t < threads; t++) {
+        free(pca.partials[t]);
+    }
+    free(pca.partials);
+    free(pca.mean);
+    free(pca.basis);
+    free(covariance);
+    free(values);
+    free(vectors);
+    free(projection.directions);
+    return projection.projected;
+}
+
+double** reduce_rows(double** data_rows, size_t n, size_t m, size_t d, reduce_method_t method) {
+    if (d == 0 || d >= m) {
+        failwithf("Cannot reduce %zu columns to %zu, the target must be between 1 and %zu!\n", m, d, m - 1);
+    }
+    uint64_t rng = rng_seed((uint64_t) time(NULL));
+    switch (method) {
+        case REDUCE_PCA:
+            return reduce_pca(data_rows, n, m, d, &rng);
+        default:
+            return reduce_jl(data_rows, n, m, d, &rng);
+    }
+}
+
+typedef struct {
+    double** data_rows;
+    size_t m;
+    size_t k;
+    double** kernels;
+    size_t* follower_count;
+    size_t* labels;
+} refine_context;
+
+static void refine_chunk(size_t from, size_t to, size_t worker, void* context) {
+    refine_context* refine = context;
+    size_t ri, ki;
+    for (ri = from; ri < to; ri++) {
+        double closest_distance = INFINITY;
+        size_t closest_kernel = refine->labels[ri];
+        for (ki = 0; ki < refine->k; ki++) {
+            if (refine->follower_count[ki] == 0) {
+                continue;
+            }
+            double distance = distf64v(refine->data_rows[ri], refine->kernels[ki], refine->m);
+            if (distance < closest_distance) {
+                closest_distance = distance;
+                closest_kernel = ki;
+            }
+        }
+        refine->labels[ri] = closest_kernel;
+    }
+}
+
+void refine_labels(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights, size_t* labels,
+        double** kernels_out) {
+    size_t ri, ki, vi;
+    double* weight_sums = calloc(k, sizeof(double));
+    refine_context refine;
+    refine.data_rows = data_rows;
+    refine.m = m;
+    refine.k = k;
+    refine.labels = labels;
+    refine.kernels = allocate_rows(k, m);
+    refine.follower_count = calloc(k, sizeof(size_t));
+    for (ki = 0; ki < k; ki++) {
+        memset(refine.kernels[ki], 0, sizeof(double) * m);
+    }
+    for (ri = 0; ri < n; ri++) {
+        double weight = (row_weights != NULL) ? row_weights[ri] : 1.0;
+        refine.follower_count[labels[ri]] += (weight > 0.0) ? 1 : 0;
+        weight_sums[labels[ri]] += weight;
+        for (vi = 0; vi < m; vi++) {
+            refine.kernels[labels[ri]][vi] += weight * data_rows[ri][vi];
+        }
+    }
+    for (ki = 0; ki < k; ki++) {
+        for (vi = 0; vi < m && refine.follower_count[ki] > 0; vi++) {
+            refine.kernels[ki][vi] /= weight_sums[ki];
+        }
+    }
+    parallel_for(n, refine_chunk, &refine);
+    for (ki = 0; ki < k && kernels_out != NULL; ki++) {
+        if (refine.follower_count[ki] > 0) {
+            memcpy(kernels_out[ki], refine.kernels[ki], sizeof(double) * m);
+        }
+    }
+    free_rows(refine.kernels, k);
+    free(refine.follower_count);
+    free(weight_sums);
+}
@@ -0,0 +1,52 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stdlib.h>
+
+/**
+ * @brief The ways rows can be projected to fewer dimensions.
+ */
+typedef enum {
+    REDUCE_JL,  // A sparse Johnson-Lindenstrauss random projection, cheap and data independent.
+    REDUCE_PCA  // Randomized principal component analysis, keeps the directions of largest variance.
+} reduce_method_t;
+
+/**
+ * @brief Project the rows of an n by m matrix to d dimensions.
+ *
+ * The work is split over the threads of the parallel-module.
+ *
+ * @param data_rows The data in an n by m matrix.
+ * @param n The amount of rows of data available.
+ * @param m The amount of columns in each row.
+ * @param d The amount of columns to project to, must be smaller than m.
+ * @param method How to project the rows.
+ *
+ * @return A newly allocated n by d matrix, free it with free_rows.
+ */
+double** reduce_rows(double** data_rows, size_t n, size_t m, size_t d, reduce_method_t method);
+
+/**
+ * @brief Recompute the kernels of a labeling in the original space and reassign every row to its closest kernel.
+ *
+ * This is a single exact Lloyd iteration, used to clean up a clustering found in a reduced space.
+ *
+ * @param row_weights The weight of each row, or NULL when all rows weigh 1.
+ * @param labels The labels (0 .. k - 1) of each row, they are updated in place.
+ * @param kernels_out Where to store the k by m kernels the rows were reassigned to, or NULL.
+ *                    A kernel without rows keeps the value it had.
+ */
+void refine_labels(double** data_rows, size_t n, size_t m, size_t k, const double* row_weights, size_t* labels,
+        double** kernels_out);
+
+/**
+ * @brief Allocate an n by m matrix as n separate rows, the same layout as the parsed data.
+ */
+double** allocate_rows(size_t n, size_t m);
+
+/**
+ * @brief Free a matrix of n rows allocated by allocate_rows.
+ */
+void free_rows(double** rows, size_t n);
+
+#endif
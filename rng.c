@@ -0,0 +1,35 @@
+#include <math.h>
+#include "rng.h"
+
+uint64_t rng_seed(uint64_t seed) {
+    // splitmix64 spreads similar seeds (e.g. consecutive timestamps or thread indices) far apart.
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (z == 0) ? 0x9E3779B97F4A7C15ULL : z;
+}
+
+uint64_t rng_next(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+double rng_uniform(uint64_t* state) {
+    // The top 53 bits fill the mantissa of a double exactly.
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+size_t rng_index(uint64_t* state, size_t n) {
+    return (size_t)(rng_uniform(state) * (double) n);
+}
+
+double rng_gaussian(uint64_t* state) {
+    double u = rng_uniform(state);
+    double v = rng_uniform(state);
+    return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v);
+}
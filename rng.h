@@ -0,0 +1,39 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * @brief A small pseudo-random number generator (xorshift64*) with explicit state.
+ *
+ * Unlike rand(), every caller owns its state, so threads can draw numbers without sharing anything.
+ * The state must never be 0, use rng_seed to initialize it.
+ */
+
+/**
+ * @brief Create a valid state from any seed, including 0.
+ */
+uint64_t rng_seed(uint64_t seed);
+
+/**
+ * @brief Draw the next 64 random bits.
+ */
+uint64_t rng_next(uint64_t* state);
+
+/**
+ * @brief Draw a uniformly distributed double in the range [0, 1).
+ */
+double rng_uniform(uint64_t* state);
+
+/**
+ * @brief Draw a uniformly distributed index in the range 0 .. n - 1.
+ */
+size_t rng_index(uint64_t* state, size_t n);
+
+/**
+ * @brief Draw a standard normally distributed double (Box-Muller).
+ */
+double rng_gaussian(uint64_t* state);
+
+#endif
@@ -0,0 +1,364 @@
+/**
+ *
+ * This module runs c_means as a resident daemon on a unix domain socket (--serve).
+ *
+ * Every connection has a reader thread, which reads jobs into the queue of the connection.
+ * Connections with queued jobs wait in a ring, a worker takes the connection at the front, runs one of its jobs,
+ * and puts the connection back at the end of the ring if it has more jobs, which shares the workers fairly
+ * between clients. The workers keep their workspace between jobs, so a warm daemon rarely allocates.
+ *
+ */
+
+#include "serve.h"
+#include "cmeans.h"
+#include "fail.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// A reader stops reading jobs when this many jobs of its connection are queued, until a worker takes one.
+#define SERVE_MAX_QUEUED 64
+// Nor does it read a job whose values would take the values of its connection's queued and running jobs past this,
+// unless none are held, so one client cannot pin more memory than this or its single largest job.
+#define SERVE_MAX_HELD_BYTES (256ull << 20)
+// How long to wait before accepting again when the process is out of file descriptors.
+#define SERVE_ACCEPT_BACKOFF_NANOSECONDS 100000000
+// A response that cannot be sent within this many seconds drops its connection, so a client that stops reading
+// holds a worker for at most this long, instead of blocking the pool.
+#define SERVE_SEND_TIMEOUT 10
+
+typedef struct connection connection;
+
+typedef struct job {
+    struct job* next;
+    connection* from;
+    serve_request request;
+    double* values;         // n * m values, then the row weights and the column weights, in one allocation.
+    double* row_weights;
+    double* column_weights;
+    size_t bytes;           // Of the values.
+} job;
+
+struct connection {
+    int fd;
+    pthread_mutex_t write_lock;
+    pthread_cond_t room;    // Signaled when a job of the connection is taken from its queue, or finished.
+    job* head;
+    job* tail;
+    size_t queued;
+    size_t held_bytes;      // The values of the queued and running jobs.
+    size_t references;      // The reader and every queued or running job.
+    bool in_ring;
+    connection* next_in_ring;
+    bool dropped;           // A response could not be sent, the remaining jobs are skipped. Guarded by the write_lock.
+};
+
+// The ring of connections with queued jobs, guarded by the lock.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static connection* ring_head = NULL;
+static connection* ring_tail = NULL;
+
+static const char* socket_path = NULL;
+
+static void stop_serving(int number) {
+    // Only async-signal-safe calls here.
+    unlink(socket_path);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Drop a reference to a connection, the last one closes and frees it. Called with the lock held.
+ */
+static void release(connection* c) {
+    c->references -= 1;
+    if (c->references == 0) {
+        close(c->fd);
+        pthread_mutex_destroy(&c->write_lock);
+        pthread_cond_destroy(&c->room);
+        free(c);
+    }
+}
+
+/**
+ * @brief Answer a job, the labels and kernels are only sent when the job succeeded.
+ */
+static void respond(connection* c, const serve_request* request, cmeans_status status, const uint64_t* labels, const double* kernels) {
+    serve_response response;
+    response.magic = SERVE_RESPONSE_MAGIC;
+    response.status = (uint32_t) status;
+    response.id = request->id;
+    response.n = request->n;
+    response.m = request->m;
+    response.k = request->k;
+    pthread_mutex_lock(&c->write_lock);
+    if (!c->dropped && (!write_exactly(c->fd, &response, sizeof(response)) || (status == CMEANS_OK
+            && (!write_exactly(c->fd, labels, sizeof(uint64_t) * request->n)
+                || !write_exactly(c->fd, kernels, sizeof(double) * request->k * request->m))))) {
+        // The client went away or stopped reading, and a partly sent response cannot be resumed.
+        // Shutting the socket down wakes its reader, which stops taking jobs from it.
+        c->dropped = true;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+/**
+ * @brief Read the jobs of a connection into its queue until the client hangs up or sends garbage.
+ */
+static void* read_jobs(void* argument) {
+    connection* c = argument;
+    serve_request request;
+    while (read_exactly(c->fd, &request, sizeof(request))) {
+        if (request.magic != SERVE_REQUEST_MAGIC || request.version != SERVE_VERSION || request.n == 0 || request.m == 0
+                || request.n > SERVE_MAX_VALUES / request.m || request.metric > CMEANS_METRIC_WEIGHTED) {
+            // The frame cannot be trusted, so neither can anything after it.
+            respond(c, &request, CMEANS_ERROR_ARGUMENT, NULL, NULL);
+            break;
+        }
+        size_t n = request.n, m = request.m;
+        size_t count = n * m + ((request.flags & SERVE_ROW_WEIGHTS) ? n : 0) + ((request.metric == CMEANS_METRIC_WEIGHTED) ? m : 0);
+        size_t bytes = sizeof(double) * count;
+        // Room is made before the values are allocated, so a client that sends faster than it is served
+        // is held back by its socket instead of by the memory of the daemon.
+        pthread_mutex_lock(&lock);
+        while (c->queued >= SERVE_MAX_QUEUED || (c->held_bytes > 0 && c->held_bytes + bytes > SERVE_MAX_HELD_BYTES)) {
+            pthread_cond_wait(&c->room, &lock);
+        }
+        c->held_bytes += bytes;
+        pthread_mutex_unlock(&lock);
+        job* j = malloc(sizeof(job));
+        j->values = malloc(bytes);
+        if (j->values == NULL || !read_exactly(c->fd, j->values, bytes)) {
+            if (j->values == NULL) {
+                respond(c, &request, CMEANS_ERROR_MEMORY, NULL, NULL);
+            }
+            free(j->values);
+            free(j);
+            pthread_mutex_lock(&lock);
+            c->held_bytes -= bytes;
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        j->bytes = bytes;
+        j->next = NULL;
+        j->from = c;
+        j->request = request;
+        double* after = j->values + n * m;
+        j->row_weights = (request.flags & SERVE_ROW_WEIGHTS) ? after : NULL;
+        after += (request.flags & SERVE_ROW_WEIGHTS) ? n : 0;
+        j->column_weights = (request.metric == CMEANS_METRIC_WEIGHTED) ? after : NULL;
+
+        pthread_mutex_lock(&lock);
+        if (c->tail != NULL) {
+            c->tail->next = j;
+        } else {
+            c->head = j;
+        }
+        c->tail = j;
+        c->queued += 1;
+        c->references += 1;
+        if (!c->in_ring) {
+            c->in_ring = true;
+            c->next_in_ring = NULL;
+            if (ring_tail != NULL) {
+                ring_tail->next_in_ring = c;
+            } else {
+                ring_head = c;
+            }
+            ring_tail = c;
+        }
+        pthread_cond_signal(&work);
+        pthread_mutex_unlock(&lock);
+    }
+    // Jobs that are still queued are answered, as far as the client still listens.
+    shutdown(c->fd, SHUT_RD);
+    pthread_mutex_lock(&lock);
+    release(c);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * @brief Take the next job, from the connection at the front of the ring. Called with the lock held.
+ */
+static job* take_job() {
+    connection* c = ring_head;
+    ring_head = c->next_in_ring;
+    if (ring_head == NULL) {
+        ring_tail = NULL;
+    }
+    job* j = c->head;
+    c->head = j->next;
+    if (c->head == NULL) {
+        c->tail = NULL;
+        c->in_ring = false;
+    } else {
+        // The connection goes to the back of the line for its next job.
+        c->next_in_ring = NULL;
+        if (ring_tail != NULL) {
+            ring_tail->next_in_ring = c;
+        } else {
+            ring_head = c;
+        }
+        ring_tail = c;
+    }
+    c->queued -= 1;
+    pthread_cond_signal(&c->room);
+    return j;
+}
+
+/**
+ * @brief Free a job that was run or skipped, which makes room for the next job of its connection.
+ */
+static void finish_job(job* j) {
+    pthread_mutex_lock(&lock);
+    j->from->held_bytes -= j->bytes;
+    pthread_cond_signal(&j->from->room);
+    release(j->from);
+    pthread_mutex_unlock(&lock);
+    free(j->values);
+    free(j);
+}
+
+/**
+ * @brief A worker of the pool, with a workspace that only grows.
+ */
+static void* run_jobs(void* argument) {
+    char* arena = NULL;
+    size_t arena_size = 0;
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (ring_head == NULL) {
+            pthread_cond_wait(&work, &lock);
+        }
+        job* j = take_job();
+        pthread_mutex_unlock(&lock);
+
+        pthread_mutex_lock(&j->from->write_lock);
+        bool dropped = j->from->dropped;
+        pthread_mutex_unlock(&j->from->write_lock);
+        if (dropped) {
+            // Nobody would read the answer.
+            finish_job(j);
+            continue;
+        }
+
+        const serve_request* request = &j->request;
+        size_t n = request->n, m = request->m, k = request->k;
+        cmeans_options options;
+        cmeans_default_options(&options, k);
+        options.metric = request->metric;
+        options.generate_kernels = (request->flags & SERVE_GENERATE_KERNELS) != 0;
+        options.seed = request->seed;
+        options.row_weights = j->row_weights;
+        options.column_weights = j->column_weights;
+
+        // The arena holds the labels, the kernels and the workspace of the clustering, in that order.
+        cmeans_status status = CMEANS_ERROR_ARGUMENT;
+        size_t workspace_size = cmeans_workspace_size(&options, n, m);
+        size_t kernels_offset = sizeof(uint64_t) * n;
+        size_t workspace_offset = (kernels_offset + sizeof(double) * k * m + 63) & ~(size_t) 63;
+        if (k > 0 && k <= n) {
+            size_t needed = workspace_offset + workspace_size;
+            if (needed > arena_size) {
+                free(arena);
+                arena_size = needed + needed / 2;
+                if (posix_memalign((void**) &arena, 64, arena_size) != 0) {
+                    arena = NULL;
+                    arena_size = 0;
+                }
+            }
+            status = (arena == NULL) ? CMEANS_ERROR_MEMORY
+                    : cmeans_cluster(&options, j->values, n, m, m, (size_t*) arena, (double*) (arena + kernels_offset),
+                            arena + workspace_offset, workspace_size);
+        } else if (k > n) {
+            status = CMEANS_ERROR_ROWS;
+        }
+        if (status == CMEANS_OK) {
+            // The labels are sent as uint64, widened in place from the back in case size_t is narrower.
+            size_t* labels = (size_t*) arena;
+            uint64_t* wire = (uint64_t*) arena;
+            size_t ri;
+            for (ri = n; ri-- > 0;) {
+                wire[ri] = (uint64_t) labels[ri];
+            }
+        }
+        respond(j->from, request, status, (uint64_t*) arena, (double*) (arena + kernels_offset));
+        finish_job(j);
+    }
+    return NULL;
+}
+
+void serve(const char* path, size_t workers) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        failwithf("The socket path '%s' is too long!\n", path);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        failwith("Could not create a unix domain socket!\n");
+    }
+    unlink(path);
+    if (bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        failwithf("Could not listen on '%s'!\n", path);
+    }
+    socket_path = path;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_serving;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t t;
+    pthread_t thread;
+    for (t = 0; t < workers; t++) {
+        if (pthread_create(&thread, NULL, run_jobs, NULL) != 0) {
+            failwith("Could not start the workers!\n");
+        }
+        pthread_detach(thread);
+    }
+    fprintf(stderr, "Serving on '%s' with %zu workers.\n", path, workers);
+
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Retrying right away would spin until a connection closes and frees a descriptor.
+                const struct timespec backoff = { 0, SERVE_ACCEPT_BACKOFF_NANOSECONDS };
+                nanosleep(&backoff, NULL);
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            failwithf("Could not accept connections on '%s'!\n", path);
+        }
+        struct timeval timeout = { SERVE_SEND_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        connection* c = calloc(1, sizeof(connection));
+        c->fd = fd;
+        c->references = 1;
+        pthread_mutex_init(&c->write_lock, NULL);
+        pthread_cond_init(&c->room, NULL);
+        if (pthread_create(&thread, NULL, read_jobs, c) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * @brief The resident mode (--serve), which clusters jobs sent over a unix domain socket.
+ *
+ * A client connects and writes any amount of jobs, each a serve_request followed by its values,
+ * and reads a serve_response (followed by the labels and kernels) per job. Responses carry the id of their job,
+ * and may come back in another order than the jobs were sent when several are queued on one connection.
+ * All numbers are in the byte order of the host, since both ends are on the same machine.
+ */
+
+#define SERVE_REQUEST_MAGIC 0x424A4D43u  // "CMJB" in memory.
+#define SERVE_RESPONSE_MAGIC 0x53524D43u // "CMRS" in memory.
+#define SERVE_VERSION 1
+
+// A job with more values than this is refused, and its connection closed, since its frame cannot be trusted.
+#define SERVE_MAX_VALUES (1ull << 28)
+
+// Flags of a serve_request.
+#define SERVE_GENERATE_KERNELS 1u // Seed at quantiles of the columns instead of at random rows.
+#define SERVE_ROW_WEIGHTS 2u      // n row weights follow the values.
+
+/**
+ * @brief The header of a job, followed by n * m values (row-major), the n row weights if SERVE_ROW_WEIGHTS is set,
+ * and m column weights if the metric is CMEANS_METRIC_WEIGHTED.
+ */
+typedef struct {
+    uint32_t magic;   // SERVE_REQUEST_MAGIC.
+    uint32_t version; // SERVE_VERSION.
+    uint64_t id;      // Chosen by the client, and echoed in the response.
+    uint64_t n;
+    uint64_t m;
+    uint64_t k;
+    uint32_t metric;  // A cmeans_metric.
+    uint32_t flags;
+    uint32_t seed;    // 0 picks one from the clock.
+    uint32_t reserved;
+} serve_request;
+
+/**
+ * @brief The header of a result, followed by n uint64 labels and k * m kernel values when the status is CMEANS_OK.
+ */
+typedef struct {
+    uint32_t magic;   // SERVE_RESPONSE_MAGIC.
+    uint32_t status;  // A cmeans_status.
+    uint64_t id;
+    uint64_t n;
+    uint64_t m;
+    uint64_t k;
+} serve_response;
+
+/**
+ * @brief Listen on a unix domain socket and cluster the jobs of every client until SIGINT or SIGTERM.
+ *
+ * Every connection gets its own queue, and the workers take jobs from the queues in turns,
+ * so a client with many queued jobs cannot starve the others. A connection stops being read while its queued
+ * jobs are too many or too large, so it cannot exhaust the memory either. Every worker keeps its workspace between jobs.
+ *
+ * @param path Where to create the socket, an existing socket there is replaced.
+ * @param workers The amount of jobs clustered at the same time.
+ */
+void serve(const char* path, size_t workers);
+
+#endif
@@ -0,0 +1,390 @@
+/**
+ *
+ * This module shares parsed rows between processes (--share), see share.h for how a segment is found.
+ *
+ * A segment is laid out as:
+ *   header    the key of the input, the publisher, the state and the amount of rows,
+ *   columns   m, the selected columns, part of the key,
+ *   values    n by m, from the first cache line after the columns,
+ *   weights   n, only when the rows were published with weights.
+ *
+ * The publisher creates the segment with O_EXCL, so exactly one process parses an input. It stores the magic last
+ * when it writes the header, and sets the state to SHARE_READY after the rows. Attaching processes wait for both.
+ *
+ * Users hold LOCK_SH on the segment until they exit, then drop it and try to take LOCK_EX without waiting.
+ * As every user drops its own lock first, the last of them gets it even when they exit at once, and unlinks
+ * the segment. The kernel drops the locks of killed processes, so an unused segment can always be told apart
+ * from one in use. A publisher that cannot publish the rows sets the state to SHARE_ABANDONED before it unlinks
+ * the segment, so the processes waiting for it parse privately right away.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "share.h"
+#include "fail.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHARE_CACHE_LINE 64
+#define SHARE_PREFIX "c_means-"
+#define SHARE_SETTINGS_LENGTH 128
+// How long a segment may stay without a header before its creator is presumed dead.
+#define SHARE_HEADER_TIMEOUT 1.0
+#define SHARE_POLL_NANOSECONDS 10000000
+
+// Values of share_header.state.
+#define SHARE_FILLING 0
+#define SHARE_READY 1
+#define SHARE_ABANDONED 2
+
+typedef struct {
+    uint32_t magic;   // SHARE_MAGIC, stored last, 0 while the header is written.
+    uint32_t version;
+    uint32_t state;   // SHARE_FILLING until the rows are published, or SHARE_ABANDONED.
+    int32_t publisher;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t modified_seconds;
+    int64_t modified_nanoseconds;
+    uint64_t m;
+    uint64_t n;
+    uint64_t weighted;
+    char settings[SHARE_SETTINGS_LENGTH];
+} share_header;
+
+struct share {
+    int fd;
+    char name[32];
+    share_header key;     // The header this input should have, without the state and the rows.
+    const uint64_t* key_columns;
+    size_t header_size;   // The header and the columns, rounded up to a cache line.
+    share_header* header; // Mapped writable for the publisher, read-only otherwise.
+    void* data;           // The whole segment, read-only, once the rows are ready.
+    size_t data_size;
+};
+
+typedef enum {
+    WAIT_READY,
+    WAIT_DEAD,     // The publisher died, the segment can be replaced.
+    WAIT_MISMATCH, // Another input with the same hash.
+    WAIT_ABANDONED // The publisher could not publish the rows.
+} wait_outcome;
+
+static uint64_t fnv1a(uint64_t hash, const void* bytes, size_t size) {
+    const unsigned char* b = bytes;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ b[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// The segment of this process, released at exit.
+static share* in_use = NULL;
+
+static size_t round_up(size_t bytes) {
+    return (bytes + SHARE_CACHE_LINE - 1) & ~((size_t) SHARE_CACHE_LINE - 1);
+}
+
+static double seconds_since(const struct timespec* start) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) (t.tv_sec - start->tv_sec) + (double) (t.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool same_key(const share* s, const share_header* header) {
+    const uint64_t* columns = (const uint64_t*) (header + 1);
+    return header->version == SHARE_VERSION && header->device == s->key.device && header->inode == s->key.inode
+        && header->size == s->key.size && header->modified_seconds == s->key.modified_seconds
+        && header->modified_nanoseconds == s->key.modified_nanoseconds && header->m == s->key.m
+        && memcmp(columns, s->key_columns, sizeof(uint64_t) * s->key.m) == 0
+        && strncmp(header->settings, s->key.settings, SHARE_SETTINGS_LENGTH) == 0;
+}
+
+/**
+ * @brief Map the whole segment read-only, once the rows are ready.
+ */
+static bool map_data(share* s) {
+    const share_header* header = s->header;
+    s->data_size = s->header_size + sizeof(double) * header->n * (header->m + (header->weighted ? 1 : 0));
+    s->data = mmap(NULL, s->data_size, PROT_READ, MAP_SHARED, s->fd, 0);
+    return s->data != MAP_FAILED;
+}
+
+/**
+ * @brief Wait until the segment of another process is ready, or its publisher is gone.
+ */
+static wait_outcome wait_ready(share* s) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    const struct timespec poll = { 0, SHARE_POLL_NANOSECONDS };
+    bool told = false;
+    while (true) {
+        struct stat info;
+        if (s->header == NULL && fstat(s->fd, &info) == 0 && (size_t) info.st_size >= s->header_size) {
+            s->header = mmap(NULL, s->header_size, PROT_READ, MAP_SHARED, s->fd, 0);
+            if (s->header == MAP_FAILED) {
+                s->header = NULL;
+                return WAIT_DEAD;
+            }
+        }
+        if (s->header == NULL || __atomic_load_n(&s->header->magic, __ATOMIC_ACQUIRE) != SHARE_MAGIC) {
+            if (seconds_since(&started) > SHARE_HEADER_TIMEOUT) {
+                return WAIT_DEAD;
+            }
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        if (!same_key(s, s->header)) {
+            return WAIT_MISMATCH;
+        }
+        uint32_t state = __atomic_load_n(&s->header->state, __ATOMIC_ACQUIRE);
+        if (state == SHARE_READY) {
+            return WAIT_READY;
+        }
+        if (state == SHARE_ABANDONED) {
+            return WAIT_ABANDONED;
+        }
+        if (kill(s->header->publisher, 0) != 0 && errno == ESRCH) {
+            return WAIT_DEAD;
+        }
+        if (!told) {
+            fprintf(stderr, "Waiting for process %d to publish the rows of the input.\n", (int) s->header->publisher);
+            told = true;
+        }
+        nanosleep(&poll, NULL);
+    }
+}
+
+static void unmap_header(share* s) {
+    if (s->header != NULL) {
+        munmap(s->header, s->header_size);
+        s->header = NULL;
+    }
+}
+
+/**
+ * @brief Create the segment and write its header, with the state SHARE_FILLING.
+ */
+static bool create(share* s) {
+    if (ftruncate(s->fd, (off_t) s->header_size) != 0) {
+        return false;
+    }
+    s->header = mmap(NULL, s->header_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->header == MAP_FAILED) {
+        s->header = NULL;
+        return false;
+    }
+    memcpy(s->header, &s->key, sizeof(share_header));
+    memcpy(s->header + 1, s->key_columns, sizeof(uint64_t) * s->key.m);
+    s->header->magic = 0;
+    s->header->state = SHARE_FILLING;
+    s->header->publisher = (int32_t) getpid();
+    __atomic_store_n(&s->header->magic, SHARE_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Whether the name still refers to the segment of a descriptor, and not to a newer one.
+ */
+static bool still_named(const char* name, int fd) {
+    struct stat named, held;
+    int named_fd = shm_open(name, O_RDONLY, 0);
+    if (named_fd < 0) {
+        return false;
+    }
+    bool same = fstat(named_fd, &named) == 0 && fstat(fd, &held) == 0
+        && named.st_dev == held.st_dev && named.st_ino == held.st_ino;
+    close(named_fd);
+    return same;
+}
+
+/**
+ * @brief Unlink the segment when no other process uses it, called at exit.
+ */
+static void release(void) {
+    // The shared lock is dropped first, had every user kept it while trying, none would get the exclusive one.
+    if (in_use != NULL && flock(in_use->fd, LOCK_UN) == 0 && flock(in_use->fd, LOCK_EX | LOCK_NB) == 0
+            && still_named(in_use->name, in_use->fd)) {
+        shm_unlink(in_use->name);
+    }
+}
+
+static void hold(share* s) {
+    flock(s->fd, LOCK_SH);
+    in_use = s;
+    atexit(release);
+}
+
+/**
+ * @brief Remove unused segments of older versions of the input (same file, other size or modification time).
+ */
+static void remove_stale(const share* s) {
+    DIR* directory = opendir("/dev/shm");
+    if (directory == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    char name[sizeof(((struct dirent*) 0)->d_name) + 1];
+    while ((entry = readdir(directory)) != NULL) {
+        if (strncmp(entry->d_name, SHARE_PREFIX, strlen(SHARE_PREFIX)) != 0 || strcmp(entry->d_name, s->name + 1) == 0) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "/%s", entry->d_name);
+        int fd = shm_open(name, O_RDONLY, 0);
+        struct stat info;
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &info) == 0 && (size_t) info.st_size >= sizeof(share_header)) {
+            share_header* header = mmap(NULL, sizeof(share_header), PROT_READ, MAP_SHARED, fd, 0);
+            if (header != MAP_FAILED) {
+                bool stale = header->magic == SHARE_MAGIC && header->device == s->key.device && header->inode == s->key.inode
+                    && (header->size != s->key.size || header->modified_seconds != s->key.modified_seconds
+                        || header->modified_nanoseconds != s->key.modified_nanoseconds);
+                if (stale && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+                    shm_unlink(name);
+                }
+                munmap(header, sizeof(share_header));
+            }
+        }
+        close(fd);
+    }
+    closedir(directory);
+}
+
+share* share_open(int fd, const size_t* columns, size_t m, const char* settings, share_role* role) {
+    *role = SHARE_UNAVAILABLE;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        fprintf(stderr, "WARNING: only a regular file on stdin can be shared (--share), the rows are parsed privately.\n");
+        return NULL;
+    }
+    if (strlen(settings) >= SHARE_SETTINGS_LENGTH) {
+        failwithf("The settings of a shared input are too long: '%s'!\n", settings);
+    }
+    share* s = calloc(1, sizeof(share));
+    s->key.version = SHARE_VERSION;
+    s->key.device = (uint64_t) info.st_dev;
+    s->key.inode = (uint64_t) info.st_ino;
+    s->key.size = (uint64_t) info.st_size;
+    s->key.modified_seconds = (int64_t) info.st_mtim.tv_sec;
+    s->key.modified_nanoseconds = (int64_t) info.st_mtim.tv_nsec;
+    s->key.m = m;
+    strcpy(s->key.settings, settings);
+    uint64_t* key_columns = malloc(sizeof(uint64_t) * (m + 1));
+    size_t ci;
+    for (ci = 0; ci < m; ci++) {
+        key_columns[ci] = columns[ci];
+    }
+    s->key_columns = key_columns;
+    s->header_size = round_up(sizeof(share_header) + sizeof(uint64_t) * m);
+
+    // The key is hashed field by field, padding would make equal keys differ.
+    uint64_t hash = 14695981039346656037ull;
+    hash = fnv1a(hash, &s->key.device, sizeof(uint64_t) * 3);
+    hash = fnv1a(hash, &s->key.modified_seconds, sizeof(int64_t) * 2);
+    hash = fnv1a(hash, key_columns, sizeof(uint64_t) * m);
+    hash = fnv1a(hash, settings, strlen(settings));
+    snprintf(s->name, sizeof(s->name), "/" SHARE_PREFIX "%016llx", (unsigned long long) hash);
+    remove_stale(s);
+
+    int attempt;
+    for (attempt = 0; attempt < 2; attempt++) {
+        s->fd = shm_open(s->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (s->fd >= 0) {
+            if (!create(s)) {
+                close(s->fd);
+                shm_unlink(s->name);
+                break;
+            }
+            hold(s);
+            *role = SHARE_PUBLISH;
+            return s;
+        }
+        if (errno != EEXIST) {
+            break;
+        }
+        s->fd = shm_open(s->name, O_RDONLY, 0);
+        if (s->fd < 0) {
+            // Removed in between, try to create it again.
+            continue;
+        }
+        // Held while waiting too, so the publisher does not remove the segment when it exits first.
+        flock(s->fd, LOCK_SH);
+        wait_outcome outcome = wait_ready(s);
+        if (outcome == WAIT_READY && map_data(s)) {
+            hold(s);
+            *role = SHARE_ATTACHED;
+            return s;
+        }
+        flock(s->fd, LOCK_UN);
+        unmap_header(s);
+        close(s->fd);
+        if (outcome != WAIT_DEAD || shm_unlink(s->name) != 0) {
+            break;
+        }
+        fprintf(stderr, "WARNING: the process publishing the shared rows died, they are published again.\n");
+    }
+    fprintf(stderr, "WARNING: could not share the rows through '/dev/shm%s', they are parsed privately.\n", s->name);
+    free(key_columns);
+    free(s);
+    return NULL;
+}
+
+bool share_publish(share* s, double** data_rows, size_t n, const double* row_weights) {
+    const size_t m = s->key.m;
+    size_t total = s->header_size + sizeof(double) * n * (m + ((row_weights != NULL) ? 1 : 0));
+    // Reserving the pages up front fails cleanly, writing to them in a full /dev/shm would raise SIGBUS.
+    char* data = (posix_fallocate(s->fd, 0, (off_t) total) == 0)
+        ? mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "WARNING: could not publish %zu rows through '/dev/shm%s', they are kept privately.\n", n, s->name);
+        // Processes waiting for the rows parse them privately as well, instead of waiting for this one to exit.
+        __atomic_store_n(&s->header->state, SHARE_ABANDONED, __ATOMIC_RELEASE);
+        shm_unlink(s->name);
+        // The name may soon belong to another publisher.
+        in_use = NULL;
+        return false;
+    }
+    double* values = (double*) (data + s->header_size);
+    size_t ri;
+    for (ri = 0; ri < n; ri++) {
+        memcpy(values + ri * m, data_rows[ri], sizeof(double) * m);
+    }
+    if (row_weights != NULL) {
+        memcpy(values + n * m, row_weights, sizeof(double) * n);
+    }
+    munmap(data, total);
+    s->header->n = n;
+    s->header->weighted = (row_weights != NULL) ? 1 : 0;
+    __atomic_store_n(&s->header->state, SHARE_READY, __ATOMIC_RELEASE);
+    if (!map_data(s)) {
+        failwithf("Could not map the rows just published through '/dev/shm%s'!\n", s->name);
+    }
+    return true;
+}
+
+double** share_rows(const share* s, size_t* n, const double** row_weights) {
+    const share_header* header = s->header;
+    const size_t m = header->m;
+    double* values = (double*) ((char*) s->data + s->header_size);
+    double** rows = malloc(sizeof(double*) * (header->n + 1));
+    size_t ri;
+    for (ri = 0; ri < header->n; ri++) {
+        rows[ri] = values + ri * m;
+    }
+    *n = header->n;
+    *row_weights = header->weighted ? values + header->n * m : NULL;
+    return rows;
+}
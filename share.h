@@ -0,0 +1,72 @@
+#ifndef SHARE_H
+#define SHARE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Parsed rows shared read-only between c_means processes through POSIX shared memory (--share).
+ *
+ * The segment of an input is named after a hash of its key: the device, inode, size and modification time of the file,
+ * the selected columns and a description of everything else that changes the parsed rows (separators, header, weights).
+ * The first process to create the segment parses the input as usual and publishes the rows, processes that start
+ * while it is in use attach to them read-only and skip parsing, so the rows are in physical memory once. A process
+ * that attaches while the rows are still being published waits for them, unless the publisher died, in which case
+ * the segment is replaced.
+ *
+ * Every process using a segment holds a shared flock on it, and the last one to exit removes it, so the rows only
+ * take memory while they are used. A changed input gets a new key, and segments left behind by killed processes
+ * for an older version of the same file are removed when it is opened again.
+ */
+
+#define SHARE_MAGIC 0x52414853u // "SHAR" in memory.
+#define SHARE_VERSION 1
+
+typedef enum {
+    SHARE_UNAVAILABLE, // Nothing is shared, parse the input as usual.
+    SHARE_ATTACHED,    // The rows were published by another process, see share_rows.
+    SHARE_PUBLISH      // This process parses the input, and must publish the rows with share_publish.
+} share_role;
+
+typedef struct share share;
+
+/**
+ * @brief Attach to the rows of an input, or become the process that publishes them.
+ *
+ * @param fd The input, which must be a regular file (e.g. stdin redirected from one), otherwise nothing is shared.
+ * @param columns The m selected columns.
+ * @param m The amount of selected columns.
+ * @param settings Everything else that changes the parsed rows, as text.
+ * @param role Where to store what the caller should do next, see share_role.
+ *
+ * @return The segment, or NULL when the role is SHARE_UNAVAILABLE.
+ */
+share* share_open(int fd, const size_t* columns, size_t m, const char* settings, share_role* role);
+
+/**
+ * @brief Copy the parsed rows into the segment and mark them ready, after which share_rows returns them.
+ *
+ * Failing to publish (e.g. a full /dev/shm) only removes the segment with a warning.
+ *
+ * @param s A segment opened with the role SHARE_PUBLISH.
+ * @param data_rows The n by m parsed rows.
+ * @param n The amount of rows.
+ * @param row_weights The weight of each row, or NULL.
+ *
+ * @return Whether the rows were published.
+ */
+bool share_publish(share* s, double** data_rows, size_t n, const double* row_weights);
+
+/**
+ * @brief The read-only rows of a segment that was attached to or published.
+ *
+ * @param s The segment.
+ * @param n Where to store the amount of rows.
+ * @param row_weights Where to store the read-only weights of the rows, or NULL when the rows were published without.
+ *
+ * @return Pointers to the rows, free only the array with free().
+ */
+double** share_rows(const share* s, size_t* n, const double** row_weights);
+
+#endif
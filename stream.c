@@ -0,0 +1,189 @@
+/**
+ *
+ * This module clusters an unbounded stream of rows with online k-means (MacQueen's update with forgetting).
+ *
+ * With decay, a kernel is a running weighted mean: its weight is shrunk for every row, and a row of weight w
+ * moves its kernel by w / weight of the way towards itself.
+ * With a window, every kernel keeps the sums of the window rows it labeled, and a ring buffer remembers
+ * which rows (and labels) are to be taken out again. The sums are recomputed from the ring whenever it wraps,
+ * so rounding errors of the subtractions cannot pile up.
+ *
+ */
+
+#include "stream.h"
+#include "fail.h"
+#include <math.h>
+#include <string.h>
+
+struct stream_state {
+    size_t k;
+    size_t m;
+    double decay;
+    size_t rows;       // The amount of rows seen.
+    double* kernels;   // k by m.
+    double* weights;   // The (decayed) weight of each kernel.
+    // The window, NULL without one.
+    size_t window;
+    double* sums;      // k by m, the weighted sums of the rows in the window per kernel.
+    double* ring;      // window by m.
+    double* ring_weights;
+    size_t* ring_labels;
+    size_t head;       // The next slot of the ring to fill.
+};
+
+stream_state* stream_create(size_t k, size_t m, double decay, size_t window) {
+    if (!(decay > 0.0 && decay <= 1.0)) {
+        failwithf("The decay must be within (0, 1], got %lf!\n", decay);
+    }
+    if (window > 0 && window < k) {
+        failwithf("A window of %zu rows cannot hold %zu kernels!\n", window, k);
+    }
+    stream_state* state = malloc(sizeof(stream_state));
+    state->k = k;
+    state->m = m;
+    state->decay = decay;
+    state->rows = 0;
+    state->kernels = calloc(k * m, sizeof(double));
+    state->weights = calloc(k, sizeof(double));
+    state->window = window;
+    state->sums = NULL;
+    state->ring = NULL;
+    state->ring_weights = NULL;
+    state->ring_labels = NULL;
+    state->head = 0;
+    if (window > 0) {
+        state->sums = calloc(k * m, sizeof(double));
+        state->ring = malloc(sizeof(double) * window * m);
+        state->ring_weights = malloc(sizeof(double) * window);
+        state->ring_labels = malloc(sizeof(size_t) * window);
+    }
+    return state;
+}
+
+static size_t closest_kernel(stream_state* state, const double* row) {
+    size_t ki, vi, closest = 0;
+    double closest_distance = INFINITY;
+    for (ki = 0; ki < state->k; ki++) {
+        const double* kernel = state->kernels + ki * state->m;
+        double distance = 0.0;
+        for (vi = 0; vi < state->m; vi++) {
+            distance += (row[vi] - kernel[vi]) * (row[vi] - kernel[vi]);
+        }
+        if (distance < closest_distance) {
+            closest_distance = distance;
+            closest = ki;
+        }
+    }
+    return closest;
+}
+
+/**
+ * @brief Move a kernel of the window to the mean of its rows, a kernel without rows stays where it is.
+ */
+static void window_kernel(stream_state* state, size_t ki) {
+    size_t vi;
+    if (state->weights[ki] <= 0.0) {
+        return;
+    }
+    for (vi = 0; vi < state->m; vi++) {
+        state->kernels[ki * state->m + vi] = state->sums[ki * state->m + vi] / state->weights[ki];
+    }
+}
+
+static void window_update(stream_state* state, const double* row, double weight, size_t label) {
+    size_t m = state->m;
+    size_t vi, ki, si;
+    double* slot = state->ring + state->head * m;
+    if (state->rows > state->window) {
+        // The ring is full, the oldest row leaves the window.
+        size_t old = state->ring_labels[state->head];
+        double old_weight = state->ring_weights[state->head];
+        state->weights[old] -= old_weight;
+        for (vi = 0; vi < m; vi++) {
+            state->sums[old * m + vi] -= old_weight * slot[vi];
+        }
+        window_kernel(state, old);
+    }
+    memcpy(slot, row, sizeof(double) * m);
+    state->ring_weights[state->head] = weight;
+    state->ring_labels[state->head] = label;
+    state->weights[label] += weight;
+    for (vi = 0; vi < m; vi++) {
+        state->sums[label * m + vi] += weight * row[vi];
+    }
+    state->head = (state->head + 1) % state->window;
+
+    if (state->head == 0) {
+        memset(state->sums, 0, sizeof(double) * state->k * m);
+        memset(state->weights, 0, sizeof(double) * state->k);
+        for (si = 0; si < state->window; si++) {
+            size_t owner = state->ring_labels[si];
+            state->weights[owner] += state->ring_weights[si];
+            for (vi = 0; vi < m; vi++) {
+                state->sums[owner * m + vi] += state->ring_weights[si] * state->ring[si * m + vi];
+            }
+        }
+        for (ki = 0; ki < state->k; ki++) {
+            window_kernel(state, ki);
+        }
+    } else {
+        window_kernel(state, label);
+    }
+}
+
+size_t stream_update(stream_state* state, const double* row, double weight) {
+    size_t m = state->m;
+    size_t ki, vi, label;
+    state->rows += 1;
+    if (state->rows <= state->k) {
+        // Seeding, the first k rows are the kernels.
+        label = state->rows - 1;
+        memcpy(state->kernels + label * m, row, sizeof(double) * m);
+    } else {
+        label = closest_kernel(state, row);
+    }
+
+    if (state->window > 0) {
+        window_update(state, row, weight, label);
+        return label;
+    }
+    if (state->decay < 1.0) {
+        for (ki = 0; ki < state->k; ki++) {
+            state->weights[ki] *= state->decay;
+        }
+    }
+    state->weights[label] += weight;
+    if (state->weights[label] > 0.0) {
+        double step = weight / state->weights[label];
+        double* kernel = state->kernels + label * m;
+        for (vi = 0; vi < m; vi++) {
+            kernel[vi] += step * (row[vi] - kernel[vi]);
+        }
+    }
+    return label;
+}
+
+size_t stream_rows(stream_state* state) {
+    return state->rows;
+}
+
+void stream_print_kernels(stream_state* state, FILE* out, const char* separator) {
+    size_t ki, vi;
+    for (ki = 0; ki < state->k; ki++) {
+        for (vi = 0; vi < state->m; vi++) {
+            fprintf(out, "%s%lf", (vi == 0) ? "" : separator, state->kernels[ki * state->m + vi]);
+        }
+        fprintf(out, "\n");
+    }
+    fflush(out);
+}
+
+void stream_free(stream_state* state) {
+    free(state->kernels);
+    free(state->weights);
+    free(state->sums);
+    free(state->ring);
+    free(state->ring_weights);
+    free(state->ring_labels);
+    free(state);
+}
@@ -0,0 +1,50 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief The state of a streaming (online) k-means clustering, which labels rows one at a time as they arrive.
+ *
+ * The first k rows become the kernels. Every following row is labeled by its closest kernel,
+ * and that kernel is moved towards it. Old rows are forgotten in one of two ways, so the kernels follow drifting data:
+ * with exponential decay, every weight shrinks by a factor per row,
+ * with a window, only the latest rows count and the oldest row is taken out again when a new one arrives.
+ * Either way the memory and the work per row do not depend on the amount of rows seen.
+ */
+typedef struct stream_state stream_state;
+
+/**
+ * @brief Create the state of a streaming clustering.
+ *
+ * @param k The amount of kernels.
+ * @param m The amount of columns in each row.
+ * @param decay The factor (0 .. 1] that the weight of the seen rows shrinks by per row, 1 never forgets.
+ * @param window When greater than 0, only the latest window rows count and decay is ignored.
+ */
+stream_state* stream_create(size_t k, size_t m, double decay, size_t window);
+
+/**
+ * @brief Label a row and move its kernel towards it.
+ *
+ * @return The kernel (0 .. k - 1) of the row.
+ */
+size_t stream_update(stream_state* state, const double* row, double weight);
+
+/**
+ * @brief The amount of rows seen so far.
+ */
+size_t stream_rows(stream_state* state);
+
+/**
+ * @brief Print the current kernels, one line per kernel with the columns split by separator.
+ */
+void stream_print_kernels(stream_state* state, FILE* out, const char* separator);
+
+/**
+ * @brief Free the state.
+ */
+void stream_free(stream_state* state);
+
+#endif
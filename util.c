@@ -2,6 +2,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 /**
  * @brief Checks if a char exists in a string.
@@ -27,3 +30,39 @@ void char_replace(char* string, char before, char after) {
     }
 }
 
+
+bool read_exactly(int fd, void* buffer, size_t size) {
+    char* at = buffer;
+    while (size > 0) {
+        ssize_t got = read(fd, at, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        at += got;
+        size -= (size_t) got;
+    }
+    return true;
+}
+
+bool write_exactly(int fd, const void* buffer, size_t size) {
+    const char* at = buffer;
+    while (size > 0) {
+        // send only works on sockets, everything else is written plainly.
+        ssize_t put = send(fd, at, size, MSG_NOSIGNAL);
+        if (put < 0 && errno == ENOTSOCK) {
+            put = write(fd, at, size);
+        }
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return false;
+        }
+        at += put;
+        size -= (size_t) put;
+    }
+    return true;
+}
@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 /**
  * @brief Checks if a char exists in a string.
@@ -22,4 +23,20 @@ bool char_in_string(char* string, char character);
  */
 void char_replace(char* string, char before, char after);
 
+/**
+ * @brief Read exactly size bytes from a file descriptor (e.g. a socket), retrying short and interrupted reads.
+ *
+ * @return Whether all bytes were read, false on end of file or an error.
+ */
+bool read_exactly(int fd, void* buffer, size_t size);
+
+/**
+ * @brief Write exactly size bytes to a file descriptor, retrying short and interrupted writes.
+ *
+ * Writing to a socket that was closed by its peer fails instead of raising SIGPIPE.
+ *
+ * @return Whether all bytes were written.
+ */
+bool write_exactly(int fd, const void* buffer, size_t size);
+
 #endif